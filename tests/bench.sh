@@ -0,0 +1,52 @@
+#! /bin/bash
+
+#
+# Performance benchmarks. These don't fail, they print numbers to compare
+# between builds.
+#
+
+function bench_dispatch_latency {
+	echo "Dispatch latency (add_work until the job starts).."
+	gcc -O2 $COMPILATION_FLAGS bench/dispatch_latency.c ../thpool.c -pthread -o bench_test
+	for threads in 1 4; do
+		for gap_us in 0 5 50; do
+			./bench_test $threads 20000 $gap_us
+		done
+	done
+	rm -f bench_test
+}
+
+function bench_create_destroy {
+	echo "Pool create and destroy latency.."
+	gcc -O2 $COMPILATION_FLAGS bench/create_destroy.c ../thpool.c -pthread -o bench_test
+	for threads in 1 4 32; do
+		./bench_test $threads 200
+	done
+	rm -f bench_test
+}
+
+# Powers of two from 1 up to $1, and $1 itself
+function pow2_list {
+	local list=1 n=2
+	while [ $n -lt $1 ]; do list="$list,$n"; n=$((n * 2)); done
+	[ $1 -gt 1 ] && list="$list,$1"
+	echo $list
+}
+
+# Export BENCH_FORMAT=json for JSON, BENCH_OUT=file to keep the results
+function bench_suite {
+	echo "Throughput, end-to-end latency, wait and destroy cost.."
+	gcc -O2 $COMPILATION_FLAGS bench/suite.c ../thpool.c -pthread -o bench_test
+	./bench_test --workers $(pow2_list ${BENCH_MAX_WORKERS:-$(nproc)}) \
+	             --producers $(pow2_list ${BENCH_MAX_PRODUCERS:-4}) \
+	             --job-us 0,1,10,100 \
+	             --format ${BENCH_FORMAT:-csv} > ${BENCH_OUT:-/dev/stdout}
+	rm -f bench_test
+}
+
+
+
+# Run benchmarks
+bench_dispatch_latency
+bench_create_destroy
+bench_suite
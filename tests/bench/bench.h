@@ -0,0 +1,24 @@
+/*
+ * What the benchmarks share: a monotonic clock in nanoseconds and the
+ * comparison qsort() needs to sort samples for percentiles.
+ */
+#ifndef _THPOOL_BENCH_
+#define _THPOOL_BENCH_
+
+#include <time.h>
+
+
+static inline long long now_ns(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+static inline int cmp_ll(const void* a, const void* b){
+	long long x = *(const long long*)a;
+	long long y = *(const long long*)b;
+	return (x > y) - (x < y);
+}
+
+#endif
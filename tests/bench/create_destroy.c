@@ -0,0 +1,69 @@
+/*
+ * Measures how long it takes to create a pool and to destroy it again,
+ * with no work in between.  Both should cost about what creating and
+ * joining the threads themselves does, which is printed alongside.
+ *
+ * Usage: ./bench [threads] [rounds]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "../../thpool.h"
+#include "bench.h"
+
+
+static void* do_nothing(void* arg){
+	return arg;
+}
+
+
+int main(int argc, char *argv[]){
+
+	int num_threads = argc > 1 ? atoi(argv[1]) : 4;
+	int rounds      = argc > 2 ? atoi(argv[2]) : 200;
+
+	long long* create_ns  = malloc(rounds * sizeof(long long));
+	long long* destroy_ns = malloc(rounds * sizeof(long long));
+	long long* raw_ns     = malloc(rounds * sizeof(long long));
+	pthread_t* pthreads   = malloc(num_threads * sizeof(pthread_t));
+	if (create_ns == NULL || destroy_ns == NULL || raw_ns == NULL || pthreads == NULL ||
+	    rounds < 1 || num_threads < 1){
+		return 1;
+	}
+
+	int n, t;
+	for (n = 0; n < rounds; n++){
+		long long start = now_ns();
+		threadpool thpool = thpool_init(num_threads);
+		long long created = now_ns();
+		thpool_destroy(thpool);
+		long long destroyed = now_ns();
+		create_ns[n]  = created - start;
+		destroy_ns[n] = destroyed - created;
+
+		/* The floor: bare pthread_create() and pthread_join() */
+		start = now_ns();
+		for (t = 0; t < num_threads; t++){
+			pthread_create(&pthreads[t], NULL, do_nothing, NULL);
+		}
+		for (t = 0; t < num_threads; t++){
+			pthread_join(pthreads[t], NULL);
+		}
+		raw_ns[n] = now_ns() - start;
+	}
+
+	qsort(create_ns,  rounds, sizeof(long long), cmp_ll);
+	qsort(destroy_ns, rounds, sizeof(long long), cmp_ll);
+	qsort(raw_ns,     rounds, sizeof(long long), cmp_ll);
+	printf("threads=%d rounds=%d create_p50_us=%lld destroy_p50_us=%lld create_p99_us=%lld destroy_p99_us=%lld pthread_create_join_p50_us=%lld\n",
+	       num_threads, rounds,
+	       create_ns[rounds / 2] / 1000, destroy_ns[rounds / 2] / 1000,
+	       create_ns[(int)(rounds * 0.99)] / 1000, destroy_ns[(int)(rounds * 0.99)] / 1000,
+	       raw_ns[rounds / 2] / 1000);
+
+	free(pthreads);
+	free(raw_ns);
+	free(destroy_ns);
+	free(create_ns);
+	return 0;
+}
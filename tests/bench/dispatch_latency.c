@@ -0,0 +1,60 @@
+/*
+ * Measures dispatch latency: time from thpool_add_work() until the job
+ * starts running on a worker.
+ *
+ * Jobs are added one at a time with a short pause in between, so workers
+ * are idle each time a job arrives and their idle loop is what is being
+ * measured.
+ *
+ * Usage: ./bench [threads] [samples] [gap_us]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "../../thpool.h"
+#include "bench.h"
+
+
+static int stamp(void* arg){
+	*(long long*)arg = now_ns();
+	return 0;
+}
+
+
+int main(int argc, char *argv[]){
+
+	int num_threads = argc > 1 ? atoi(argv[1]) : 4;
+	int samples     = argc > 2 ? atoi(argv[2]) : 20000;
+	int gap_us      = argc > 3 ? atoi(argv[3]) : 5;
+
+	long long* latency = malloc(samples * sizeof(long long));
+	if (latency == NULL || samples < 1){
+		return 1;
+	}
+
+	threadpool thpool = thpool_init(num_threads);
+	long long started;
+	int result;
+	int n;
+	for (n = 0; n < samples; n++){
+		long long until = now_ns() + gap_us * 1000LL;
+		while (now_ns() < until);
+
+		long long added = now_ns();
+		thpool_add_work(thpool, n, stamp, &started);
+		if (thpool_wait_result(thpool, n, -1, &result) != 0){
+			return 1;
+		}
+		latency[n] = started - added;
+	}
+	thpool_destroy(thpool);
+
+	qsort(latency, samples, sizeof(long long), cmp_ll);
+	printf("threads=%d samples=%d gap_us=%d p50_ns=%lld p99_ns=%lld p999_ns=%lld\n",
+	       num_threads, samples, gap_us,
+	       latency[samples / 2],
+	       latency[(int)(samples * 0.99)],
+	       latency[(int)(samples * 0.999)]);
+
+	free(latency);
+	return 0;
+}
@@ -0,0 +1,290 @@
+/*
+ * Benchmark suite: submit throughput, end-to-end latency and the cost of
+ * thpool_wait() and thpool_destroy(), over a matrix of worker counts,
+ * job sizes and producer counts.  Prints one row per combination as CSV
+ * or JSON, so runs of different builds can be diffed or plotted.
+ *
+ * For each combination:
+ *   throughput   producers add jobs as fast as they can while the main
+ *                thread collects the results; submit_per_s counts only
+ *                the adding, done_per_s the whole trip until collected
+ *   latency      each producer adds one job and waits for its result
+ *                (thpool_wait_result), over and over; percentiles of
+ *                the time from add to result in hand
+ *   wait         thpool_wait() called right after adding WAIT_BATCH jobs,
+ *                until they are all done: the drain plus waking the
+ *                waiter, median of 100 rounds
+ *   destroy      thpool_destroy() of the idle pool
+ *
+ * Usage: ./bench [--workers 1,2,4] [--job-us 0,1,10,100] [--producers 1,2]
+ *                [--jobs 20000] [--samples 2000] [--format csv|json]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "../../thpool.h"
+#include "bench.h"
+
+#define MAX_LIST                    16
+#define TRIP_BUDGET_NS              200000000LL  /* job time per worker per run */
+#define WAIT_BATCH                  64           /* jobs each timed wait drains */
+#define WAIT_ROUNDS                 100
+
+
+typedef struct bench_run{
+	threadpool thpool;
+	int        num_producers;
+	int        jobs_per_producer;
+	long long  job_ns;
+	pthread_barrier_t start;
+	long long* add_ns;                   /* per producer, adding only */
+	long long* latency_ns;               /* per sample, add to result */
+} bench_run;
+
+typedef struct producer{
+	bench_run* run_p;
+	int        id;
+} producer;
+
+
+/* The job: busy for job_ns, the way a short CPU bound task would be */
+static int spin_job(void* arg){
+	long long job_ns = *(long long*)arg;
+	if (job_ns > 0){
+		long long until = now_ns() + job_ns;
+		while (now_ns() < until);
+	}
+	return 0;
+}
+
+
+/* Parse "1,2,4" into list, return number of entries */
+static int parse_list(const char* str, int list[]){
+	int n = 0;
+	while (*str && n < MAX_LIST){
+		list[n++] = atoi(str);
+		str = strchr(str, ',');
+		if (str == NULL){
+			break;
+		}
+		str++;
+	}
+	return n;
+}
+
+
+static void* produce_jobs(void* arg){
+	producer* producer_p = (producer*)arg;
+	bench_run* run_p = producer_p->run_p;
+	int first = producer_p->id * run_p->jobs_per_producer;
+	int n;
+
+	pthread_barrier_wait(&run_p->start);
+	long long start = now_ns();
+	for (n = 0; n < run_p->jobs_per_producer; n++){
+		thpool_add_work(run_p->thpool, first + n, spin_job, &run_p->job_ns);
+	}
+	run_p->add_ns[producer_p->id] = now_ns() - start;
+	return NULL;
+}
+
+
+static void* produce_samples(void* arg){
+	producer* producer_p = (producer*)arg;
+	bench_run* run_p = producer_p->run_p;
+	int first = producer_p->id * run_p->jobs_per_producer;
+	int result;
+	int n;
+
+	pthread_barrier_wait(&run_p->start);
+	for (n = 0; n < run_p->jobs_per_producer; n++){
+		long long added = now_ns();
+		thpool_add_work(run_p->thpool, first + n, spin_job, &run_p->job_ns);
+		thpool_wait_result(run_p->thpool, first + n, -1, &result);
+		run_p->latency_ns[first + n] = now_ns() - added;
+	}
+	return NULL;
+}
+
+
+/* Start the producers, with the calling thread joining in at the
+ * barrier, and return once the caller may go on */
+static void start_producers(bench_run* run_p, pthread_t* pthreads, producer* producers, void* (*func_p)(void*)){
+	int n;
+	pthread_barrier_init(&run_p->start, NULL, run_p->num_producers + 1);
+	for (n = 0; n < run_p->num_producers; n++){
+		producers[n].run_p = run_p;
+		producers[n].id    = n;
+		pthread_create(&pthreads[n], NULL, func_p, &producers[n]);
+	}
+	pthread_barrier_wait(&run_p->start);
+}
+
+
+static void join_producers(bench_run* run_p, pthread_t* pthreads){
+	int n;
+	for (n = 0; n < run_p->num_producers; n++){
+		pthread_join(pthreads[n], NULL);
+	}
+	pthread_barrier_destroy(&run_p->start);
+}
+
+
+static void print_row(const char* format, int first, int workers, int producers, int job_us, int jobs,
+                      double submit_per_s, double done_per_s, const long long* latency_ns, int samples,
+                      long long wait_ns, long long destroy_ns){
+	long long p50  = latency_ns[samples / 2];
+	long long p99  = latency_ns[(int)(samples * 0.99)];
+	long long p999 = latency_ns[(int)(samples * 0.999)];
+
+	if (strcmp(format, "json") == 0){
+		printf("%s\n  {\"workers\": %d, \"producers\": %d, \"job_us\": %d, \"jobs\": %d, "
+		       "\"submit_per_s\": %.0f, \"done_per_s\": %.0f, "
+		       "\"latency_p50_ns\": %lld, \"latency_p99_ns\": %lld, \"latency_p999_ns\": %lld, "
+		       "\"wait_ns\": %lld, \"destroy_ns\": %lld}",
+		       first ? "[" : ",", workers, producers, job_us, jobs, submit_per_s, done_per_s,
+		       p50, p99, p999, wait_ns, destroy_ns);
+	}
+	else{
+		if (first){
+			printf("workers,producers,job_us,jobs,submit_per_s,done_per_s,"
+			       "latency_p50_ns,latency_p99_ns,latency_p999_ns,wait_ns,destroy_ns\n");
+		}
+		printf("%d,%d,%d,%d,%.0f,%.0f,%lld,%lld,%lld,%lld,%lld\n",
+		       workers, producers, job_us, jobs, submit_per_s, done_per_s,
+		       p50, p99, p999, wait_ns, destroy_ns);
+	}
+	fflush(stdout);
+}
+
+
+int main(int argc, char *argv[]){
+
+	int workers[MAX_LIST]   = { 1, 2, 4 };
+	int job_us[MAX_LIST]    = { 0, 1, 10, 100 };
+	int producers[MAX_LIST] = { 1, 2 };
+	int num_workers = 3, num_job_us = 4, num_producers = 2;
+	int max_jobs    = 20000;
+	int max_samples = 2000;
+	const char* format = "csv";
+
+	int n;
+	for (n = 1; n + 1 < argc; n += 2){
+		if (strcmp(argv[n], "--workers") == 0)        num_workers   = parse_list(argv[n + 1], workers);
+		else if (strcmp(argv[n], "--job-us") == 0)    num_job_us    = parse_list(argv[n + 1], job_us);
+		else if (strcmp(argv[n], "--producers") == 0) num_producers = parse_list(argv[n + 1], producers);
+		else if (strcmp(argv[n], "--jobs") == 0)      max_jobs      = atoi(argv[n + 1]);
+		else if (strcmp(argv[n], "--samples") == 0)   max_samples   = atoi(argv[n + 1]);
+		else if (strcmp(argv[n], "--format") == 0)    format        = argv[n + 1];
+		else{
+			fprintf(stderr, "Unknown option %s\n", argv[n]);
+			return 1;
+		}
+	}
+	if (max_jobs < 1 || max_samples < 1){
+		return 1;
+	}
+
+	int first = 1;
+	int w, s, p;
+	for (w = 0; w < num_workers; w++){
+		for (s = 0; s < num_job_us; s++){
+			for (p = 0; p < num_producers; p++){
+				bench_run run;
+				run.num_producers = producers[p] > 0 ? producers[p] : 1;
+				run.job_ns        = job_us[s] * 1000LL;
+
+				/* Long jobs get fewer of them, so every run takes about as long */
+				int jobs    = max_jobs;
+				int samples = max_samples;
+				if (run.job_ns > 0 && TRIP_BUDGET_NS * workers[w] / run.job_ns < jobs){
+					jobs = (int)(TRIP_BUDGET_NS * workers[w] / run.job_ns);
+				}
+				if (run.job_ns > 0 && TRIP_BUDGET_NS / run.job_ns < samples){
+					samples = (int)(TRIP_BUDGET_NS / run.job_ns);
+				}
+				if (jobs < run.num_producers)    jobs    = run.num_producers;
+				if (samples < run.num_producers) samples = run.num_producers;
+
+				pthread_t* pthreads = malloc(run.num_producers * sizeof(pthread_t));
+				producer*  prods    = malloc(run.num_producers * sizeof(producer));
+				int*       uuids    = malloc(jobs * sizeof(int));
+				int*       results  = malloc(jobs * sizeof(int));
+				long long  waits[WAIT_ROUNDS];
+				int        wait_uuids[WAIT_BATCH];
+				int        wait_results[WAIT_BATCH];
+				run.add_ns     = malloc(run.num_producers * sizeof(long long));
+				run.latency_ns = malloc(samples * sizeof(long long));
+				if (pthreads == NULL || prods == NULL || uuids == NULL || results == NULL ||
+				    run.add_ns == NULL || run.latency_ns == NULL){
+					return 1;
+				}
+
+				run.thpool = thpool_init(workers[w]);
+				if (run.thpool == NULL){
+					return 1;
+				}
+
+				/* Throughput */
+				run.jobs_per_producer = jobs / run.num_producers;
+				jobs = run.jobs_per_producer * run.num_producers;
+				start_producers(&run, pthreads, prods, produce_jobs);
+				long long start = now_ns();
+				int collected = 0;
+				while (collected < jobs){
+					collected += thpool_collect_results(run.thpool, jobs - collected, uuids, results, -1);
+				}
+				long long done = now_ns() - start;
+				join_producers(&run, pthreads);
+				long long add_ns = 0;
+				for (n = 0; n < run.num_producers; n++){
+					if (run.add_ns[n] > add_ns){
+						add_ns = run.add_ns[n];
+					}
+				}
+
+				/* Latency */
+				run.jobs_per_producer = samples / run.num_producers;
+				samples = run.jobs_per_producer * run.num_producers;
+				start_producers(&run, pthreads, prods, produce_samples);
+				join_producers(&run, pthreads);
+				qsort(run.latency_ns, samples, sizeof(long long), cmp_ll);
+
+				/* Wait, on a pool with a batch to drain, and destroy */
+				for (n = 0; n < WAIT_ROUNDS; n++){
+					int k;
+					for (k = 0; k < WAIT_BATCH; k++){
+						thpool_add_work(run.thpool, k, spin_job, &run.job_ns);
+					}
+					long long before = now_ns();
+					thpool_wait(run.thpool);
+					waits[n] = now_ns() - before;
+					for (k = 0; k < WAIT_BATCH; ){
+						k += thpool_collect_results(run.thpool, WAIT_BATCH - k, wait_uuids, wait_results, -1);
+					}
+				}
+				qsort(waits, WAIT_ROUNDS, sizeof(long long), cmp_ll);
+				long long before = now_ns();
+				thpool_destroy(run.thpool);
+				long long destroy_ns = now_ns() - before;
+
+				print_row(format, first, workers[w], run.num_producers, job_us[s], jobs,
+				          jobs * 1e9 / (add_ns > 0 ? add_ns : 1), jobs * 1e9 / (done > 0 ? done : 1),
+				          run.latency_ns, samples, waits[WAIT_ROUNDS / 2], destroy_ns);
+				first = 0;
+
+				free(run.latency_ns);
+				free(run.add_ns);
+				free(results);
+				free(uuids);
+				free(prods);
+				free(pthreads);
+			}
+		}
+	}
+	if (strcmp(format, "json") == 0 && !first){
+		printf("\n]\n");
+	}
+	return 0;
+}
@@ -2,6 +2,12 @@
 #include <unistd.h>
 #include <time.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <string.h>
 #include "../../thpool.h"
 
 
@@ -11,6 +17,82 @@ void sleep_2_secs(){
 }
 
 
+int return_arg(void* arg){
+	return (int)(intptr_t)arg;
+}
+
+
+threadpool nested_thpool;
+
+int add_nested(void* arg){
+	return thpool_add_work(nested_thpool, 100 + (int)(intptr_t)arg, return_arg, arg);
+}
+
+
+atomic_int gate_open;
+
+int wait_for_gate(void* arg){
+	while (!atomic_load(&gate_open))
+		usleep(1000);
+	return (int)(intptr_t)arg;
+}
+
+
+atomic_int done_sum;
+
+void add_to_done_sum(int job_uuid, int result, void* done_arg){
+	atomic_fetch_add(&done_sum, job_uuid + result + (int)(intptr_t)done_arg);
+}
+
+
+atomic_int run_count;
+int run_order[64];
+
+int record_order(void* arg){
+	run_order[atomic_fetch_add(&run_count, 1)] = (int)(intptr_t)arg;
+	return 0;
+}
+
+
+int count_run(void* arg){
+	atomic_fetch_add(&run_count, 1);
+	usleep(100);
+	return (int)(intptr_t)arg;
+}
+
+
+atomic_int key_busy[8];
+int key_next[8];
+atomic_int key_errors;
+
+int run_keyed(void* arg){
+	int key = (int)(intptr_t)arg / 1000, seq = (int)(intptr_t)arg % 1000;
+	int idle = 0;
+	if (!atomic_compare_exchange_strong(&key_busy[key], &idle, 1))
+		atomic_fetch_add(&key_errors, 1);
+	if (key_next[key] != seq)
+		atomic_fetch_add(&key_errors, 1);
+	key_next[key] = seq + 1;
+	atomic_store(&key_busy[key], 0);
+	return 0;
+}
+
+
+atomic_char range_hits[100000];
+
+void hit_range(long begin, long end, void* ctx){
+	long i;
+	(void)ctx;
+	for (i = begin; i < end; i++)
+		atomic_fetch_add(&range_hits[i], 1);
+}
+
+int nested_parallel_for(void* arg){
+	(void)arg;
+	return thpool_parallel_for(nested_thpool, 0, 100000, 0, hit_range, NULL);
+}
+
+
 int main(int argc, char *argv[]){
 
 	int num = 0;
@@ -64,6 +146,667 @@ int main(int argc, char *argv[]){
 		return -1;
 	};
 
+	/* Test duplicate uuids are handed back oldest first */
+	int result;
+	thpool = thpool_init(1);
+	thpool_add_work(thpool, 7, return_arg, (void*)(intptr_t)1);
+	thpool_add_work(thpool, 7, return_arg, (void*)(intptr_t)2);
+	thpool_wait(thpool);
+	if (thpool_find_result(thpool, 7, 1, 1, &result) || result != 1) {
+		printf("Expected result 1 for first uuid 7, got %d", result);
+		return -1;
+	};
+	if (thpool_find_result(thpool, 7, 1, 1, &result) || result != 2) {
+		printf("Expected result 2 for second uuid 7, got %d", result);
+		return -1;
+	};
+	if (thpool_find_result(thpool, 7, 1, 1, &result) == 0) {
+		printf("Expected no more results for uuid 7");
+		return -1;
+	};
+	thpool_destroy(thpool);
+
+	/* Test blocking wait for a single result */
+	thpool = thpool_init(2);
+	thpool_add_work(thpool, 8, return_arg, (void*)(intptr_t)8);
+	if (thpool_wait_result(thpool, 8, 1000000000LL, &result) || result != 8) {
+		printf("Expected result 8 for uuid 8, got %d", result);
+		return -1;
+	};
+	if (thpool_wait_result(thpool, 9, 1000000LL, &result) == 0) {
+		printf("Expected uuid 9 to time out");
+		return -1;
+	};
+	thpool_destroy(thpool);
+
+	/* Test work added from inside a job */
+	int i;
+	nested_thpool = thpool_init(4);
+	for (i = 0; i < 50; i++)
+		thpool_add_work(nested_thpool, i, add_nested, (void*)(intptr_t)i);
+	thpool_wait(nested_thpool);
+	for (i = 0; i < 50; i++) {
+		if (thpool_wait_result(nested_thpool, 100 + i, 0, &result) || result != i) {
+			printf("Expected result %d for nested uuid %d, got %d", i, 100 + i, result);
+			return -1;
+		};
+	}
+	thpool_destroy(nested_thpool);
+
+	/* Test adding a burst of work */
+	int       batch_uuids[64];
+	th_func_p batch_funcs[64];
+	void*     batch_args[64];
+	thpool = thpool_init(4);
+	for (i = 0; i < 64; i++) {
+		batch_uuids[i] = 1000 + i;
+		batch_funcs[i] = return_arg;
+		batch_args[i]  = (void*)(intptr_t)i;
+	}
+	if (thpool_add_work_batch(thpool, 64, batch_uuids, batch_funcs, batch_args)) {
+		printf("Expected batch of 64 jobs to be added");
+		return -1;
+	};
+	for (i = 0; i < 64; i++) {
+		if (thpool_wait_result(thpool, 1000 + i, 1000000000LL, &result) || result != i) {
+			printf("Expected result %d for batch uuid %d, got %d", i, 1000 + i, result);
+			return -1;
+		};
+	}
+	thpool_destroy(thpool);
+
+	/* Test collecting all results at once */
+	int collected = 0;
+	int uuid_sum  = 0;
+	int out_uuids[16];
+	int out_results[16];
+	thpool = thpool_init(4);
+	for (i = 0; i < 40; i++)
+		thpool_add_work(thpool, i, return_arg, (void*)(intptr_t)i);
+	while (collected < 40) {
+		num = thpool_collect_results(thpool, 16, out_uuids, out_results, 1000000000LL);
+		if (num <= 0) {
+			printf("Expected more results after %d collected", collected);
+			return -1;
+		};
+		for (i = 0; i < num; i++) {
+			if (out_results[i] != out_uuids[i]) {
+				printf("Expected result %d for uuid %d, got %d", out_uuids[i], out_uuids[i], out_results[i]);
+				return -1;
+			};
+			uuid_sum += out_uuids[i];
+		}
+		collected += num;
+	}
+	if (collected != 40 || uuid_sum != 780) {
+		printf("Expected 40 results with uuid sum 780, got %d and %d", collected, uuid_sum);
+		return -1;
+	};
+	if (thpool_collect_results(thpool, 16, out_uuids, out_results, 1000000LL) != 0) {
+		printf("Expected no results left");
+		return -1;
+	};
+	thpool_destroy(thpool);
+
+	/* Test more results than the workers hold before handing them in */
+	thpool = thpool_init(2);
+	for (i = 0; i < 5000; i++)
+		thpool_add_work(thpool, i, return_arg, (void*)(intptr_t)i);
+	thpool_wait(thpool);
+	num = thpool_queue_out_len(thpool);
+	if (num != 5000) {
+		printf("Expected 5000 results waiting, got %d", num);
+		return -1;
+	};
+	collected = 0;
+	while ((num = thpool_collect_results(thpool, 16, out_uuids, out_results, 0)) > 0) {
+		for (i = 0; i < num; i++) {
+			if (out_results[i] != out_uuids[i]) {
+				printf("Expected result %d for uuid %d, got %d", out_uuids[i], out_uuids[i], out_results[i]);
+				return -1;
+			};
+		}
+		collected += num;
+	}
+	if (collected != 5000) {
+		printf("Expected to collect 5000 results, got %d", collected);
+		return -1;
+	};
+	thpool_destroy(thpool);
+
+	/* Test init from a config, with and without busy-waiting */
+	thpool_config config;
+	thpool_config_init(&config);
+	config.num_threads = 2;
+	for (num = 0; num < 2; num++) {
+		config.idle_spin_ns = num ? 0 : 1000000;
+		thpool = thpool_init_ex(&config);
+		if (thpool_num_threads_alive(thpool) != 2) {
+			printf("Expected 2 threads alive from config, got %d", thpool_num_threads_alive(thpool));
+			return -1;
+		};
+		for (i = 0; i < 100; i++) {
+			thpool_add_work(thpool, i, return_arg, (void*)(intptr_t)i);
+			if (thpool_wait_result(thpool, i, 1000000000LL, &result) || result != i) {
+				printf("Expected result %d from configured pool, got %d", i, result);
+				return -1;
+			};
+		}
+		thpool_destroy(thpool);
+	}
+
+	/* Test backpressure from a bounded queue */
+	config.num_threads    = 1;
+	config.idle_spin_ns   = 0;
+	config.queue_capacity = 4;
+	thpool = thpool_init_ex(&config);
+	thpool_add_work(thpool, 0, wait_for_gate, (void*)0);
+	while (thpool_num_threads_working(thpool) != 1)
+		usleep(1000);
+	for (i = 1; i <= 4; i++) {
+		if (thpool_try_add_work(thpool, i, return_arg, (void*)(intptr_t)i)) {
+			printf("Expected room in bounded queue for job %d", i);
+			return -1;
+		};
+	}
+	if (thpool_try_add_work(thpool, 5, return_arg, (void*)5) != -1 || errno != EAGAIN) {
+		printf("Expected EAGAIN from full bounded queue");
+		return -1;
+	};
+	if (thpool_add_work_timed(thpool, 5, return_arg, (void*)5, 10000000LL) != -1 || errno != ETIMEDOUT) {
+		printf("Expected ETIMEDOUT from full bounded queue");
+		return -1;
+	};
+	atomic_store(&gate_open, 1);
+	for (i = 0; i <= 4; i++) {
+		if (thpool_wait_result(thpool, i, 1000000000LL, &result) || result != i) {
+			printf("Expected result %d from bounded queue, got %d", i, result);
+			return -1;
+		};
+	}
+	for (i = 0; i < 20; i++) {
+		batch_uuids[i] = 2000 + i;
+		batch_args[i]  = (void*)(intptr_t)i;
+	}
+	thpool_add_work_batch(thpool, 20, batch_uuids, batch_funcs, batch_args);
+	for (i = 0; i < 20; i++) {
+		if (thpool_wait_result(thpool, 2000 + i, 1000000000LL, &result) || result != i) {
+			printf("Expected result %d for bounded batch, got %d", i, result);
+			return -1;
+		};
+	}
+	thpool_destroy(thpool);
+
+	/* Test results handed to a callback instead of queue_out */
+	atomic_init(&done_sum, 0);
+	thpool = thpool_init(4);
+	for (i = 0; i < 50; i++)
+		thpool_add_work_cb(thpool, i, return_arg, (void*)(intptr_t)i, add_to_done_sum, (void*)1);
+	thpool_wait(thpool);
+	if (atomic_load(&done_sum) != 2500 || thpool_queue_out_len(thpool) != 0) {
+		printf("Expected callbacks to sum 2500 with queue_out empty, got %d and %d",
+		       atomic_load(&done_sum), thpool_queue_out_len(thpool));
+		return -1;
+	};
+	thpool_destroy(thpool);
+
+#if defined(__linux__)
+	/* Test waiting for results with poll() on the completion fd */
+	struct pollfd pfd;
+	thpool_config_init(&config);
+	config.num_threads   = 2;
+	config.completion_fd = 1;
+	thpool = thpool_init_ex(&config);
+	pfd.fd     = thpool_completion_fd(thpool);
+	pfd.events = POLLIN;
+	if (pfd.fd < 0 || poll(&pfd, 1, 0) != 0) {
+		printf("Expected an idle completion fd");
+		return -1;
+	};
+	for (i = 0; i < 10; i++)
+		thpool_add_work(thpool, i, return_arg, (void*)(intptr_t)i);
+	collected = 0;
+	while (collected < 10) {
+		if (poll(&pfd, 1, 1000) != 1) {
+			printf("Expected completion fd readable after %d results", collected);
+			return -1;
+		};
+		collected += thpool_collect_results(thpool, 4, out_uuids, out_results, 0);
+	}
+	/* The last worker may still be signalling the result it pushed */
+	thpool_wait(thpool);
+	thpool_collect_results(thpool, 4, out_uuids, out_results, 0);
+	if (poll(&pfd, 1, 0) != 0) {
+		printf("Expected completion fd cleared once results are collected");
+		return -1;
+	};
+	thpool_destroy(thpool);
+#endif
+
+	/* Test pinned pools, from a CPU list and from the topology */
+	int pin_cpus[] = { 0 };
+	for (num = 0; num < 2; num++) {
+		thpool_config_init(&config);
+		config.num_threads = 3;
+		if (num) {
+			config.numa_local = 1;
+		} else {
+			config.affinity = THPOOL_AFFINITY_LIST;
+			config.cpus     = pin_cpus;
+			config.num_cpus = 1;
+		}
+		thpool = thpool_init_ex(&config);
+		if (thpool_num_threads_alive(thpool) != 3) {
+			printf("Expected 3 pinned threads alive, got %d", thpool_num_threads_alive(thpool));
+			return -1;
+		};
+		for (i = 0; i < 50; i++)
+			thpool_add_work(thpool, i, return_arg, (void*)(intptr_t)i);
+		for (i = 0; i < 50; i++) {
+			if (thpool_wait_result(thpool, i, 1000000000LL, &result) || result != i) {
+				printf("Expected result %d from pinned pool, got %d", i, result);
+				return -1;
+			};
+		}
+		/* Workers added past the initial table and those left after a
+		 * shrink still get the node's jobs */
+		int pin_sizes[] = { 12, 2 };
+		int k;
+		for (k = 0; k < 2; k++) {
+			if (thpool_resize(thpool, pin_sizes[k])) {
+				printf("Could not resize pinned pool to %d", pin_sizes[k]);
+				return -1;
+			};
+			for (i = 0; i < 50; i++)
+				thpool_add_work(thpool, i, return_arg, (void*)(intptr_t)i);
+			for (i = 0; i < 50; i++) {
+				if (thpool_wait_result(thpool, i, 1000000000LL, &result) || result != i) {
+					printf("Expected result %d from resized pinned pool, got %d", i, result);
+					return -1;
+				};
+			}
+		}
+		thpool_destroy(thpool);
+	}
+	config.affinity = THPOOL_AFFINITY_LIST;
+	config.num_cpus = 0;
+	if (thpool_init_ex(&config) != NULL) {
+		printf("Expected an empty CPU list to be refused");
+		return -1;
+	};
+
+	/* Test the metrics snapshot */
+	thpool_stats stats;
+	thpool = thpool_init(2);
+	for (i = 0; i < 100; i++)
+		thpool_add_work(thpool, i, return_arg, (void*)(intptr_t)i);
+	for (i = 0; i < 90; i++)
+		thpool_wait_result(thpool, i, 1000000000LL, &result);
+	thpool_wait(thpool);
+	if (thpool_get_stats(thpool, &stats) == 0) {
+		if (stats.jobs_added != 100 || stats.jobs_completed != 100 ||
+		    stats.jobs_collected != 90 || stats.results_waiting != 10 ||
+		    stats.queue_wait.count != 100 || stats.result_wait.count != 90) {
+			printf("Unexpected stats: added %llu completed %llu collected %llu waiting %d",
+			       stats.jobs_added, stats.jobs_completed, stats.jobs_collected, stats.results_waiting);
+			return -1;
+		};
+		if (stats.run_time.p50_ns > stats.run_time.p99_ns ||
+		    stats.run_time.p99_ns > stats.run_time.max_ns) {
+			printf("Expected ordered percentiles, got p50 %llu p99 %llu max %llu",
+			       stats.run_time.p50_ns, stats.run_time.p99_ns, stats.run_time.max_ns);
+			return -1;
+		};
+	}
+	thpool_destroy(thpool);
+
+	/* Test that higher priority jobs run first */
+	thpool = thpool_init(1);
+	atomic_store(&gate_open, 0);
+	atomic_init(&run_count, 0);
+	thpool_add_work(thpool, 0, wait_for_gate, NULL);
+	while (thpool_num_threads_working(thpool) != 1)
+		usleep(1000);
+	for (i = 0; i < 3; i++) {
+		thpool_add_work_prio(thpool, THPOOL_PRIO_LOW,    i, record_order, (void*)THPOOL_PRIO_LOW);
+		thpool_add_work_prio(thpool, THPOOL_PRIO_NORMAL, i, record_order, (void*)THPOOL_PRIO_NORMAL);
+		thpool_add_work_prio(thpool, THPOOL_PRIO_HIGH,   i, record_order, (void*)THPOOL_PRIO_HIGH);
+	}
+	atomic_store(&gate_open, 1);
+	thpool_wait(thpool);
+	for (i = 0; i < 9; i++) {
+		if (run_order[i] != i / 3) {
+			printf("Expected priority %d at position %d, got %d", i / 3, i, run_order[i]);
+			return -1;
+		};
+	}
+
+	/* Test that low priority jobs age in under a flood of high ones */
+	atomic_store(&gate_open, 0);
+	atomic_init(&run_count, 0);
+	thpool_add_work(thpool, 0, wait_for_gate, NULL);
+	while (thpool_num_threads_working(thpool) != 1)
+		usleep(1000);
+	thpool_add_work_prio(thpool, THPOOL_PRIO_LOW, 0, record_order, (void*)THPOOL_PRIO_LOW);
+	for (i = 0; i < 40; i++)
+		thpool_add_work_prio(thpool, THPOOL_PRIO_HIGH, i, record_order, (void*)THPOOL_PRIO_HIGH);
+	atomic_store(&gate_open, 1);
+	thpool_wait(thpool);
+	for (i = 0; i < 41 && run_order[i] != THPOOL_PRIO_LOW; i++);
+	if (i >= 20) {
+		printf("Expected low priority job to run within 20 picks, ran at %d", i);
+		return -1;
+	};
+	thpool_destroy(thpool);
+
+	/* Test that a paused pool starts no jobs until resumed */
+	thpool = thpool_init(2);
+	thpool_pause(thpool);
+	for (i = 0; i < 4; i++)
+		thpool_add_work(thpool, i, return_arg, (void*)(intptr_t)i);
+	if (thpool_wait_result(thpool, 0, 50000000LL, &result) == 0) {
+		printf("Expected no job to run while paused");
+		return -1;
+	};
+	thpool_resume(thpool);
+	for (i = 0; i < 4; i++) {
+		if (thpool_wait_result(thpool, i, 1000000000LL, &result) || result != i) {
+			printf("Expected result %d after resume, got %d", i, result);
+			return -1;
+		};
+	}
+	thpool_destroy(thpool);
+
+	/* Test that no job starts once thpool_pause() has returned */
+	thpool = thpool_init(4);
+	atomic_store(&run_count, 0);
+	for (i = 0; i < 2000; i++)
+		thpool_add_work(thpool, i, count_run, NULL);
+	usleep(5000);
+	thpool_pause(thpool);
+	num = atomic_load(&run_count);
+	usleep(50000);
+	if (atomic_load(&run_count) != num) {
+		printf("Expected no job to start after pause, %d did", atomic_load(&run_count) - num);
+		return -1;
+	};
+	thpool_resume(thpool);
+	thpool_wait(thpool);
+	if (atomic_load(&run_count) != 2000) {
+		printf("Expected all 2000 jobs to run after resume, %d did", atomic_load(&run_count));
+		return -1;
+	};
+	thpool_destroy(thpool);
+
+	/* Test resizing: grow, shrink, and grow back into old slots */
+	thpool = thpool_init(2);
+	int sizes[] = { 6, 1, 3 };
+	for (num = 0; num < 3; num++) {
+		if (thpool_resize(thpool, sizes[num])) {
+			printf("Expected resize to %d to succeed", sizes[num]);
+			return -1;
+		};
+		for (i = 0; i < 1000 && thpool_num_threads_alive(thpool) != sizes[num]; i++)
+			usleep(1000);
+		if (thpool_num_threads_alive(thpool) != sizes[num]) {
+			printf("Expected %d threads alive after resize, got %d", sizes[num], thpool_num_threads_alive(thpool));
+			return -1;
+		};
+		for (i = 0; i < 50; i++)
+			thpool_add_work(thpool, i, return_arg, (void*)(intptr_t)i);
+		for (i = 0; i < 50; i++) {
+			if (thpool_wait_result(thpool, i, 1000000000LL, &result) || result != i) {
+				printf("Expected result %d from resized pool, got %d", i, result);
+				return -1;
+			};
+		}
+	}
+	thpool_destroy(thpool);
+
+	/* Test that the autoscaler grows under a backlog and shrinks when idle */
+	thpool_config_init(&config);
+	config.num_threads    = 1;
+	config.max_threads    = 4;
+	config.idle_spin_ns   = 0;
+	config.idle_linger_ns = 50000000LL;
+	thpool = thpool_init_ex(&config);
+	atomic_store(&gate_open, 0);
+	thpool_add_work(thpool, 0, wait_for_gate, (void*)0);
+	for (i = 1; i <= 20; i++)
+		thpool_add_work(thpool, i, return_arg, (void*)(intptr_t)i);
+	for (i = 1; i <= 20; i++)
+		thpool_wait_result(thpool, i, 1000000000LL, &result);
+	if (thpool_num_threads_alive(thpool) < 2) {
+		printf("Expected the pool to grow past 1 thread under a backlog");
+		return -1;
+	};
+	atomic_store(&gate_open, 1);
+	thpool_wait(thpool);
+	for (i = 0; i < 2000 && thpool_num_threads_alive(thpool) != 1; i++)
+		usleep(1000);
+	if (thpool_num_threads_alive(thpool) != 1) {
+		printf("Expected idle threads to retire down to 1, got %d", thpool_num_threads_alive(thpool));
+		return -1;
+	};
+	thpool_destroy(thpool);
+
+	/* Test that keyed jobs run one at a time and in order, per key, also
+	 * while keys move between threads and the pool shrinks under them */
+	thpool_config_init(&config);
+	config.num_threads         = 4;
+	config.key_rebalance_depth = 2;
+	thpool = thpool_init_ex(&config);
+	for (i = 0; i < 800; i++) {
+		if (i == 400)
+			thpool_resize(thpool, 2);
+		thpool_add_work_keyed(thpool, i % 8, i, run_keyed, (void*)(intptr_t)(i % 8 * 1000 + i / 8));
+	}
+	thpool_wait(thpool);
+	if (atomic_load(&key_errors) != 0) {
+		printf("Expected keyed jobs in order and one at a time, %d were not", atomic_load(&key_errors));
+		return -1;
+	};
+	for (i = 0; i < 8; i++) {
+		if (key_next[i] != 100) {
+			printf("Expected 100 jobs of key %d to run, got %d", i, key_next[i]);
+			return -1;
+		};
+	}
+	thpool_destroy(thpool);
+
+	/* Test that cancelled and expired jobs complete without running */
+	thpool = thpool_init(1);
+	atomic_store(&gate_open, 0);
+	thpool_add_work(thpool, 0, wait_for_gate, (void*)0);
+	for (i = 1; i <= 3; i++)
+		thpool_add_work(thpool, i, return_arg, (void*)(intptr_t)i);
+	thpool_add_work_deadline(thpool, 4, return_arg, (void*)4, 1000000LL);
+	if (thpool_cancel(thpool, 2) || thpool_cancel(thpool, 2) != -1) {
+		printf("Expected exactly one job with uuid 2 to cancel");
+		return -1;
+	};
+	usleep(10000);
+	atomic_store(&gate_open, 1);
+	int expected[] = { 0, 1, -ECANCELED, 3, -ETIMEDOUT };
+	for (i = 0; i <= 4; i++) {
+		if (thpool_wait_result(thpool, i, 1000000000LL, &result) || result != expected[i]) {
+			printf("Expected result %d for job %d, got %d", expected[i], i, result);
+			return -1;
+		};
+	}
+	thpool_destroy(thpool);
+
+	/* Test that uncollected results are freed after their TTL */
+	thpool_config_init(&config);
+	config.num_threads   = 1;
+	config.result_ttl_ns = 20000000LL;
+	thpool = thpool_init_ex(&config);
+	thpool_add_work(thpool, 0, return_arg, (void*)0);
+	thpool_wait(thpool);
+	usleep(100000);
+	if (thpool_queue_out_len(thpool) != 0) {
+		printf("Expected the result to be reaped, %d still waiting", thpool_queue_out_len(thpool));
+		return -1;
+	};
+	thpool_destroy(thpool);
+
+	/* Test futures: waited, polled, and released before their job ran */
+	thpool = thpool_init(2);
+	atomic_store(&gate_open, 0);
+	thpool_future* gated = thpool_submit(thpool, wait_for_gate, (void*)7);
+	thpool_future* futures[64];
+	for (i = 0; i < 64; i++)
+		futures[i] = thpool_submit(thpool, return_arg, (void*)(intptr_t)i);
+	if (thpool_future_poll(gated) || thpool_future_wait(gated, 0, &result) != -1) {
+		printf("Expected the gated future not to be ready yet");
+		return -1;
+	};
+	for (i = 0; i < 64; i += 2)
+		thpool_future_release(futures[i]);
+	for (i = 1; i < 64; i += 2) {
+		if (thpool_future_wait(futures[i], 1000000000LL, &result) || result != i) {
+			printf("Expected future %d to return %d, got %d", i, i, result);
+			return -1;
+		};
+		thpool_future_release(futures[i]);
+	}
+	atomic_store(&gate_open, 1);
+	if (thpool_future_wait(gated, -1, &result) || result != 7 || !thpool_future_poll(gated)) {
+		printf("Expected the gated future to return 7, got %d", result);
+		return -1;
+	};
+	thpool_future_release(gated);
+	thpool_wait(thpool);
+	if (thpool_queue_out_len(thpool) != 0) {
+		printf("Expected futures to leave queue_out empty");
+		return -1;
+	};
+	thpool_destroy(thpool);
+
+	/* Test dependencies: a diamond behind a gate, and a dep already done */
+	thpool = thpool_init(4);
+	atomic_store(&gate_open, 0);
+	run_count = 0;
+	gated = thpool_submit(thpool, wait_for_gate, (void*)0);
+	thpool_future* left  = thpool_submit_after(thpool, &gated, 1, record_order, (void*)1);
+	thpool_future* right = thpool_submit_after(thpool, &gated, 1, record_order, (void*)2);
+	thpool_future* both[] = { left, right };
+	thpool_future* last  = thpool_submit_after(thpool, both, 2, record_order, (void*)3);
+	usleep(10000);
+	if (atomic_load(&run_count) != 0 || thpool_future_poll(left) || thpool_future_poll(last)) {
+		printf("Expected no dependent job to start before the gate opened");
+		return -1;
+	};
+	atomic_store(&gate_open, 1);
+	if (thpool_future_wait(last, 1000000000LL, &result) || atomic_load(&run_count) != 3 || run_order[2] != 3) {
+		printf("Expected the joining job to run last, after both branches");
+		return -1;
+	};
+	thpool_future* late = thpool_submit_after(thpool, both, 2, return_arg, (void*)9);
+	thpool_future_release(left);
+	thpool_future_release(right);
+	if (thpool_future_wait(late, 1000000000LL, &result) || result != 9) {
+		printf("Expected a job on finished deps to run, got %d", result);
+		return -1;
+	};
+	thpool_future_release(late);
+	thpool_future_release(last);
+	thpool_future_release(gated);
+	thpool_destroy(thpool);
+
+	/* Test parallel_for: a set grain, the default one, and from a job */
+	thpool = thpool_init(4);
+	nested_thpool = thpool;
+	if (thpool_parallel_for(thpool, 0, 100000, 1000, hit_range, NULL) ||
+	    thpool_parallel_for(thpool, 0, 100000, 0, hit_range, NULL) ||
+	    thpool_parallel_for(thpool, 5, 5, 1, hit_range, NULL)) {
+		printf("Expected parallel_for to succeed");
+		return -1;
+	};
+	gated = thpool_submit(thpool, nested_parallel_for, NULL);
+	if (thpool_future_wait(gated, -1, &result) || result != 0) {
+		printf("Expected parallel_for from inside a job to succeed");
+		return -1;
+	};
+	thpool_future_release(gated);
+	for (i = 0; i < 100000; i++) {
+		if (range_hits[i] != 3) {
+			printf("Expected index %d to be run 3 times, got %d", i, range_hits[i]);
+			return -1;
+		};
+	}
+
+	/* Helpers a paused pool leaves queued are not anyone's uuid 0 */
+	thpool_pause(thpool);
+	if (thpool_parallel_for(thpool, 0, 100000, 1000, hit_range, NULL) ||
+	    thpool_cancel(thpool, 0) == 0) {
+		printf("Expected parallel_for helpers not to be cancelled as uuid 0");
+		return -1;
+	};
+	thpool_resume(thpool);
+	thpool_destroy(thpool);
+
+	/* Test I/O jobs, through io_uring and on the workers */
+	for (num = 0; num < 2; num++) {
+		static char io_bufs[64][512];
+		char path[] = "/tmp/thpool_io_XXXXXX";
+		int fd = mkstemp(path);
+		int devnull = open("/dev/null", O_WRONLY);
+		if (fd == -1 || devnull == -1) {
+			printf("Could not open files for the I/O test");
+			return -1;
+		};
+		unlink(path);
+		thpool_config_init(&config);
+		config.num_threads = 2;
+		config.io_depth    = num ? 0 : 16;
+		thpool = thpool_init_ex(&config);
+		for (i = 0; i < 64; i++) {
+			memset(io_bufs[i], 'a' + i % 26, sizeof(io_bufs[i]));
+			thpool_add_io(thpool, i, THPOOL_IO_WRITE, fd, io_bufs[i], sizeof(io_bufs[i]), i * 512LL);
+			thpool_add_io(thpool, 100 + i, THPOOL_IO_WRITE, devnull, io_bufs[i], sizeof(io_bufs[i]), 0);
+		}
+		thpool_wait(thpool);
+		thpool_add_io(thpool, 200, THPOOL_IO_FSYNC, fd, NULL, 0, 0);
+		thpool_add_io(thpool, 201, THPOOL_IO_READ, -1, io_bufs[0], 1, 0);
+		for (i = 0; i < 64; i++) {
+			if (thpool_wait_result(thpool, i, 1000000000LL, &result) || result != 512 ||
+			    thpool_wait_result(thpool, 100 + i, 1000000000LL, &result) || result != 512) {
+				printf("Expected 512 bytes written by I/O job %d, got %d", i, result);
+				return -1;
+			};
+		}
+		if (thpool_wait_result(thpool, 200, 1000000000LL, &result) || result != 0 ||
+		    thpool_wait_result(thpool, 201, 1000000000LL, &result) || result != -EBADF) {
+			printf("Expected fsync to return 0 and a bad fd -EBADF, got %d", result);
+			return -1;
+		};
+		memset(io_bufs, 0, sizeof(io_bufs));
+		for (i = 0; i < 64; i++)
+			thpool_add_io(thpool, i, THPOOL_IO_READ, fd, io_bufs[i], sizeof(io_bufs[i]), i * 512LL);
+		for (i = 0; i < 64; i++) {
+			if (thpool_wait_result(thpool, i, 1000000000LL, &result) || result != 512 ||
+			    io_bufs[i][0] != 'a' + i % 26 || io_bufs[i][511] != 'a' + i % 26) {
+				printf("Expected I/O job %d to read back what was written, got %d", i, result);
+				return -1;
+			};
+		}
+		/* Either path may be the one this kernel has, the stats tell which ran */
+		int metrics = thpool_get_stats(thpool, &stats) == 0;
+		if (stats.io_rings != 0 && (num || stats.io_rings != 2)) {
+			printf("Expected %s workers to have an io_uring, %d did", num ? "no" : "all or no", stats.io_rings);
+			return -1;
+		};
+		if (metrics && (stats.io_submitted + stats.io_inline != 194 || (stats.io_rings > 0) != (stats.io_submitted > 0))) {
+			printf("Expected io_uring to run I/O jobs if there are rings, %llu of %llu ran there with %d rings",
+			       stats.io_submitted, stats.io_submitted + stats.io_inline, stats.io_rings);
+			return -1;
+		};
+		thpool_destroy(thpool);
+		close(devnull);
+		close(fd);
+	}
+
 	// thpool_destroy(thpool);
 
 	// sleep(1); // Sometimes main exits before thpool_destroy finished 100%
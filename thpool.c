@@ -15,15 +15,35 @@
 #define _POSIX_C_SOURCE 200809L
 #endif
 #endif
+#if defined(__linux__) && !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE  /* syscall() for futex, without all of _GNU_SOURCE */
+#endif
 #include <unistd.h>
-#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <errno.h>
 #include <time.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
 #if defined(__linux__)
 #include <sys/prctl.h>
+#include <sys/eventfd.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#endif
+
+/* Kernel headers older than 5.6 have no io_uring read and write ops (nor
+ * the probe for them), I/O jobs then run inline */
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
 #endif
 
 #include "thpool.h"
@@ -34,6 +54,18 @@
 #define THPOOL_DEBUG 0
 #endif
 
+#ifdef DISABLE_METRICS
+#define THPOOL_METRICS 0
+#else
+#define THPOOL_METRICS 1
+#endif
+
+#if defined(IO_URING_OP_SUPPORTED) && defined(SYS_io_uring_setup)
+#define THPOOL_IO_URING 1
+#else
+#define THPOOL_IO_URING 0
+#endif
+
 #if !defined(DISABLE_PRINT) || defined(THPOOL_DEBUG)
 #define err(str) fprintf(stderr, str)
 #else
@@ -44,11 +76,9 @@
 
 //TODO DUMPING GROUND
 //===================
-//TODO:(captured) add queue metrics
-//TODO: How handle duplicate job_uuid's, if at all?
-//		Should this ever happen using UUID's?
-//		Only look for this in queue_out?  What do?
-//		Or, just allow it for now.  Future "queue_out monitor thread" can remove "aged-out" jobs.
+//NOTE: Duplicate job_uuid's are allowed.  queue_out keeps every completion and
+//		thpool_find_result() hands them back oldest first, one per call.
+//		With a result_ttl_ns the reaper thread removes "aged-out" ones.
 //TODO: AFTER INTEGRATION: all printf() and err() calls must be replaced will appropriate logging function calls
 
 
@@ -59,21 +89,63 @@
 /* ========================== STRUCTURES ============================ */
 
 
-/* Binary semaphore */
-typedef struct bsem {
+/* Counting semaphore */
+typedef struct csem {
+	atomic_int   v;                      /* posts not yet taken       */
+	atomic_int   waiters;                /* threads about to sleep    */
+	atomic_uint  seq;                    /* futex word, bumped on wake*/
+#if !defined(__linux__)
 	pthread_mutex_t mutex;
 	pthread_cond_t   cond;
-	int v;
-} bsem;
-
-// typedef struct job_metrics {
-// 	int    age_queue_in;
-// 	int    age_queue_out;
-// }job_metrics;
+#endif
+} csem;
+
+/* Job timestamps, nanoseconds on CLOCK_MONOTONIC */
+typedef struct job_metrics {
+	long long    queued_ns;      /* added to the pool         */
+	long long    done_ns;        /* finished running          */
+} job_metrics;
+
+/* Log-linear latency histogram (HDR style)
+ * Each power of two is split into HIST_SUB buckets, so any recorded value
+ * is known to within 1/HIST_SUB of itself at a fixed, small size.
+ * Counters are atomics: recording takes no lock and readers may sum them
+ * at any time.
+ */
+#define HIST_SUB_BITS                       3
+#define HIST_SUB                            (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS                       48   /* ~3 days in ns */
+#define HIST_BUCKETS                        ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct histogram {
+	atomic_ullong count;                 /* values recorded           */
+	atomic_ullong sum_ns;                /* for the mean              */
+	atomic_ullong max_ns;                /* largest value             */
+	atomic_ullong buckets[HIST_BUCKETS]; /* values per bucket         */
+} histogram;
+
+/* Plain copy of one or more histograms added up, for reporting */
+typedef struct histsum {
+	unsigned long long count;
+	unsigned long long sum_ns;
+	unsigned long long max_ns;
+	unsigned long long buckets[HIST_BUCKETS];
+} histsum;
+
+/* What a thpool_add_io() job does */
+typedef struct jobio{
+	int          op;             /* THPOOL_IO_*               */
+	int          fd;
+	void*        buf;
+	unsigned int len;
+	long long    offset;
+} jobio;
 
 /* Job */
 typedef struct job{
 	struct job*  prev;           /* pointer to previous job   */
+	struct job*  next;           /* pointer to next job       */
+	struct job*  hnext;          /* next job in index bucket  */
 
 //TODO: If keep, need to sort out different function pointer prototypes scattered across test code.
 	th_func_p    function;       /* function pointer          */
@@ -82,72 +154,536 @@ typedef struct job{
 
 	int          uuid;           /* job identifier            */
 	int          result;         /* job result code           */
-//	int          age_queue;      /* generic age for either queue?  Later put in metrics struct? */
-
-// 	struct job_metrics     metrics;
+	th_done_p    done;           /* called instead of queue_out */
+	void*        done_arg;       /* done's argument           */
+	int          shard;          /* key shard, -1 if not keyed */
+	atomic_uint  state;          /* JOB_* | generation << 2   */
+	long long    deadline_ns;    /* drop unless started by, 0 never */
+	long long    reap_ns;        /* drop from queue_out after */
+	atomic_uint  future;         /* FUTURE_* bits, 0 if none  */
+	struct thpool_* thpool_p;    /* owning pool, for futures  */
+	_Atomic(struct jobdep*) successors; /* futures waiting on this one */
+	struct jobdep* deps;         /* edges to what this waits on */
+	atomic_int   deps_left;      /* unfinished deps, +1 while adding */
+	jobio        io;             /* for thpool_add_io() jobs  */
+#if THPOOL_METRICS
+	job_metrics  metrics;        /* timestamps                */
+#endif
 } job;
 
+/* Edge of a dependency graph, on the successor list of the job waited on */
+typedef struct jobdep{
+	struct job*     job_p;               /* job that waits            */
+	struct jobdep*  next;                /* next edge on the list     */
+} jobdep;
+
+/* Range of a thpool_parallel_for(), shared by the caller and its helpers */
+typedef struct parfor{
+	atomic_long  next_chunk;             /* next chunk to hand out    */
+	long         num_chunks;
+	long         begin;                  /* range, end exclusive      */
+	long         end;
+	long         grain;                  /* indexes per chunk         */
+	th_range_p   func;                   /* called once per chunk     */
+	void*        ctx;                    /* func's argument           */
+	atomic_long  chunks_left;            /* chunks not finished yet   */
+	atomic_int   refs;                   /* caller and helper jobs    */
+	csem         finished;               /* posted by the last chunk  */
+} parfor;
+
+/* Thread blocked on a job that has not arrived in a queue yet */
+typedef struct jobwaiter{
+	int             uuid;                /* job the waiter wants      */
+	int             any;                 /* or 1 to take any job      */
+	int             ready;               /* set once that job arrives */
+	pthread_cond_t  cond;                /* waiter's own wakeup       */
+	struct jobwaiter* next;              /* next waiter on the queue  */
+} jobwaiter;
+
 /* Job queue */
 typedef struct jobqueue{
 	pthread_mutex_t rwmutex;             /* used for queue r/w access */
 	job  *front;                         /* pointer to front of queue */
 	job  *rear;                          /* pointer to rear  of queue */
-	bsem *has_jobs;                      /* flag as binary semaphore  */
-	volatile int len;                    /* number of jobs in queue   */
+	atomic_int len;                      /* jobs in queue, may be read
+	                                        without the lock          */
+	job  **buckets;                      /* uuid index (NULL if none) */
+	unsigned int num_buckets;            /* index size, power of two  */
+	jobwaiter *waiters;                  /* threads waiting on a uuid */
 } jobqueue;
 
 
+/* Chunk of job memory, carved up by the job slab */
+typedef struct jobchunk{
+	struct jobchunk* next;               /* next chunk of the slab    */
+	job  jobs[];                         /* the jobs themselves       */
+} jobchunk;
+
+/* Job allocator, owned by the pool */
+typedef struct jobslab{
+	pthread_mutex_t lock;                /* guards the shared list    */
+	job  *free;                          /* shared free list (->prev) */
+	int  num_free;                       /* jobs on the shared list   */
+	jobchunk *chunks;                    /* all memory of the slab    */
+	int  chunk_jobs;                     /* size of the next chunk    */
+	unsigned long id;                    /* unique, tags thread caches*/
+	struct jobslab* next;                /* next slab in registry     */
+} jobslab;
+
+/* Per-thread cache of free jobs */
+typedef struct jobcache{
+	unsigned long slab_id;               /* slab the jobs belong to   */
+	job  *free;                          /* cached jobs (->prev)      */
+	int  num_free;                       /* number of cached jobs     */
+} jobcache;
+
+
+/* Circular array backing a work-stealing deque */
+typedef struct wsarray{
+	long size;                           /* slots, power of two       */
+	struct wsarray* retired;             /* smaller array it replaced */
+	_Atomic(job*) slots[];               /* the jobs                  */
+} wsarray;
+
+/* Chase-Lev work-stealing deque
+ * The owning thread pushes and pops at the bottom, any other thread
+ * steals from the top.  Neither side takes a lock.
+ */
+typedef struct wsdeque{
+	atomic_long top;                     /* next slot to steal        */
+	atomic_long bottom;                  /* next slot to push         */
+	_Atomic(wsarray*) array;             /* current backing array     */
+} wsdeque;
+
+
+/* Cell of a bounded job ring */
+typedef struct ringcell{
+	atomic_ulong seq;                    /* lap the cell is ready for */
+	job*      job_p;                     /* the job                   */
+} ringcell;
+
+/* Bounded lock-free MPMC job ring (Vyukov)
+ * Any thread may push or pop, neither side takes a lock.  head and tail
+ * sit on their own cache lines so producers and consumers do not fight
+ * over one.
+ */
+typedef struct jobring{
+	ringcell* cells;                     /* power of two cells        */
+	unsigned long mask;                  /* cells - 1                 */
+	char      pad0[64];
+	atomic_ulong head;                   /* next cell to pop          */
+	char      pad1[64 - sizeof(atomic_ulong)];
+	atomic_ulong tail;                   /* next cell to push         */
+	char      pad2[64 - sizeof(atomic_ulong)];
+	csem      free_slots;                /* one post per free cell    */
+} jobring;
+
+
+/* Results a worker holds before it has to take queue_out's lock, power of two */
+#define RESULT_RING_SIZE                    1024
+
+/* Single-producer ring of a worker's finished jobs
+ * The worker adds at tail without a lock.  Whoever holds queue_out's
+ * lock moves them over to queue_out, so there is one consumer at a time.
+ */
+typedef struct resultring{
+	atomic_uint head;                    /* next slot to move over    */
+	char      pad0[64 - sizeof(atomic_uint)];
+	atomic_uint tail;                    /* next slot to fill         */
+	unsigned int head_seen;              /* worker's copy of head     */
+	char      pad1[64 - sizeof(atomic_uint) - sizeof(unsigned int)];
+	job*      slots[RESULT_RING_SIZE];   /* the finished jobs         */
+} resultring;
+
+
+#if THPOOL_IO_URING
+/* A worker's io_uring, set up and driven with raw system calls
+ *
+ * Only the owning worker adds to the submission queue and only the
+ * pool's io thread takes from the completion queue, so neither side
+ * needs a lock.
+ */
+typedef struct iouring{
+	int           fd;                    /* ring fd, -1 if none       */
+	unsigned int  entries;               /* submission queue size     */
+	atomic_int    in_flight;             /* submitted, not reaped     */
+	void*         sq_map;                /* mapped rings, cq_map may  */
+	size_t        sq_map_len;            /* be sq_map itself          */
+	void*         cq_map;
+	size_t        cq_map_len;
+	struct io_uring_sqe* sqes;           /* submission entries        */
+	size_t        sqes_len;
+	atomic_uint*  sq_head;               /* moved by the kernel       */
+	atomic_uint*  sq_tail;               /* moved by the worker       */
+	unsigned int* sq_array;
+	unsigned int  sq_mask;
+	atomic_uint*  cq_head;               /* moved by the io thread    */
+	atomic_uint*  cq_tail;               /* moved by the kernel       */
+	struct io_uring_cqe* cqes;
+	unsigned int  cq_mask;
+} iouring;
+#endif
+
 /* Thread */
 //TODO: Add a flushing state to the thread (for when a task requestor goes away unexpectedly)
 typedef struct thread{
 	int       id;                        /* friendly id               */
 	pthread_t pthread;                   /* pointer to actual thread  */
 	struct thpool_* thpool_p;            /* access to thpool          */
+	wsdeque   deque;                     /* jobs added by this thread */
+	jobqueue  inbox;                     /* jobs handed to the thread */
+	jobqueue  keyed;                     /* jobs of keys mapped here  */
+	atomic_int num_keyed;                /* jobs queued in keyed      */
+	atomic_int keyed_busy;               /* one keyed job at a time   */
+	unsigned int steal_seed;             /* victim selection state    */
+	int       spin_ns;                   /* current idle busy-wait    */
+	unsigned int picks;                  /* jobs taken, for aging     */
+	int       cpu;                       /* pinned to, or -1          */
+	int       node;                      /* NUMA node of cpu          */
+	atomic_int retire;                   /* asked to leave the pool   */
+	atomic_int running;                  /* pthread not yet returned  */
+	int       joinable;                  /* pthread still to be joined*/
+	/* Written twice per job and read only by thpool_pause(), so kept
+	 * off the lines thieves and producers touch */
+	char      pad0[64];
+	atomic_int starting;                 /* past the gate, not started*/
+	char      pad1[64 - sizeof(atomic_int)];
+	resultring results;                  /* finished, for queue_out   */
+#if THPOOL_IO_URING
+	iouring   ring;                      /* for thpool_add_io() jobs  */
+#endif
+#if THPOOL_METRICS
+	histogram queue_wait;                /* added until started       */
+	histogram run_time;                  /* started until done        */
+#endif
 } thread;
 
+/* Table of a pool's threads
+ * Slots are filled once and kept until thpool_destroy(), so threads that
+ * left the pool stay reachable for the jobs still queued on them.
+ */
+typedef struct threadtable{
+	int       size;                      /* slots                     */
+	struct threadtable* retired;         /* smaller table it replaced */
+	thread*   slots[];                   /* the threads               */
+} threadtable;
+
+/* Workers of a pool that run on one NUMA node */
+typedef struct numanode{
+	int*      workers;                   /* their thread ids          */
+	int       num_workers;
+	atomic_uint next_inbox;              /* round robin for add_work  */
+} numanode;
+
+/* Workers of a pool grouped by NUMA node
+ * Built for every thread id below size and rebuilt, not changed, when the
+ * thread table outgrows it; like that table it is kept until
+ * thpool_destroy() for readers still on it.
+ */
+typedef struct nodetable{
+	int       size;                      /* thread ids covered        */
+	int       num_nodes;
+	struct nodetable* retired;           /* smaller table it replaced */
+	numanode  nodes[];                   /* worker ids follow these   */
+} nodetable;
+
+/* Keys of keyed jobs hash to this many shards, each run by one thread */
+#define KEY_SHARDS                          256
+
 /* Threadpool */
 typedef struct thpool_{
-	thread**   threads;                  /* pointer to threads        */
-
-	volatile int num_threads_alive;      /* threads currently alive   */
-	volatile int num_threads_working;    /* threads currently working */
+	_Atomic(threadtable*) threads;       /* every thread ever started */
+	atomic_int num_threads;              /* threads jobs are routed to*/
+	atomic_int num_slots;                /* threads safe to reach     */
+	pthread_mutex_t resize_lock;         /* serialises size changes   */
+	int        min_threads;              /* autoscaler bounds, both   */
+	int        max_threads;              /* num_threads if it is off  */
+	int        scale_queue_depth;        /* queued jobs per thread    */
+	long long  scale_wait_ns;            /* queue wait that grows     */
+	long long  idle_linger_ns;           /* idle time before retiring */
+	atomic_int grow_requested;           /* reaper adds a thread      */
+
+	atomic_int num_threads_alive;        /* threads currently alive   */
 	pthread_mutex_t  thcount_lock;       /* used for thread count etc */
 	pthread_cond_t  threads_all_idle;    /* signal to thpool_wait     */
+	pthread_cond_t  threads_started;     /* signal to thpool_init     */
+	pthread_cond_t  threads_stopped;     /* signal to resize, destroy */
+	atomic_int num_idle_waiters;         /* threads in thpool_wait    */
+
+	atomic_int threads_keepalive;        /* live\die status flag      */
+	atomic_int threads_on_hold;          /* run\pause status flag     */
+	pthread_mutex_t  hold_lock;          /* used to park paused threads */
+	pthread_cond_t  threads_resumed;     /* signal to held threads    */
+	pthread_cond_t  threads_paused;      /* signal to thpool_pause    */
+
+	jobqueue  queue_in;                  /* shared queue, no workers  */
+	jobqueue  queue_high;                /* THPOOL_PRIO_HIGH jobs     */
+	jobqueue  queue_low;                 /* THPOOL_PRIO_LOW jobs      */
+	jobring   ring;                      /* bounded queue, if enabled */
+
+	/* Counters every job writes, each group on cache lines of its own
+	 * so it does not drag the read-mostly fields around it along */
+	char      pad0[64];
+	atomic_int num_threads_working;      /* threads currently working */
+	char      pad1[64 - sizeof(atomic_int)];
+	atomic_int num_jobs_queued;          /* jobs waiting in any queue */
+	csem      has_jobs;                  /* one post per queued job   */
+	char      pad2[64];
+	atomic_uint next_inbox;              /* round robin for add_work  */
+#if THPOOL_METRICS
+	atomic_ullong jobs_added;            /* jobs ever added           */
+#endif
+	char      pad3[64];
 
-	volatile int threads_keepalive;      /* live\die status flag      */
-	volatile int threads_on_hold;        /* run\pause status flag     */
-	pthread_mutex_t  alive_lock;         /* used for thpool run state */
-
-	jobqueue  queue_in;                  /* queue for pending jobs    */
+	atomic_int num_keyed_queued;         /* keyed jobs not done yet   */
+	int       key_rebalance_depth;       /* keyed backlog to move keys*/
+	atomic_ullong key_shards[KEY_SHARDS];/* owner << 32 | jobs pending*/
 	jobqueue  queue_out;                 /* queue for completed jobs  */
+	atomic_int num_result_waiters;       /* threads blocked on queue_out */
+	jobslab   job_slab;                  /* memory for all jobs       */
+
+	int       idle_spin_ns;              /* max idle busy-wait        */
+	int       idle_yields;               /* yields before sleeping    */
+
+	int*      cpus;                      /* CPUs to pin workers to    */
+	int       num_cpus;                  /* 0 leaves workers unpinned */
+	_Atomic(nodetable*) nodes;           /* NULL unless numa_local    */
+
+	int       completion_fd;             /* eventfd for results or -1 */
+	atomic_int completion_armed;         /* next result signals fd    */
+
+	long long result_ttl_ns;             /* uncollected result life   */
+	pthread_t reaper;                    /* frees results, grows pool */
+	int       reaper_running;            /* reaper needs joining      */
+	pthread_mutex_t reaper_lock;         /* used to stop the reaper   */
+	pthread_cond_t  reaper_wake;         /* signal to the reaper      */
+
+	unsigned int io_depth;               /* io_uring entries per worker */
+	int       io_event_fd;               /* every ring's CQEs signal it */
+	pthread_t io_thread;                 /* completes in-flight I/O   */
+	int       io_running;                /* io thread needs joining   */
+	atomic_int io_stop;                  /* io thread may leave once  */
+	atomic_int num_io_in_flight;         /* I/O jobs in some ring     */
+
+#if !defined(__linux__)
+	pthread_mutex_t future_lock;         /* futures sleep on a futex  */
+	pthread_cond_t  future_ready;        /* elsewhere, on this        */
+#endif
+
+#if THPOOL_METRICS
+	atomic_ullong jobs_dropped;          /* cancelled or expired      */
+	atomic_ullong jobs_collected;        /* results ever taken        */
+	atomic_ullong results_reaped;        /* results never taken       */
+	atomic_ullong io_submitted;          /* I/O jobs run by io_uring  */
+	atomic_ullong io_inline;             /* I/O jobs run on a worker  */
+	histogram queue_out_wait;            /* done until result taken   */
+#endif
 } thpool_;
 
 
 #define MAX_QUEUE_SIZE_WITHOUT_WARNING      100
 
+/* Clock used for result wait deadlines (monotonic where condvars support it) */
+#if defined(__APPLE__)
+#define THPOOL_CLOCK                        CLOCK_REALTIME
+#else
+#define THPOOL_CLOCK                        CLOCK_MONOTONIC
+#endif
+#define JOBQUEUE_INDEX_INIT_BUCKETS         256
+#define JOBSLAB_JOBS_PER_THREAD             32
+#define JOBSLAB_MAX_CHUNK_JOBS              16384
+#define JOBCACHE_BATCH                      32
+#define WSDEQUE_INIT_SIZE                   64
+#define STEAL_START_JITTER                  8
+#define PRIO_AGING_INTERVAL                 16
+#define TOPO_MAX_CPUS                       1024
+#define TOPO_NODE_REFRESH                   64
+#define JOBRING_MAX_CAPACITY                (1 << 30)
+#define IDLE_SPIN_NS_DEFAULT                20000
+#define IDLE_YIELDS_DEFAULT                 4
+#define IDLE_SPIN_CLOCK_EVERY               16
+#define SCALE_QUEUE_DEPTH_DEFAULT           2
+#define SCALE_WAIT_NS_DEFAULT               1000000LL
+#define IDLE_LINGER_NS_DEFAULT              1000000000LL
+#define CSEM_ANY                            0xffffffffU  /* every wake bit */
+#define REAPER_MIN_PERIOD_NS                1000000LL
+#define PARFOR_CHUNKS_PER_THREAD            8    /* default grain split       */
+#define IO_DEPTH_MAX                        4096 /* io_uring entries per worker */
+
+/* Job states, the rest of job->state counts how often the job was queued */
+#define JOB_QUEUED                          1
+#define JOB_RUNNING                         2
+#define JOB_CANCELLED                       3
+#define JOB_STATE_MASK                      3U
+
+/* Bits of job.future */
+#define FUTURE_ISSUED                       1    /* made by thpool_submit()   */
+#define FUTURE_READY                        2    /* result is in              */
+#define FUTURE_RELEASED                     4    /* caller let go of it       */
+#define FUTURE_WAITED                       8    /* someone sleeps on it      */
+
+/* Tell the CPU we are busy waiting */
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax()                         __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax()                         __asm__ __volatile__("yield")
+#else
+#define cpu_relax()
+#endif
+
 
 /* ========================== PROTOTYPES ============================ */
 
 
 static int   thread_init(thpool_* thpool_p, struct thread** thread_p, int id);
+static int   thread_start(struct thread* thread_p);
 static void* thread_do(struct thread* thread_p);
-static void  thread_hold(int sig_id);
+static int   thread_idle_wait(struct thread* thread_p);
+static int   thread_retire_idle(struct thread* thread_p);
+static int   thread_leaving(struct thread* thread_p);
+static void  thread_wait_stopped(struct thread* thread_p);
+static void  thread_hold(thpool_* thpool_p);
+static int   thread_enter_gate(struct thread* thread_p);
+static void  thread_leave_gate(struct thread* thread_p);
 static void  thread_destroy(struct thread* thread_p);
-
-static int   jobqueue_init(jobqueue* jobqueue_p);
+static struct job* thread_find_job(struct thread* thread_p);
+static struct job* thread_take_level(struct thread* thread_p, int prio);
+static int   thpool_add_job(thpool_* thpool_p, int prio, int job_uuid, th_func_p func_p, void* arg_p,
+                            th_done_p done_p, void* done_arg_p, long long timeout_ns, long long deadline_ns);
+static void* thpool_reaper(void* thpool_p);
+static void  thpool_signal_completion(thpool_* thpool_p);
+static struct job* thpool_future_job(thpool_* thpool_p, th_func_p func_p, void* arg_p);
+static void  thpool_future_complete(thpool_* thpool_p, struct job* job_p);
+static void  thpool_push_successor(thpool_* thpool_p, struct job* job_p);
+static int   parfor_run(void* parfor_p);
+static void  thpool_deliver(thpool_* thpool_p, struct job* job_p);
+static void  thpool_merge_results(thpool_* thpool_p);
+static void  thpool_drop_queued(thpool_* thpool_p);
+static void  thpool_drop_job(struct job* job_p);
+static int   thpool_io_run(void* job_p);
+static int   thpool_io_submit(struct thread* thread_p, struct job* job_p);
+static void* thpool_io_thread(void* thpool_p);
+static void  parfor_release(int job_uuid, int result, void* parfor_p);
+static int   thpool_uses_ring(thpool_* thpool_p);
+static int   thpool_reserve_slot(thpool_* thpool_p, long long timeout_ns);
+static void  thpool_release_slot(thpool_* thpool_p);
+static void  thpool_push_jobs(thpool_* thpool_p, int prio, struct job* first_p, struct job* last_p, int num_jobs);
+static int   thpool_key_owner(thpool_* thpool_p, int shard, int num_threads);
+static void  thpool_push_keyed(thpool_* thpool_p, struct job* job_p, int key);
+static struct job* thread_take_keyed(struct thread* owner_p);
+static struct job* thread_adopt_keyed(struct thread* thread_p);
+static void  thread_keyed_done(thpool_* thpool_p, int shard);
+static struct job* thread_steal_job(struct thread* thread_p);
+static struct job* thread_steal_from(struct thread* victim_p);
+static int   thpool_next_inbox(thpool_* thpool_p, int num_threads);
+static struct thread* thpool_thread(thpool_* thpool_p, int id);
+static int   thpool_grow_locked(thpool_* thpool_p, int num_threads);
+static void  thpool_autoscale(thpool_* thpool_p);
+static void  thpool_request_grow(thpool_* thpool_p);
+static int   thpool_init_cpus(thpool_* thpool_p, const thpool_config* config_p);
+static int   thpool_init_nodes(thpool_* thpool_p, int num_threads);
+static void  thpool_free_placement(thpool_* thpool_p);
+
+static int   topo_read_int(const char* path);
+static int   topo_cpu_node(int cpu);
+static int   topo_physical_cores(int** cpus_p);
+static int   topo_pin_self(int cpu);
+static int   topo_current_node(void);
+
+static void  job_arm(struct job* job_p);
+static int   job_cancel(struct job* job_p, int job_uuid);
+static int   job_claim(struct job* job_p);
+
+static int   jobqueue_init(jobqueue* jobqueue_p, unsigned int num_buckets);
 static void  jobqueue_clear(jobqueue* jobqueue_p);
 static void  jobqueue_push(jobqueue* jobqueue_p, struct job* newjob_p);
+static void  jobqueue_push_chain(jobqueue* jobqueue_p, struct job* first_p, struct job* last_p, int num_jobs);
+static void  jobqueue_link_chain(jobqueue* jobqueue_p, struct job* first_p, struct job* last_p, int num_jobs);
 static struct job* jobqueue_pull_front(jobqueue* jobqueue_p);
-static struct job* jobqueue_pull_by_uuid(jobqueue* jobqueue_p, int job_uuid);
+static struct job* jobqueue_unlink_by_uuid(jobqueue* jobqueue_p, int job_uuid);
+static struct job* jobqueue_pull_by_uuid(jobqueue* jobqueue_p, int job_uuid, const struct timespec* abstime);
+static struct job* jobqueue_pull_chain(jobqueue* jobqueue_p, int max_jobs, const struct timespec* abstime, int* num_jobs_p);
+static struct job* jobqueue_unlink_chain(jobqueue* jobqueue_p, int max_jobs, int* num_jobs_p);
+static struct job* jobqueue_pull_expired(jobqueue* jobqueue_p, long long now_ns, int* num_jobs_p);
+static int   jobqueue_cancel(jobqueue* jobqueue_p, int job_uuid);
+static void  jobqueue_wake_waiters(jobqueue* jobqueue_p, struct job* job_p);
 static int   jobqueue_length(jobqueue* jobqueue_p);
 static void  jobqueue_destroy(jobqueue* jobqueue_p);
 
-static int   bsem_init(struct bsem *bsem_p, int value);
-static void  bsem_reset(struct bsem *bsem_p);
-static void  bsem_post(struct bsem *bsem_p);
-static void  bsem_post_all(struct bsem *bsem_p);
-static void  bsem_wait(struct bsem *bsem_p);
-static void  bsem_destroy(struct bsem *bsem_p);
+static int   wsdeque_init(wsdeque* wsdeque_p);
+static int   wsdeque_push(wsdeque* wsdeque_p, struct job* job_p);
+static struct job* wsdeque_pop(wsdeque* wsdeque_p);
+static struct job* wsdeque_steal(wsdeque* wsdeque_p);
+static int   wsdeque_empty(wsdeque* wsdeque_p);
+static int   wsdeque_cancel(wsdeque* wsdeque_p, int job_uuid);
+static wsarray* wsdeque_grow(wsdeque* wsdeque_p, wsarray* array_p, long bottom, long top);
+static void  wsdeque_destroy(wsdeque* wsdeque_p);
+
+static int   jobring_init(jobring* jobring_p, int capacity);
+static int   jobring_push(jobring* jobring_p, struct job* job_p);
+static struct job* jobring_pop(jobring* jobring_p);
+static int   jobring_cancel(jobring* jobring_p, int job_uuid);
+static void  jobring_destroy(jobring* jobring_p);
+
+static void  resultring_init(resultring* resultring_p);
+static int   resultring_push(resultring* resultring_p, struct job* job_p);
+static int   resultring_empty(resultring* resultring_p);
+static int   resultring_size(resultring* resultring_p);
+static struct job* resultring_drain(resultring* resultring_p, struct job** last_p, int* num_jobs_p);
+
+static int   jobslab_init(jobslab* jobslab_p, int num_jobs);
+static int   jobslab_grow(jobslab* jobslab_p);
+static struct job* jobslab_alloc(jobslab* jobslab_p);
+static struct job* jobslab_alloc_batch(jobslab* jobslab_p, int num_jobs);
+static void  jobslab_free(jobslab* jobslab_p, struct job* job_p);
+static void  jobslab_destroy(jobslab* jobslab_p);
+static jobcache* jobcache_get(jobslab* jobslab_p);
+static void  jobcache_flush(jobcache* cache_p);
+static void  jobcache_thread_exit(void* cache_p);
+static void  jobcache_key_init(void);
+
+static unsigned int jobindex_hash(int job_uuid, unsigned int num_buckets);
+static void  jobindex_insert(jobqueue* jobqueue_p, struct job* job_p);
+static void  jobindex_remove(jobqueue* jobqueue_p, struct job* job_p);
+static void  jobindex_grow(jobqueue* jobqueue_p);
+
+#if THPOOL_IO_URING
+static int   iouring_init(iouring* ring_p, unsigned int entries, int event_fd);
+static int   iouring_probe(int ring_fd);
+static int   iouring_submit(iouring* ring_p, struct job* job_p);
+static struct job* iouring_pop(iouring* ring_p);
+static void  iouring_destroy(iouring* ring_p);
+#endif
+
+static int   csem_init(struct csem *csem_p, int value);
+static void  csem_post(struct csem *csem_p, int n);
+static int   csem_trywait(struct csem *csem_p);
+static int   csem_timedwait(struct csem *csem_p, const struct timespec* abstime);
+static int   csem_timedwait_flag(struct csem *csem_p, const struct timespec* abstime, atomic_int* flag_p,
+                                 atomic_int* flag2_p, unsigned int bit);
+static void  csem_kick(struct csem *csem_p, unsigned int bit);
+static void  csem_destroy(struct csem *csem_p);
+
+#if THPOOL_METRICS
+static long long metrics_now_ns(void);
+static void  histogram_init(histogram* histogram_p);
+static void  histogram_record(histogram* histogram_p, long long value_ns);
+static void  histogram_add_to(histogram* histogram_p, histsum* histsum_p);
+static void  histsum_latency(histsum* histsum_p, thpool_latency* latency_p);
+static void  thpool_record_collected(thpool_* thpool_p, struct job* job_p, long long now_ns);
+#endif
+
+static void  waiter_cond_init(pthread_cond_t* cond_p);
+static void  abstime_from_now(struct timespec* ts_p, long long timeout_ns);
+static long long clock_now_ns(void);
+
+
+/* Worker the calling thread is, NULL for threads outside any pool */
+static _Thread_local struct thread* thread_self = NULL;
+
+/* Successor list of a future whose job has finished */
+static jobdep jobdep_closed;
+#define JOBDEP_CLOSED                       (&jobdep_closed)
 
 
 
@@ -158,11 +694,64 @@ static void  bsem_destroy(struct bsem *bsem_p);
 
 /* Initialise thread pool */
 struct thpool_* thpool_init(int num_threads){
+	thpool_config config;
+	thpool_config_init(&config);
+	config.num_threads = num_threads;
+	return thpool_init_ex(&config);
+}
+
+
+/* Default thread pool settings */
+void thpool_config_init(thpool_config* config_p){
+	config_p->num_threads  = 0;
+	config_p->idle_spin_ns = IDLE_SPIN_NS_DEFAULT;
+	config_p->idle_yields  = IDLE_YIELDS_DEFAULT;
+	config_p->queue_capacity = 0;
+	config_p->completion_fd  = 0;
+	config_p->affinity       = THPOOL_AFFINITY_NONE;
+	config_p->cpus           = NULL;
+	config_p->num_cpus       = 0;
+	config_p->numa_local     = 0;
+	config_p->min_threads    = 0;
+	config_p->max_threads    = 0;
+	config_p->scale_queue_depth = SCALE_QUEUE_DEPTH_DEFAULT;
+	config_p->scale_wait_ns     = SCALE_WAIT_NS_DEFAULT;
+	config_p->idle_linger_ns    = IDLE_LINGER_NS_DEFAULT;
+	config_p->key_rebalance_depth = 0;
+	config_p->result_ttl_ns       = 0;
+	config_p->io_depth            = 0;
+}
+
+
+/* Initialise thread pool from settings */
+struct thpool_* thpool_init_ex(const thpool_config* config_p){
+
+	if (config_p == NULL){
+		err("thpool_init_ex(): No config given\n");
+		return NULL;
+	}
 
+	int num_threads = config_p->num_threads;
 	if (num_threads < 0){
 		num_threads = 0;
 	}
 
+	/* Autoscaler bounds, off unless a max_threads is given */
+	int min_threads = num_threads;
+	int max_threads = num_threads;
+	if (config_p->max_threads > 0){
+		if (config_p->min_threads > 0 && config_p->min_threads < num_threads){
+			min_threads = config_p->min_threads;
+		}
+		if (min_threads < 1){
+			min_threads = 1;
+		}
+		if (config_p->max_threads > max_threads){
+			max_threads = config_p->max_threads;
+		}
+	}
+	int table_size = max_threads > 0 ? max_threads : 1;
+
 	/* Make new thread pool */
 	thpool_* thpool_p;
 	thpool_p = (struct thpool_*)malloc(sizeof(struct thpool_));
@@ -170,67 +759,230 @@ struct thpool_* thpool_init(int num_threads){
 		err("thpool_init(): Could not allocate memory for thread pool\n");
 		return NULL;
 	}
-	thpool_p->num_threads_alive   = 0;
-	thpool_p->num_threads_working = 0;
-	thpool_p->threads_on_hold     = 0;
-	thpool_p->threads_keepalive   = 1;
+	atomic_init(&thpool_p->num_threads_alive, 0);
+	atomic_init(&thpool_p->num_threads_working, 0);
+	atomic_init(&thpool_p->num_idle_waiters, 0);
+	atomic_init(&thpool_p->num_result_waiters, 0);
+	atomic_init(&thpool_p->threads_on_hold, 0);
+	atomic_init(&thpool_p->threads_keepalive, 1);
+	atomic_init(&thpool_p->num_threads, 0);
+	atomic_init(&thpool_p->grow_requested, 0);
+	atomic_init(&thpool_p->num_slots, 0);
+	thpool_p->min_threads       = min_threads;
+	thpool_p->max_threads       = max_threads;
+	thpool_p->scale_queue_depth = config_p->scale_queue_depth > 0 ? config_p->scale_queue_depth : 1;
+	thpool_p->scale_wait_ns     = config_p->scale_wait_ns  > 0 ? config_p->scale_wait_ns  : 0;
+	thpool_p->idle_linger_ns    = config_p->idle_linger_ns > 0 ? config_p->idle_linger_ns : 0;
+	atomic_init(&thpool_p->num_jobs_queued, 0);
+	atomic_init(&thpool_p->num_keyed_queued, 0);
+	thpool_p->key_rebalance_depth = config_p->key_rebalance_depth > 0 ? config_p->key_rebalance_depth : 0;
+	int shard;
+	for (shard = 0; shard < KEY_SHARDS; shard++){
+		/* Owner out of range: mapped on first use */
+		atomic_init(&thpool_p->key_shards[shard], (unsigned long long)shard << 32);
+	}
+	atomic_init(&thpool_p->next_inbox, 0);
+	thpool_p->result_ttl_ns  = config_p->result_ttl_ns > 0 ? config_p->result_ttl_ns : 0;
+	thpool_p->reaper_running = 0;
+#if THPOOL_METRICS
+	atomic_init(&thpool_p->jobs_added, 0);
+	atomic_init(&thpool_p->jobs_dropped, 0);
+	atomic_init(&thpool_p->jobs_collected, 0);
+	atomic_init(&thpool_p->results_reaped, 0);
+	atomic_init(&thpool_p->io_submitted, 0);
+	atomic_init(&thpool_p->io_inline, 0);
+	histogram_init(&thpool_p->queue_out_wait);
+#endif
+
+	/* Busy-waiting only helps if whoever adds work can run meanwhile */
+	thpool_p->idle_spin_ns = config_p->idle_spin_ns > 0 ? config_p->idle_spin_ns : 0;
+	thpool_p->idle_yields  = config_p->idle_yields  > 0 ? config_p->idle_yields  : 0;
+	if (sysconf(_SC_NPROCESSORS_ONLN) <= 1){
+		thpool_p->idle_spin_ns = 0;
+	}
+
+	/* Where workers run */
+	thpool_p->cpus      = NULL;
+	thpool_p->num_cpus  = 0;
+	atomic_init(&thpool_p->nodes, NULL);
+	if (thpool_init_cpus(thpool_p, config_p) == -1){
+		free(thpool_p);
+		return NULL;
+	}
+	if (config_p->numa_local && thpool_init_nodes(thpool_p, table_size) == -1){
+		err("thpool_init(): Could not allocate memory for NUMA nodes\n");
+		thpool_free_placement(thpool_p);
+		free(thpool_p);
+		return NULL;
+	}
 
 	/* Initialise the job queue */
-	if (jobqueue_init(&thpool_p->queue_in) == -1){
+	if (jobqueue_init(&thpool_p->queue_in, 0) == -1){
 		err("thpool_init(): Could not allocate memory for input job queue\n");
+		thpool_free_placement(thpool_p);
 		free(thpool_p);
 		return NULL;
 	}
 
-	if (jobqueue_init(&thpool_p->queue_out) == -1){
+	/* No index, so these can not fail */
+	jobqueue_init(&thpool_p->queue_high, 0);
+	jobqueue_init(&thpool_p->queue_low, 0);
+
+	if (jobqueue_init(&thpool_p->queue_out, JOBQUEUE_INDEX_INIT_BUCKETS) == -1){
 		err("thpool_init(): Could not allocate memory for output job queue\n");
 		jobqueue_destroy(&thpool_p->queue_in);
+		thpool_free_placement(thpool_p);
+		free(thpool_p);
+		return NULL;
+	}
+
+	/* Preallocate job memory */
+	if (jobslab_init(&thpool_p->job_slab, num_threads * JOBSLAB_JOBS_PER_THREAD) == -1){
+		err("thpool_init(): Could not allocate memory for jobs\n");
+		jobqueue_destroy(&thpool_p->queue_out);
+		jobqueue_destroy(&thpool_p->queue_in);
+		thpool_free_placement(thpool_p);
+		free(thpool_p);
+		return NULL;
+	}
+
+	/* Readiness signal for event loops */
+	thpool_p->completion_fd = -1;
+	atomic_init(&thpool_p->completion_armed, 1);
+#if defined(__linux__)
+	if (config_p->completion_fd){
+		thpool_p->completion_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (thpool_p->completion_fd == -1){
+			err("thpool_init(): Could not create completion eventfd\n");
+			jobslab_destroy(&thpool_p->job_slab);
+			jobqueue_destroy(&thpool_p->queue_out);
+			jobqueue_destroy(&thpool_p->queue_in);
+			thpool_free_placement(thpool_p);
+			free(thpool_p);
+			return NULL;
+		}
+	}
+#endif
+
+	/* Bounded queue for jobs from outside the pool */
+	thpool_p->ring.cells = NULL;
+	if (config_p->queue_capacity > 0 &&
+	    jobring_init(&thpool_p->ring, config_p->queue_capacity) == -1){
+		err("thpool_init(): Could not allocate memory for bounded job queue\n");
+		if (thpool_p->completion_fd != -1){
+			close(thpool_p->completion_fd);
+		}
+		jobslab_destroy(&thpool_p->job_slab);
+		jobqueue_destroy(&thpool_p->queue_out);
+		jobqueue_destroy(&thpool_p->queue_in);
+		thpool_free_placement(thpool_p);
 		free(thpool_p);
 		return NULL;
 	}
 
 	/* Make threads in pool */
-	thpool_p->threads = (struct thread**)malloc(num_threads * sizeof(struct thread *));
-	if (thpool_p->threads == NULL){
+	threadtable* table_p = (threadtable*)calloc(1, sizeof(threadtable) + table_size * sizeof(thread*));
+	if (table_p == NULL){
 		err("thpool_init(): Could not allocate memory for threads\n");
+		if (thpool_p->ring.cells){
+			jobring_destroy(&thpool_p->ring);
+		}
+		if (thpool_p->completion_fd != -1){
+			close(thpool_p->completion_fd);
+		}
+		jobslab_destroy(&thpool_p->job_slab);
 		jobqueue_destroy(&thpool_p->queue_out);
 		jobqueue_destroy(&thpool_p->queue_in);
+		thpool_free_placement(thpool_p);
 		free(thpool_p);
 		return NULL;
 	}
 
+	table_p->size = table_size;
+	atomic_init(&thpool_p->threads, table_p);
+
 	pthread_mutex_init(&(thpool_p->thcount_lock), NULL);
-	pthread_mutex_init(&(thpool_p->alive_lock), NULL);
+	pthread_mutex_init(&(thpool_p->resize_lock), NULL);
+	pthread_mutex_init(&(thpool_p->hold_lock), NULL);
+	pthread_mutex_init(&(thpool_p->reaper_lock), NULL);
+	pthread_cond_init(&thpool_p->threads_resumed, NULL);
+	pthread_cond_init(&thpool_p->threads_paused, NULL);
+	waiter_cond_init(&thpool_p->reaper_wake);
 	pthread_cond_init(&thpool_p->threads_all_idle, NULL);
+	waiter_cond_init(&thpool_p->threads_started);
+	pthread_cond_init(&thpool_p->threads_stopped, NULL);
+#if !defined(__linux__)
+	pthread_mutex_init(&(thpool_p->future_lock), NULL);
+	waiter_cond_init(&thpool_p->future_ready);
+#endif
+	csem_init(&thpool_p->has_jobs, 0);
+
+	/* I/O jobs: a ring per worker, all signalling one eventfd */
+	thpool_p->io_depth    = 0;
+	thpool_p->io_event_fd = -1;
+	thpool_p->io_running  = 0;
+	atomic_init(&thpool_p->io_stop, 0);
+	atomic_init(&thpool_p->num_io_in_flight, 0);
+#if THPOOL_IO_URING
+	if (config_p->io_depth > 0){
+		thpool_p->io_event_fd = eventfd(0, EFD_CLOEXEC);
+		if (thpool_p->io_event_fd != -1){
+			thpool_p->io_depth = config_p->io_depth < IO_DEPTH_MAX ? config_p->io_depth : IO_DEPTH_MAX;
+		}
+	}
+#endif
 
 	/* Thread init */
 	int ret;
 	int n;
 	for (n=0; n<num_threads; n++){
-		ret = thread_init(thpool_p, &thpool_p->threads[n], n);
+		ret = thread_init(thpool_p, &table_p->slots[n], n);
 		if (ret) {
 			thpool_destroy(thpool_p);
 			return NULL;
 		}
+		/* Only now may other threads route work to (or steal from) it */
+		atomic_store_explicit(&thpool_p->num_slots, n + 1, memory_order_release);
+		atomic_store_explicit(&thpool_p->num_threads, n + 1, memory_order_release);
 	}
 
-	/* Wait for threads to initialize */
-	struct timespec ts;
-	int wait_count = 0;
-
-	ts.tv_sec  = 0;
-	ts.tv_nsec = 100;
-	while (thpool_p->num_threads_alive != num_threads){
-		nanosleep(&ts, &ts);
-		wait_count++;
-		if (wait_count > 100000000){//Kludge to give 10 sec max wait
+	/* Wait for threads to initialize, each one signals as it comes up */
+	struct timespec deadline;
+	int timed_out = 0;
+	abstime_from_now(&deadline, 10 * 1000000000LL);
+	pthread_mutex_lock(&thpool_p->thcount_lock);
+	while (atomic_load(&thpool_p->num_threads_alive) != num_threads && !timed_out){
+		timed_out = (pthread_cond_timedwait(&thpool_p->threads_started, &thpool_p->thcount_lock, &deadline) == ETIMEDOUT);
+	}
+	timed_out = atomic_load(&thpool_p->num_threads_alive) != num_threads;
+	pthread_mutex_unlock(&thpool_p->thcount_lock);
+	if (timed_out){
 #if THPOOL_DEBUG
-			printf("THPOOL_DEBUG: %s: Timeout waiting for all threads\n",
-			       __func__);
+		printf("THPOOL_DEBUG: %s: Timeout waiting for all threads\n",
+		       __func__);
 #endif
+		thpool_destroy(thpool_p);
+		return NULL;
+	}
+
+	/* Free results nobody collects, and start threads for the autoscaler */
+	if (thpool_p->result_ttl_ns || thpool_p->max_threads > thpool_p->min_threads){
+		if (pthread_create(&thpool_p->reaper, NULL, thpool_reaper, thpool_p) != 0){
+			err("thpool_init(): Could not create result reaper thread\n");
+			thpool_destroy(thpool_p);
+			return NULL;
+		}
+		thpool_p->reaper_running = 1;
+	}
+
+	/* Complete I/O jobs as the kernel finishes them */
+	if (thpool_p->io_depth){
+		if (pthread_create(&thpool_p->io_thread, NULL, thpool_io_thread, thpool_p) != 0){
+			err("thpool_init(): Could not create io thread\n");
 			thpool_destroy(thpool_p);
 			return NULL;
 		}
+		thpool_p->io_running = 1;
 	}
 
 	return thpool_p;
@@ -239,591 +991,4508 @@ struct thpool_* thpool_init(int num_threads){
 
 /* Add work to the thread pool */
 int thpool_add_work(thpool_* thpool_p, int job_uuid, th_func_p func_p, void* arg_p){
+	return thpool_add_work_timed(thpool_p, job_uuid, func_p, arg_p, -1);
+}
+
+
+/* Add work to the thread pool if its queue has room */
+int thpool_try_add_work(thpool_* thpool_p, int job_uuid, th_func_p func_p, void* arg_p){
+	return thpool_add_work_timed(thpool_p, job_uuid, func_p, arg_p, 0);
+}
+
+
+/* Add work to the thread pool, waiting up to timeout_ns for queue room */
+int thpool_add_work_timed(thpool_* thpool_p, int job_uuid, th_func_p func_p, void* arg_p, long long timeout_ns){
+	return thpool_add_job(thpool_p, THPOOL_PRIO_NORMAL, job_uuid, func_p, arg_p, NULL, NULL, timeout_ns, 0);
+}
+
+
+/* Add work that is dropped unless it starts within deadline_ns */
+int thpool_add_work_deadline(thpool_* thpool_p, int job_uuid, th_func_p func_p, void* arg_p, long long deadline_ns){
+	return thpool_add_job(thpool_p, THPOOL_PRIO_NORMAL, job_uuid, func_p, arg_p, NULL, NULL, -1,
+	                      deadline_ns > 0 ? clock_now_ns() + deadline_ns : 0);
+}
+
+
+/* Add work whose result goes to a callback instead of queue_out */
+int thpool_add_work_cb(thpool_* thpool_p, int job_uuid, th_func_p func_p, void* arg_p,
+                       th_done_p done_p, void* done_arg_p){
+	return thpool_add_job(thpool_p, THPOOL_PRIO_NORMAL, job_uuid, func_p, arg_p, done_p, done_arg_p, -1, 0);
+}
+
+
+/* Add work at a priority level */
+int thpool_add_work_prio(thpool_* thpool_p, int prio, int job_uuid, th_func_p func_p, void* arg_p){
+	if (prio < THPOOL_PRIO_HIGH || prio > THPOOL_PRIO_LOW){
+		err("thpool_add_work_prio(): Invalid priority\n");
+		return -1;
+	}
+	return thpool_add_job(thpool_p, prio, job_uuid, func_p, arg_p, NULL, NULL, -1, 0);
+}
+
+
+/* Add work that runs in order with, and on the same thread as, the
+ * other jobs of its key */
+int thpool_add_work_keyed(thpool_* thpool_p, int key, int job_uuid, th_func_p func_p, void* arg_p){
+	job* newjob;
+
+	newjob=jobslab_alloc(&thpool_p->job_slab);
+	if (newjob==NULL){
+		err("thpool_add_work_keyed(): Could not allocate memory for new job\n");
+		return -1;
+	}
+
+	newjob->function=func_p;
+	newjob->arg=arg_p;
+	newjob->done=NULL;
+	newjob->done_arg=NULL;
+	newjob->prev=NULL;
+	newjob->uuid=job_uuid;
+	newjob->deadline_ns=0;
+	atomic_store_explicit(&newjob->future, 0, memory_order_relaxed);
+
+	thpool_push_keyed(thpool_p, newjob, key);
+	return 0;
+}
+
+
+/* Make a job and queue it
+ * @param prio          THPOOL_PRIO_*, only NORMAL jobs count against a bounded queue
+ * @param done_p        NULL sends the result to queue_out
+ * @param timeout_ns    wait for room in a bounded queue, see thpool_reserve_slot()
+ * @param deadline_ns   absolute THPOOL_CLOCK time to start by, 0 for none
+ */
+static int thpool_add_job(thpool_* thpool_p, int prio, int job_uuid, th_func_p func_p, void* arg_p,
+                          th_done_p done_p, void* done_arg_p, long long timeout_ns, long long deadline_ns){
 	job* newjob;
 
-	newjob=(struct job*)malloc(sizeof(struct job));
+	if (prio == THPOOL_PRIO_NORMAL && thpool_reserve_slot(thpool_p, timeout_ns) == -1){
+		return -1;
+	}
+
+	newjob=jobslab_alloc(&thpool_p->job_slab);
 	if (newjob==NULL){
 		err("thpool_add_work(): Could not allocate memory for new job\n");
+		if (prio == THPOOL_PRIO_NORMAL){
+			thpool_release_slot(thpool_p);
+		}
 		return -1;
 	}
 
 	/* add function and argument */
 	newjob->function=func_p;
 	newjob->arg=arg_p;
+	newjob->done=done_p;
+	newjob->done_arg=done_arg_p;
+	newjob->shard=-1;
+	newjob->deadline_ns=deadline_ns;
+	atomic_store_explicit(&newjob->future, 0, memory_order_relaxed);
 
 	newjob->prev=NULL;
 	newjob->uuid=job_uuid;
 
 	/* add job to queue */
-	jobqueue_push(&thpool_p->queue_in, newjob);
+	thpool_push_jobs(thpool_p, prio, newjob, newjob, 1);
 
 	return 0;
 }
 
-/* Extract result from thread pool */
-int thpool_find_result(thpool_* thpool_p, int job_uuid, int retry_count_max, int retry_interval_ns, int* result_p){
 
-	struct timespec ts;
-	job* completed_job;
-	int retry_count = 0;
-	int result_found = 0;
+/* Add a burst of work to the thread pool */
+int thpool_add_work_batch(thpool_* thpool_p, int num_jobs, const int job_uuids[],
+                          const th_func_p func_ps[], void* const arg_ps[]){
+	job* first_job;
+	job* job_p;
+	job* last_job = NULL;
+	int n;
+
+	if (num_jobs <= 0){
+		return 0;
+	}
 
-	ts.tv_sec  = 0;
-	ts.tv_nsec = retry_interval_ns;
+	/* allocate all jobs in one go, already chained front to rear */
+	first_job = jobslab_alloc_batch(&thpool_p->job_slab, num_jobs);
+	if (first_job==NULL){
+		err("thpool_add_work_batch(): Could not allocate memory for new jobs\n");
+		return -1;
+	}
 
-	while(retry_count < retry_count_max){
+	for (n = 0, job_p = first_job; n < num_jobs; n++, job_p = job_p->prev){
+		job_p->function = func_ps[n];
+		job_p->arg      = arg_ps ? arg_ps[n] : NULL;
+		job_p->uuid     = job_uuids[n];
+		job_p->done     = NULL;
+		job_p->shard    = -1;
+		job_p->deadline_ns = 0;
+		atomic_store_explicit(&job_p->future, 0, memory_order_relaxed);
+		last_job = job_p;
+	}
 
-		completed_job = jobqueue_pull_by_uuid(&thpool_p->queue_out, job_uuid);
-		if (completed_job){
-			*result_p = completed_job->result;
-			free(completed_job);
-			result_found = 1;
-			break;
+	/* a bounded queue takes them one by one, as room frees up */
+	if (thpool_uses_ring(thpool_p)){
+		job_p = first_job;
+		while (job_p){
+			job* next_p = job_p->prev;
+			job_p->prev = NULL;
+			thpool_reserve_slot(thpool_p, -1);
+			thpool_push_jobs(thpool_p, THPOOL_PRIO_NORMAL, job_p, job_p, 1);
+			job_p = next_p;
 		}
-		else{
-			nanosleep(&ts, &ts);
-		}
-		retry_count++;
+		return 0;
 	}
 
-	if (result_found){
-#if THPOOL_DEBUG
-		printf("THPOOL_DEBUG: %s: job(%p) found: uuid %d\n",
-		       __func__, completed_job, job_uuid);
-#endif
+	/* add all jobs to queue */
+	thpool_push_jobs(thpool_p, THPOOL_PRIO_NORMAL, first_job, last_job, num_jobs);
+
+	return 0;
+}
+
+
+/* Whether jobs added by the calling thread go through the bounded ring
+ *
+ * Jobs that workers add from inside a job bypass it (they go to the
+ * worker's own deque): a worker blocked on a full queue could be the
+ * very one meant to drain it.
+ */
+static int thpool_uses_ring(thpool_* thpool_p){
+	return thpool_p->ring.cells && !(thread_self && thread_self->thpool_p == thpool_p);
+}
+
+
+/* Reserve room for one job in the bounded ring, if the caller uses it
+ *
+ * @param timeout_ns    0 fails at once, negative waits forever
+ * @return 0 on success, -1 with errno EAGAIN (no waiting) or ETIMEDOUT
+ */
+static int thpool_reserve_slot(thpool_* thpool_p, long long timeout_ns){
+	struct timespec abstime;
+
+	if (!thpool_uses_ring(thpool_p) || csem_trywait(&thpool_p->ring.free_slots)){
 		return 0;
 	}
-	else{
-#if THPOOL_DEBUG
-		printf("THPOOL_DEBUG: %s: job NOT found: uuid %d\n",
-		       __func__, job_uuid);
-#endif
+	if (timeout_ns == 0){
+		errno = EAGAIN;
+		return -1;
+	}
+	if (timeout_ns > 0){
+		abstime_from_now(&abstime, timeout_ns);
+	}
+	if (csem_timedwait(&thpool_p->ring.free_slots, timeout_ns > 0 ? &abstime : NULL) == -1){
+		errno = ETIMEDOUT;
 		return -1;
 	}
+	return 0;
 }
 
 
-/* Wait until all jobs have finished */
-//TODO: Hardcoded for "thpool_p->queue_in".
-//		Can "thpool_p->queue_out" even use this concept?
-//				(queue_out NOT GUARENTEED to be emptied out via thpool_find_results())
-//			If NOT, rename function?
-void thpool_wait(thpool_* thpool_p){
-	pthread_mutex_lock(&thpool_p->thcount_lock);
-	while (jobqueue_length(&thpool_p->queue_in) || thpool_p->num_threads_working) {
-		pthread_cond_wait(&thpool_p->threads_all_idle, &thpool_p->thcount_lock);
+/* Give back room reserved by thpool_reserve_slot() */
+static void thpool_release_slot(thpool_* thpool_p){
+	if (thpool_uses_ring(thpool_p)){
+		csem_post(&thpool_p->ring.free_slots, 1);
 	}
-	pthread_mutex_unlock(&thpool_p->thcount_lock);
 }
 
 
-/* Destroy the threadpool */
-/* Retrieve any desired output before calling this destroy */
-void thpool_destroy(thpool_* thpool_p){
-	/* No need to destroy if it's NULL */
-	if (thpool_p == NULL) return ;
-
-	volatile int threads_total = thpool_num_threads_alive(thpool_p);
+/* Thread in slot id of the pool's table, id < num_slots */
+static struct thread* thpool_thread(thpool_* thpool_p, int id){
+	return atomic_load_explicit(&thpool_p->threads, memory_order_acquire)->slots[id];
+}
 
-	/* End each thread 's infinite loop */
-	pthread_mutex_lock(&thpool_p->alive_lock);
-	thpool_p->threads_keepalive = 0;
-	pthread_mutex_unlock(&thpool_p->alive_lock);
 
-	/* Give one second to kill idle threads */
-	double TIMEOUT = 1.0;
-	time_t start, end;
-	double tpassed = 0.0;
-	time (&start);
-	while (tpassed < TIMEOUT && thpool_num_threads_alive(thpool_p)){
-		bsem_post_all(thpool_p->queue_in.has_jobs);
-		time (&end);
-		tpassed = difftime(end,start);
+/* Start threads until num_threads take jobs, resize_lock held
+ *
+ * Slots of threads that left are reused: a thread asked to leave that
+ * has not noticed yet just stays, one already leaving is waited for and
+ * started afresh.
+ *
+ * @return 0 on success, -1 otherwise
+ */
+static int thpool_grow_locked(thpool_* thpool_p, int num_threads){
+	threadtable* table_p = atomic_load(&thpool_p->threads);
+	if (num_threads > table_p->size){
+		int size = 2 * table_p->size > num_threads ? 2 * table_p->size : num_threads;
+		threadtable* bigger_p = (threadtable*)calloc(1, sizeof(threadtable) + size * sizeof(thread*));
+		if (bigger_p == NULL){
+			err("thpool_resize(): Could not allocate memory for threads\n");
+			return -1;
+		}
+		/* Readers may still be on the old table, it goes at thpool_destroy() */
+		bigger_p->size    = size;
+		bigger_p->retired = table_p;
+		memcpy(bigger_p->slots, table_p->slots, table_p->size * sizeof(thread*));
+		atomic_store_explicit(&thpool_p->threads, bigger_p, memory_order_release);
+		table_p = bigger_p;
 	}
-
-	/* Poll remaining threads */
-	while (thpool_num_threads_alive(thpool_p)){
-		bsem_post_all(thpool_p->queue_in.has_jobs);
-		sleep(1);
+	/* New threads must be in their node's workers to get its jobs */
+	nodetable* nodes_p = atomic_load(&thpool_p->nodes);
+	if (nodes_p && nodes_p->size < table_p->size && thpool_init_nodes(thpool_p, table_p->size) == -1){
+		err("thpool_resize(): Could not allocate memory for NUMA nodes\n");
+		return -1;
 	}
 
-	/* Job queue cleanup */
-	jobqueue_destroy(&thpool_p->queue_out);
-	jobqueue_destroy(&thpool_p->queue_in);
-	/* Deallocs */
 	int n;
-	for (n=0; n < threads_total; n++){
-		thread_destroy(thpool_p->threads[n]);
+	for (n = atomic_load(&thpool_p->num_threads); n < num_threads; n++){
+		if (n < atomic_load(&thpool_p->num_slots)){
+			thread* thread_p = table_p->slots[n];
+			int asked = 1;
+			if (!atomic_compare_exchange_strong(&thread_p->retire, &asked, 0)){
+				thread_wait_stopped(thread_p);
+				if (thread_start(thread_p) == -1){
+					return -1;
+				}
+			}
+		}
+		else {
+			/* Under hold_lock: a thpool_pause() either scans the new
+			 * slot, or ran before the thread starts and it sees the gate */
+			pthread_mutex_lock(&thpool_p->hold_lock);
+			int failed = thread_init(thpool_p, &table_p->slots[n], n) == -1;
+			if (!failed){
+				atomic_store_explicit(&thpool_p->num_slots, n + 1, memory_order_release);
+			}
+			pthread_mutex_unlock(&thpool_p->hold_lock);
+			if (failed){
+				return -1;
+			}
+		}
+		atomic_store_explicit(&thpool_p->num_threads, n + 1, memory_order_release);
 	}
-	free(thpool_p->threads);
-	pthread_mutex_destroy(&thpool_p->thcount_lock);
-	pthread_mutex_destroy(&thpool_p->alive_lock);
-	pthread_cond_destroy(&thpool_p->threads_all_idle);
-	free(thpool_p);
+	return 0;
 }
 
 
-/* Pause all threads in threadpool */
-void thpool_pause(thpool_* thpool_p) {
-	int n;
-	for (n=0; n < thpool_num_threads_alive(thpool_p); n++){
-		pthread_kill(thpool_p->threads[n]->pthread, SIGUSR1);
+/* Add a thread for a backlog, unless at max_threads or already resizing */
+static void thpool_autoscale(thpool_* thpool_p){
+	if (pthread_mutex_trylock(&thpool_p->resize_lock) != 0){
+		return;
 	}
-	thpool_p->threads_on_hold = 1;
-}
-
-
-/* Resume all threads in threadpool */
-void thpool_resume(thpool_* thpool_p) {
-	int n;
-	for (n=0; n < thpool_num_threads_alive(thpool_p); n++){
-		pthread_kill(thpool_p->threads[n]->pthread, SIGUSR2);
+	int num_threads = atomic_load(&thpool_p->num_threads);
+	if (num_threads < thpool_p->max_threads && thpool_alive_state(thpool_p)){
+		thpool_grow_locked(thpool_p, num_threads + 1);
 	}
-	thpool_p->threads_on_hold = 0;
+	pthread_mutex_unlock(&thpool_p->resize_lock);
 }
 
 
-int thpool_num_threads_alive(thpool_* thpool_p){
-	int num;
-	pthread_mutex_lock(&thpool_p->thcount_lock);
-	num = thpool_p->num_threads_alive;
-	pthread_mutex_unlock(&thpool_p->thcount_lock);
-	return num;
+/* Have the reaper add a thread for a backlog
+ *
+ * Starting a thread takes far longer than queueing a job, so the one
+ * who sees the backlog only raises a flag.  Only the first one to raise
+ * it wakes the reaper.
+ */
+static void thpool_request_grow(thpool_* thpool_p){
+	if (atomic_load_explicit(&thpool_p->grow_requested, memory_order_relaxed) == 0 &&
+	    atomic_exchange(&thpool_p->grow_requested, 1) == 0){
+		pthread_mutex_lock(&thpool_p->reaper_lock);
+		pthread_cond_signal(&thpool_p->reaper_wake);
+		pthread_mutex_unlock(&thpool_p->reaper_lock);
+	}
 }
 
 
-int thpool_num_threads_working(thpool_* thpool_p){
-	int num;
-	pthread_mutex_lock(&thpool_p->thcount_lock);
-	num = thpool_p->num_threads_working;
-	pthread_mutex_unlock(&thpool_p->thcount_lock);
-	return num;
+/* Count a node's workers still in the pool: their ids are ascending, so
+ * after a shrink those that left are the tail of the list */
+static int numanode_workers_below(numanode* node_p, int num_threads){
+	int lo = 0;
+	int hi = node_p->num_workers;
+	while (lo < hi){
+		int mid = lo + (hi - lo) / 2;
+		if (node_p->workers[mid] < num_threads){
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	return lo;
 }
 
 
-int thpool_queue_out_len(thpool_* thpool_p){
-	return jobqueue_length(&thpool_p->queue_out);
+/* Pick the worker whose inbox gets the next job from outside the pool
+ *
+ * NUMA pools keep jobs on the submitter's node, so their memory stays
+ * close to the worker running them; the rest simply go round robin.
+ */
+static int thpool_next_inbox(thpool_* thpool_p, int num_threads){
+	nodetable* nodes_p = atomic_load_explicit(&thpool_p->nodes, memory_order_acquire);
+	if (nodes_p){
+		int node = topo_current_node();
+		int num_workers = node < nodes_p->num_nodes ? numanode_workers_below(&nodes_p->nodes[node], num_threads) : 0;
+		if (num_workers){
+			numanode* node_p = &nodes_p->nodes[node];
+			unsigned int n = atomic_fetch_add_explicit(&node_p->next_inbox, 1, memory_order_relaxed);
+			return node_p->workers[n % num_workers];
+		}
+	}
+	unsigned int n = atomic_fetch_add_explicit(&thpool_p->next_inbox, 1, memory_order_relaxed);
+	return n % num_threads;
 }
 
 
-int thpool_alive_state(thpool_* thpool_p){
-	int state;
-	pthread_mutex_lock(&thpool_p->alive_lock);
-	state = thpool_p->threads_keepalive;
-	pthread_mutex_unlock(&thpool_p->alive_lock);
-	return state;
+/* Route a chain of jobs to a worker and wake idle threads
+ *
+ * HIGH and LOW jobs go to the pool's queue for their level.  NORMAL jobs
+ * added from inside a job go to the calling worker's own deque,
+ * where they need no lock and are the first thing idle workers steal.
+ * Jobs from any other thread go to the bounded ring if the pool has one,
+ * else to the next worker's inbox, round robin, with a whole chain
+ * spliced in under one lock.  A pool without workers keeps its jobs in
+ * queue_in.
+ *
+ * @param prio          THPOOL_PRIO_* level of every job in the chain
+ * @param first_p       front of the chain (linked through ->prev)
+ * @param last_p        rear of the chain
+ * @param num_jobs      jobs in the chain
+ */
+static void thpool_push_jobs(thpool_* thpool_p, int prio, struct job* first_p, struct job* last_p, int num_jobs){
+	int num_threads = atomic_load_explicit(&thpool_p->num_threads, memory_order_acquire);
+	job* stamp_p;
+
+#if THPOOL_METRICS
+	long long now_ns = metrics_now_ns();
+	for (stamp_p = first_p; stamp_p; stamp_p = stamp_p->prev){
+		stamp_p->metrics.queued_ns = now_ns;
+	}
+	atomic_fetch_add_explicit(&thpool_p->jobs_added, num_jobs, memory_order_relaxed);
+#endif
+	for (stamp_p = first_p; stamp_p; stamp_p = stamp_p->prev){
+		job_arm(stamp_p);
+	}
+
+	if (prio == THPOOL_PRIO_HIGH){
+		jobqueue_push_chain(&thpool_p->queue_high, first_p, last_p, num_jobs);
+	}
+	else if (prio == THPOOL_PRIO_LOW){
+		jobqueue_push_chain(&thpool_p->queue_low, first_p, last_p, num_jobs);
+	}
+	else if (thread_self && thread_self->thpool_p == thpool_p){
+		job* job_p = first_p;
+		while (job_p){
+			job* next_p = job_p->prev;
+			if (wsdeque_push(&thread_self->deque, job_p) == -1){
+				jobqueue_push(&thread_self->inbox, job_p);
+			}
+			job_p = next_p;
+		}
+	}
+	else if (thpool_p->ring.cells){
+		/* Room was reserved by thpool_reserve_slot() */
+		job* job_p = first_p;
+		while (job_p){
+			job* next_p = job_p->prev;
+			jobring_push(&thpool_p->ring, job_p);
+			job_p = next_p;
+		}
+	}
+	else if (num_threads){
+		int id = thpool_next_inbox(thpool_p, num_threads);
+		jobqueue_push_chain(&thpool_thread(thpool_p, id)->inbox, first_p, last_p, num_jobs);
+	}
+	else{
+		jobqueue_push_chain(&thpool_p->queue_in, first_p, last_p, num_jobs);
+	}
+
+	int queued = atomic_fetch_add_explicit(&thpool_p->num_jobs_queued, num_jobs, memory_order_seq_cst) + num_jobs;
+	csem_post(&thpool_p->has_jobs, num_jobs);
+
+	if (thpool_p->max_threads > thpool_p->min_threads &&
+	    queued > num_threads * thpool_p->scale_queue_depth){
+		thpool_request_grow(thpool_p);
+	}
+}
+
+
+/* Queue a keyed job on the thread its key maps to and wake that thread
+ *
+ * All jobs of a shard, so of a key, wait in one thread's keyed queue,
+ * which only ever has one job taken out and running at a time.  They do
+ * not count in num_jobs_queued nor post has_jobs: no other thread may
+ * run them, so only the owner is woken, through its num_keyed flag.
+ */
+static void thpool_push_keyed(thpool_* thpool_p, struct job* job_p, int key){
+	int num_threads = atomic_load_explicit(&thpool_p->num_threads, memory_order_acquire);
+
+#if THPOOL_METRICS
+	job_p->metrics.queued_ns = metrics_now_ns();
+	atomic_fetch_add_explicit(&thpool_p->jobs_added, 1, memory_order_relaxed);
+#endif
+	job_arm(job_p);
+
+	if (num_threads == 0){
+		/* No thread to keep the order on, queue it like any other job */
+		job_p->shard = -1;
+		jobqueue_push(&thpool_p->queue_in, job_p);
+		atomic_fetch_add(&thpool_p->num_jobs_queued, 1);
+		csem_post(&thpool_p->has_jobs, 1);
+		return;
+	}
+
+	int shard = (int)jobindex_hash(key, KEY_SHARDS);
+	job_p->shard = shard;
+	atomic_fetch_add(&thpool_p->num_keyed_queued, 1);
+
+	int owner = thpool_key_owner(thpool_p, shard, num_threads);
+	thread* owner_p = thpool_thread(thpool_p, owner);
+	int backlog = atomic_fetch_add(&owner_p->num_keyed, 1);
+	jobqueue_push(&owner_p->keyed, job_p);
+
+	if (owner >= atomic_load(&thpool_p->num_threads)){
+		/* Its thread left the pool while the shard had jobs, any thread
+		 * may adopt them now */
+		csem_post(&thpool_p->has_jobs, 1);
+	}
+	else if (backlog == 0){
+		/* With a backlog the owner is awake already and will not sleep
+		 * before it is done */
+		csem_kick(&thpool_p->has_jobs, 1U << (owner % 32));
+	}
+}
+
+
+/* Pick the thread a key shard runs on and count one more job pending
+ *
+ * A shard only moves while none of its jobs are queued or running, so
+ * jobs of a key never overtake each other.  It moves then if its thread
+ * left the pool, or, with key_rebalance_depth set, if its thread has more
+ * keyed jobs queued than that and some other thread has under half as
+ * many.
+ *
+ * @return the thread id
+ */
+static int thpool_key_owner(thpool_* thpool_p, int shard, int num_threads){
+	atomic_ullong* shard_p = &thpool_p->key_shards[shard];
+	unsigned long long word = atomic_load(shard_p);
+
+	for (;;){
+		int owner = (int)(word >> 32);
+		unsigned int pending = (unsigned int)word;
+
+		if (pending == 0 && owner >= num_threads){
+			owner = shard % num_threads;
+		}
+		else if (pending == 0 && thpool_p->key_rebalance_depth){
+			int backlog = atomic_load(&thpool_thread(thpool_p, owner)->num_keyed);
+			if (backlog > thpool_p->key_rebalance_depth){
+				int id;
+				for (id = 0; id < num_threads; id++){
+					int other = atomic_load(&thpool_thread(thpool_p, id)->num_keyed);
+					if (other < backlog / 2){
+						owner   = id;
+						backlog = other;
+					}
+				}
+			}
+		}
+
+		unsigned long long next = ((unsigned long long)owner << 32) | (pending + 1);
+		if (atomic_compare_exchange_weak(shard_p, &word, next)){
+			return owner;
+		}
+	}
+}
+
+/* Extract result from thread pool, waiting up to timeout_ns for it */
+int thpool_wait_result(thpool_* thpool_p, int job_uuid, long long timeout_ns, int* result_p){
+
+	struct timespec abstime;
+	job* completed_job;
+
+	/* Look without announcing first, workers only merge for us once we
+	 * may have to sleep */
+	pthread_mutex_lock(&thpool_p->queue_out.rwmutex);
+	thpool_merge_results(thpool_p);
+	completed_job = jobqueue_unlink_by_uuid(&thpool_p->queue_out, job_uuid);
+	pthread_mutex_unlock(&thpool_p->queue_out.rwmutex);
+
+	if (completed_job == NULL && timeout_ns != 0){
+		if (timeout_ns > 0){
+			abstime_from_now(&abstime, timeout_ns);
+		}
+
+		/* Announce before merging, see thpool_deliver() */
+		atomic_fetch_add(&thpool_p->num_result_waiters, 1);
+		pthread_mutex_lock(&thpool_p->queue_out.rwmutex);
+		thpool_merge_results(thpool_p);
+		pthread_mutex_unlock(&thpool_p->queue_out.rwmutex);
+		completed_job = jobqueue_pull_by_uuid(&thpool_p->queue_out, job_uuid,
+		                                      timeout_ns > 0 ? &abstime : NULL);
+		atomic_fetch_sub(&thpool_p->num_result_waiters, 1);
+	}
+
+	if (completed_job){
+		*result_p = completed_job->result;
+#if THPOOL_METRICS
+		thpool_record_collected(thpool_p, completed_job, metrics_now_ns());
+#endif
+#if THPOOL_DEBUG
+		printf("THPOOL_DEBUG: %s: job(%p) found: uuid %d\n",
+		       __func__, completed_job, job_uuid);
+#endif
+		jobslab_free(&thpool_p->job_slab, completed_job);
+		return 0;
+	}
+	else{
+#if THPOOL_DEBUG
+		printf("THPOOL_DEBUG: %s: job NOT found: uuid %d\n",
+		       __func__, job_uuid);
+#endif
+		return -1;
+	}
+}
+
+
+/* Extract every available result from thread pool, up to max_results */
+int thpool_collect_results(thpool_* thpool_p, int max_results, int job_uuids[], int results[], long long timeout_ns){
+
+	struct timespec abstime;
+	job* job_p = NULL;
+	int num_jobs = 0;
+	int n;
+
+	if (max_results <= 0){
+		return 0;
+	}
+
+	/* Clear the completion fd first and re-arm it, so any result that
+	 * lands after the pull below signals it again */
+	if (thpool_p->completion_fd != -1){
+		uint64_t count;
+		if (read(thpool_p->completion_fd, &count, sizeof(count)) == -1 && errno != EAGAIN){
+			err("thpool_collect_results(): Could not read completion fd\n");
+		}
+		atomic_store(&thpool_p->completion_armed, 1);
+	}
+
+	/* Take what is there without announcing first, workers only merge
+	 * for us once we may have to sleep */
+	pthread_mutex_lock(&thpool_p->queue_out.rwmutex);
+	thpool_merge_results(thpool_p);
+	job_p = jobqueue_unlink_chain(&thpool_p->queue_out, max_results, &num_jobs);
+	pthread_mutex_unlock(&thpool_p->queue_out.rwmutex);
+
+	if (num_jobs == 0 && timeout_ns != 0){
+		if (timeout_ns > 0){
+			abstime_from_now(&abstime, timeout_ns);
+		}
+
+		/* Announce before merging, see thpool_deliver() */
+		atomic_fetch_add(&thpool_p->num_result_waiters, 1);
+		pthread_mutex_lock(&thpool_p->queue_out.rwmutex);
+		thpool_merge_results(thpool_p);
+		pthread_mutex_unlock(&thpool_p->queue_out.rwmutex);
+		job_p = jobqueue_pull_chain(&thpool_p->queue_out, max_results,
+		                            timeout_ns > 0 ? &abstime : NULL, &num_jobs);
+		atomic_fetch_sub(&thpool_p->num_result_waiters, 1);
+	}
+
+	/* Results left behind must keep the fd readable */
+	if (thpool_p->completion_fd != -1 && jobqueue_length(&thpool_p->queue_out)){
+		thpool_signal_completion(thpool_p);
+	}
+
+#if THPOOL_METRICS
+	long long now_ns = num_jobs ? metrics_now_ns() : 0;
+#endif
+	for (n = 0; n < num_jobs; n++){
+		job* next_p = job_p->prev;
+		job_uuids[n] = job_p->uuid;
+		results[n]   = job_p->result;
+#if THPOOL_METRICS
+		thpool_record_collected(thpool_p, job_p, now_ns);
+#endif
+		jobslab_free(&thpool_p->job_slab, job_p);
+		job_p = next_p;
+	}
+	return num_jobs;
+}
+
+
+/* Snapshot of the pool's counters and latency histograms */
+int thpool_get_stats(thpool_* thpool_p, thpool_stats* stats_p){
+	memset(stats_p, 0, sizeof(*stats_p));
+	stats_p->jobs_queued     = atomic_load(&thpool_p->num_jobs_queued);
+	stats_p->results_waiting = atomic_load_explicit(&thpool_p->queue_out.len, memory_order_relaxed);
+	int num_slots = atomic_load_explicit(&thpool_p->num_slots, memory_order_acquire);
+	int n;
+	for (n = 0; n < num_slots; n++){
+		stats_p->results_waiting += resultring_size(&thpool_thread(thpool_p, n)->results);
+#if THPOOL_IO_URING
+		stats_p->io_rings += thpool_thread(thpool_p, n)->ring.fd != -1;
+#endif
+	}
+
+#if THPOOL_METRICS
+	histsum* sums_p = (histsum*)calloc(3, sizeof(histsum));
+	if (sums_p == NULL){
+		err("thpool_get_stats(): Could not allocate memory for histograms\n");
+		return -1;
+	}
+
+	/* Threads that left the pool still count */
+	for (n = 0; n < num_slots; n++){
+		histogram_add_to(&thpool_thread(thpool_p, n)->queue_wait, &sums_p[0]);
+		histogram_add_to(&thpool_thread(thpool_p, n)->run_time,   &sums_p[1]);
+	}
+	histogram_add_to(&thpool_p->queue_out_wait, &sums_p[2]);
+
+	histsum_latency(&sums_p[0], &stats_p->queue_wait);
+	histsum_latency(&sums_p[1], &stats_p->run_time);
+	histsum_latency(&sums_p[2], &stats_p->result_wait);
+	stats_p->jobs_added     = atomic_load_explicit(&thpool_p->jobs_added, memory_order_relaxed);
+	stats_p->jobs_completed = stats_p->run_time.count;
+	stats_p->jobs_dropped   = atomic_load_explicit(&thpool_p->jobs_dropped, memory_order_relaxed);
+	stats_p->jobs_collected = atomic_load_explicit(&thpool_p->jobs_collected, memory_order_relaxed);
+	stats_p->results_reaped = atomic_load_explicit(&thpool_p->results_reaped, memory_order_relaxed);
+	stats_p->io_submitted   = atomic_load_explicit(&thpool_p->io_submitted, memory_order_relaxed);
+	stats_p->io_inline      = atomic_load_explicit(&thpool_p->io_inline, memory_order_relaxed);
+
+	free(sums_p);
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+
+/* Get the fd that turns readable when results are waiting */
+int thpool_completion_fd(thpool_* thpool_p){
+	if (thpool_p->completion_fd == -1){
+		errno = ENOSYS;
+	}
+	return thpool_p->completion_fd;
+}
+
+
+/* Make the completion fd readable, unless it already is
+ *
+ * One write covers every result that lands until the next
+ * thpool_collect_results() re-arms it, so a burst of results costs a
+ * single system call.
+ */
+static void thpool_signal_completion(thpool_* thpool_p){
+	uint64_t one = 1;
+	if (atomic_exchange(&thpool_p->completion_armed, 0)){
+		if (write(thpool_p->completion_fd, &one, sizeof(one)) == -1){
+			err("thpool_signal_completion(): Could not write completion fd\n");
+		}
+	}
+}
+
+
+/* Extract result from thread pool
+ *
+ * Kept for existing callers; the retry budget is simply turned into one
+ * blocking wait of retry_count_max * retry_interval_ns.
+ */
+int thpool_find_result(thpool_* thpool_p, int job_uuid, int retry_count_max, int retry_interval_ns, int* result_p){
+
+	if (retry_count_max <= 0){
+		return -1;
+	}
+	if (retry_interval_ns < 0){
+		retry_interval_ns = 0;
+	}
+	return thpool_wait_result(thpool_p, job_uuid,
+	                          (long long)retry_count_max * retry_interval_ns, result_p);
+}
+
+
+/* Wait until all jobs have finished */
+//TODO: Hardcoded for "thpool_p->queue_in".
+//		Can "thpool_p->queue_out" even use this concept?
+//				(queue_out NOT GUARENTEED to be emptied out via thpool_find_results())
+//			If NOT, rename function?
+void thpool_wait(thpool_* thpool_p){
+	pthread_mutex_lock(&thpool_p->thcount_lock);
+	/* Announce before checking: a worker going idle checks the other
+	 * way round, so one of the two sees the other (all seq_cst) */
+	atomic_fetch_add(&thpool_p->num_idle_waiters, 1);
+	while (atomic_load(&thpool_p->num_jobs_queued) > 0 || atomic_load(&thpool_p->num_keyed_queued) > 0 ||
+	       atomic_load(&thpool_p->num_threads_working) > 0 || atomic_load(&thpool_p->num_io_in_flight) > 0) {
+		pthread_cond_wait(&thpool_p->threads_all_idle, &thpool_p->thcount_lock);
+	}
+	atomic_fetch_sub(&thpool_p->num_idle_waiters, 1);
+	pthread_mutex_unlock(&thpool_p->thcount_lock);
+}
+
+
+/* Cancel a job that has not started yet
+ *
+ * Jobs sit in many queues, some of them lock-free, so the job is only
+ * marked: whichever worker takes it completes it with -ECANCELED instead
+ * of running it.  The marking races the worker's own claim on the job
+ * state, so exactly one of them wins.
+ */
+int thpool_cancel(thpool_* thpool_p, int job_uuid){
+	if (jobqueue_cancel(&thpool_p->queue_high, job_uuid) ||
+	    jobqueue_cancel(&thpool_p->queue_in, job_uuid) ||
+	    (thpool_p->ring.cells && jobring_cancel(&thpool_p->ring, job_uuid)) ||
+	    jobqueue_cancel(&thpool_p->queue_low, job_uuid)){
+		return 0;
+	}
+
+	/* Threads that left the pool may still hold jobs, so try them too */
+	int num_slots = atomic_load_explicit(&thpool_p->num_slots, memory_order_acquire);
+	int n;
+	for (n = 0; n < num_slots; n++){
+		thread* thread_p = thpool_thread(thpool_p, n);
+		if (jobqueue_cancel(&thread_p->inbox, job_uuid) ||
+		    wsdeque_cancel(&thread_p->deque, job_uuid) ||
+		    jobqueue_cancel(&thread_p->keyed, job_uuid)){
+			return 0;
+		}
+	}
+	return -1;
+}
+
+
+/* Add work whose result is handed back through a future
+ *
+ * The future is the job itself: it stays out of queue_out, and stays
+ * allocated until both the worker and the caller are done with it.
+ */
+thpool_future* thpool_submit(thpool_* thpool_p, th_func_p func_p, void* arg_p){
+	job* newjob;
+
+	if (thpool_reserve_slot(thpool_p, -1) == -1){
+		return NULL;
+	}
+
+	newjob=thpool_future_job(thpool_p, func_p, arg_p);
+	if (newjob==NULL){
+		thpool_release_slot(thpool_p);
+		return NULL;
+	}
+
+	thpool_push_jobs(thpool_p, THPOOL_PRIO_NORMAL, newjob, newjob, 1);
+	return (thpool_future*)newjob;
+}
+
+
+/* Add work that is queued once the jobs of all deps have finished
+ *
+ * Each dep gets an edge pushed onto its successor list, unless its job
+ * finished already.  deps_left holds one extra count until every edge
+ * is in place, so no worker queues the job while it is still being
+ * added; whoever takes deps_left to 0 queues it.
+ */
+thpool_future* thpool_submit_after(thpool_* thpool_p, thpool_future* const deps[], int num_deps,
+                                   th_func_p func_p, void* arg_p){
+	job* newjob;
+	int n;
+
+	if (num_deps < 0 || (num_deps > 0 && deps == NULL)){
+		err("thpool_submit_after(): Invalid dependencies\n");
+		return NULL;
+	}
+
+	newjob=thpool_future_job(thpool_p, func_p, arg_p);
+	if (newjob==NULL){
+		return NULL;
+	}
+	if (num_deps > 0){
+		newjob->deps = (jobdep*)malloc(num_deps * sizeof(jobdep));
+		if (newjob->deps == NULL){
+			err("thpool_submit_after(): Could not allocate memory for dependencies\n");
+			jobslab_free(&thpool_p->job_slab, newjob);
+			return NULL;
+		}
+	}
+	atomic_store_explicit(&newjob->deps_left, num_deps + 1, memory_order_relaxed);
+
+	for (n = 0; n < num_deps; n++){
+		job* dep_p = (job*)deps[n];
+		jobdep* edge_p = &newjob->deps[n];
+		edge_p->job_p = newjob;
+		jobdep* head_p = atomic_load_explicit(&dep_p->successors, memory_order_acquire);
+		do {
+			if (head_p == JOBDEP_CLOSED){
+				atomic_fetch_sub(&newjob->deps_left, 1);
+				break;
+			}
+			edge_p->next = head_p;
+		} while (!atomic_compare_exchange_weak_explicit(&dep_p->successors, &head_p, edge_p,
+		                                                memory_order_release, memory_order_acquire));
+	}
+
+	if (atomic_fetch_sub(&newjob->deps_left, 1) == 1){
+		/* Everything it waits for has finished, so it is queued from
+		 * here and, like thpool_submit(), may wait for queue room */
+		free(newjob->deps);
+		newjob->deps = NULL;
+		if (thpool_reserve_slot(thpool_p, -1) == -1){
+			jobslab_free(&thpool_p->job_slab, newjob);
+			return NULL;
+		}
+		thpool_push_jobs(thpool_p, THPOOL_PRIO_NORMAL, newjob, newjob, 1);
+	}
+	return (thpool_future*)newjob;
+}
+
+
+/* Make the job of a future, not queued yet */
+static job* thpool_future_job(thpool_* thpool_p, th_func_p func_p, void* arg_p){
+	job* newjob;
+
+	newjob=jobslab_alloc(&thpool_p->job_slab);
+	if (newjob==NULL){
+		err("thpool_submit(): Could not allocate memory for new job\n");
+		return NULL;
+	}
+
+	newjob->function=func_p;
+	newjob->arg=arg_p;
+	newjob->done=NULL;
+	newjob->done_arg=NULL;
+	newjob->shard=-1;
+	newjob->deadline_ns=0;
+	newjob->prev=NULL;
+	newjob->uuid=0;
+	newjob->thpool_p=thpool_p;
+	newjob->deps=NULL;
+	atomic_store_explicit(&newjob->successors, NULL, memory_order_relaxed);
+	atomic_store_explicit(&newjob->future, FUTURE_ISSUED, memory_order_relaxed);
+	return newjob;
+}
+
+
+/* Wait for a future's result
+ *
+ * Waiters set FUTURE_WAITED before sleeping and the worker sets
+ * FUTURE_READY before looking for it, so one of the two always sees the
+ * other, and a worker with nobody waiting makes no system call.
+ */
+int thpool_future_wait(thpool_future* future_p, long long timeout_ns, int* result_p){
+	job* job_p = (job*)future_p;
+	struct timespec abstime;
+	int timed_out = 0;
+
+	if (timeout_ns > 0){
+		abstime_from_now(&abstime, timeout_ns);
+	}
+	unsigned int state = atomic_load_explicit(&job_p->future, memory_order_acquire);
+	while (!(state & FUTURE_READY)){
+		if (timeout_ns == 0 || timed_out){
+			return -1;
+		}
+		if (!(state & FUTURE_WAITED)){
+			state = atomic_fetch_or(&job_p->future, FUTURE_WAITED) | FUTURE_WAITED;
+			continue;
+		}
+#if defined(__linux__)
+		if (syscall(SYS_futex, &job_p->future, FUTEX_WAIT_BITSET_PRIVATE, state,
+		            timeout_ns > 0 ? &abstime : NULL, NULL, FUTEX_BITSET_MATCH_ANY) == -1
+		    && errno == ETIMEDOUT){
+			timed_out = 1;
+		}
+#else
+		thpool_* thpool_p = job_p->thpool_p;
+		pthread_mutex_lock(&thpool_p->future_lock);
+		while (!(atomic_load(&job_p->future) & FUTURE_READY) && !timed_out){
+			if (timeout_ns > 0){
+				timed_out = (pthread_cond_timedwait(&thpool_p->future_ready, &thpool_p->future_lock, &abstime) == ETIMEDOUT);
+			}
+			else{
+				pthread_cond_wait(&thpool_p->future_ready, &thpool_p->future_lock);
+			}
+		}
+		pthread_mutex_unlock(&thpool_p->future_lock);
+#endif
+		state = atomic_load_explicit(&job_p->future, memory_order_acquire);
+	}
+	*result_p = job_p->result;
+	return 0;
+}
+
+
+/* Whether a future's result is in */
+int thpool_future_poll(thpool_future* future_p){
+	job* job_p = (job*)future_p;
+	return (atomic_load_explicit(&job_p->future, memory_order_acquire) & FUTURE_READY) != 0;
+}
+
+
+/* Let go of a future, freeing its job if the worker is done with it */
+void thpool_future_release(thpool_future* future_p){
+	if (future_p == NULL) return ;
+
+	job* job_p = (job*)future_p;
+	thpool_* thpool_p = job_p->thpool_p;
+	if (atomic_fetch_or(&job_p->future, FUTURE_RELEASED) & FUTURE_READY){
+#if THPOOL_METRICS
+		thpool_record_collected(thpool_p, job_p, metrics_now_ns());
+#endif
+		jobslab_free(&thpool_p->job_slab, job_p);
+	}
+}
+
+
+/* Hand a finished job's result to its future
+ *
+ * Successors first: closing the list makes thpool_submit_after() count
+ * this dep as done from now on, and each edge is read before its count
+ * is dropped, as the last drop frees it.
+ *
+ * Whichever of this and thpool_future_release() comes second frees the
+ * job.  Once FUTURE_READY is set the job may be freed and reused at any
+ * moment, but its memory stays in the slab, so at worst the wakeup below
+ * is a spurious one for a later job.
+ */
+static void thpool_future_complete(thpool_* thpool_p, job* job_p){
+	jobdep* edge_p = atomic_exchange_explicit(&job_p->successors, JOBDEP_CLOSED, memory_order_acq_rel);
+	while (edge_p){
+		jobdep* next_p = edge_p->next;
+		job* successor_p = edge_p->job_p;
+		if (atomic_fetch_sub(&successor_p->deps_left, 1) == 1){
+			thpool_push_successor(thpool_p, successor_p);
+		}
+		edge_p = next_p;
+	}
+
+	unsigned int state = atomic_fetch_or(&job_p->future, FUTURE_READY);
+	if (state & FUTURE_RELEASED){
+		jobslab_free(&thpool_p->job_slab, job_p);
+		return;
+	}
+	if (state & FUTURE_WAITED){
+#if defined(__linux__)
+		syscall(SYS_futex, &job_p->future, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+#else
+		pthread_mutex_lock(&thpool_p->future_lock);
+		pthread_cond_broadcast(&thpool_p->future_ready);
+		pthread_mutex_unlock(&thpool_p->future_lock);
+#endif
+	}
+}
+
+
+/* Queue a job whose last dep just finished
+ *
+ * Called on the worker that ran that dep, so the job lands in its own
+ * deque, still warm, without a trip through the caller or the ring.
+ */
+static void thpool_push_successor(thpool_* thpool_p, job* job_p){
+	free(job_p->deps);
+	job_p->deps = NULL;
+	thpool_push_jobs(thpool_p, THPOOL_PRIO_NORMAL, job_p, job_p, 1);
+}
+
+
+/* Run func_p over [begin, end) in chunks, on the pool and the caller
+ *
+ * The range lives in one descriptor and chunks are handed out by an
+ * atomic cursor, so a loop costs one allocation and one push of at most
+ * num_threads helper jobs, however many chunks it has.  Helpers that
+ * start once every chunk is taken just drop their reference, and one
+ * that thpool_cancel() or a paused pool holds back is not waited for.
+ */
+int thpool_parallel_for(thpool_* thpool_p, long begin, long end, long grain, th_range_p func_p, void* ctx_p){
+	int num_threads = atomic_load_explicit(&thpool_p->num_threads, memory_order_acquire);
+	long count = end - begin;
+	int n;
+
+	if (count <= 0){
+		return 0;
+	}
+	if (grain < 1){
+		grain = count / (PARFOR_CHUNKS_PER_THREAD * (num_threads + 1));
+		if (grain < 1){
+			grain = 1;
+		}
+	}
+	long num_chunks = count / grain + (count % grain != 0);
+	if (num_chunks == 1){
+		func_p(begin, end, ctx_p);
+		return 0;
+	}
+
+	parfor* parfor_p = (parfor*)malloc(sizeof(parfor));
+	if (parfor_p == NULL){
+		err("thpool_parallel_for(): Could not allocate memory for the range\n");
+		return -1;
+	}
+	atomic_init(&parfor_p->next_chunk, 0);
+	parfor_p->num_chunks = num_chunks;
+	parfor_p->begin      = begin;
+	parfor_p->end        = end;
+	parfor_p->grain      = grain;
+	parfor_p->func       = func_p;
+	parfor_p->ctx        = ctx_p;
+	atomic_init(&parfor_p->chunks_left, num_chunks);
+	atomic_init(&parfor_p->refs, 1);
+	csem_init(&parfor_p->finished, 0);
+
+	/* A helper per worker at most, and no more than a bounded queue has
+	 * room for right now: the caller takes whatever they do not */
+	int num_helpers = num_chunks - 1 < num_threads ? (int)(num_chunks - 1) : num_threads;
+	for (n = 0; n < num_helpers; n++){
+		if (thpool_reserve_slot(thpool_p, 0) == -1){
+			break;
+		}
+	}
+	num_helpers = n;
+	if (num_helpers > 0){
+		job* first_job = jobslab_alloc_batch(&thpool_p->job_slab, num_helpers);
+		if (first_job == NULL){
+			for (n = 0; n < num_helpers; n++){
+				thpool_release_slot(thpool_p);
+			}
+		}
+		else{
+			job* job_p;
+			job* last_job = NULL;
+			atomic_fetch_add(&parfor_p->refs, num_helpers);
+			for (job_p = first_job; job_p; job_p = job_p->prev){
+				job_p->function = parfor_run;
+				job_p->arg      = parfor_p;
+				job_p->uuid     = 0;
+				job_p->done     = parfor_release;
+				job_p->done_arg = parfor_p;
+				job_p->shard    = -1;
+				job_p->deadline_ns = 0;
+				atomic_store_explicit(&job_p->future, 0, memory_order_relaxed);
+				last_job = job_p;
+			}
+			thpool_push_jobs(thpool_p, THPOOL_PRIO_NORMAL, first_job, last_job, num_helpers);
+		}
+	}
+
+	parfor_run(parfor_p);
+	csem_timedwait(&parfor_p->finished, NULL);
+	parfor_release(0, 0, parfor_p);
+	return 0;
+}
+
+
+/* Take chunks of a parallel_for until none are left
+ *
+ * Whoever finishes the last chunk posts finished.  chunks_left is only
+ * ever changed by read-modify-writes, so that post carries every chunk's
+ * work over to the caller.
+ */
+static int parfor_run(void* arg_p){
+	parfor* parfor_p = (parfor*)arg_p;
+	long chunk;
+
+	while ((chunk = atomic_fetch_add_explicit(&parfor_p->next_chunk, 1, memory_order_relaxed)) < parfor_p->num_chunks){
+		long first = parfor_p->begin + chunk * parfor_p->grain;
+		long last  = parfor_p->end - first > parfor_p->grain ? first + parfor_p->grain : parfor_p->end;
+		parfor_p->func(first, last, parfor_p->ctx);
+		if (atomic_fetch_sub_explicit(&parfor_p->chunks_left, 1, memory_order_acq_rel) == 1){
+			csem_post(&parfor_p->finished, 1);
+		}
+	}
+	return 0;
+}
+
+
+/* Drop a reference to a parallel_for range, the last one frees it
+ *
+ * Also the completion callback of the helper jobs, run whether or not
+ * they ran at all.
+ */
+static void parfor_release(int job_uuid, int result, void* arg_p){
+	parfor* parfor_p = (parfor*)arg_p;
+	(void)job_uuid;
+	(void)result;
+	if (atomic_fetch_sub_explicit(&parfor_p->refs, 1, memory_order_acq_rel) == 1){
+		csem_destroy(&parfor_p->finished);
+		free(parfor_p);
+	}
+}
+
+
+/* Add an I/O job, run on the kernel's time where the pool has rings */
+int thpool_add_io(thpool_* thpool_p, int job_uuid, int op, int fd, void* buf_p, unsigned int len, long long offset){
+	job* newjob;
+
+	if (op < THPOOL_IO_READ || op > THPOOL_IO_FSYNC || len > INT_MAX){
+		err("thpool_add_io(): Invalid I/O\n");
+		return -1;
+	}
+	if (thpool_reserve_slot(thpool_p, -1) == -1){
+		return -1;
+	}
+
+	newjob=jobslab_alloc(&thpool_p->job_slab);
+	if (newjob==NULL){
+		err("thpool_add_io(): Could not allocate memory for new job\n");
+		thpool_release_slot(thpool_p);
+		return -1;
+	}
+
+	newjob->function=thpool_io_run;
+	newjob->arg=newjob;
+	newjob->done=NULL;
+	newjob->done_arg=NULL;
+	newjob->shard=-1;
+	newjob->deadline_ns=0;
+	newjob->prev=NULL;
+	newjob->uuid=job_uuid;
+	atomic_store_explicit(&newjob->future, 0, memory_order_relaxed);
+	newjob->io.op     = op;
+	newjob->io.fd     = fd;
+	newjob->io.buf    = buf_p;
+	newjob->io.len    = len;
+	newjob->io.offset = offset;
+
+	thpool_push_jobs(thpool_p, THPOOL_PRIO_NORMAL, newjob, newjob, 1);
+	return 0;
+}
+
+
+/* Run an I/O job on the worker: no ring, or it is full
+ * @return bytes transferred (0 for fsync), -errno on failure
+ */
+static int thpool_io_run(void* arg_p){
+	job* job_p = (job*)arg_p;
+	ssize_t ret;
+
+	/* A negative offset uses (and moves) the file position, as
+	 * io_uring does, which pipes and sockets need */
+	switch (job_p->io.op){
+	case THPOOL_IO_READ:
+		ret = job_p->io.offset < 0 ? read(job_p->io.fd, job_p->io.buf, job_p->io.len) :
+		      pread(job_p->io.fd, job_p->io.buf, job_p->io.len, (off_t)job_p->io.offset);
+		break;
+	case THPOOL_IO_WRITE:
+		ret = job_p->io.offset < 0 ? write(job_p->io.fd, job_p->io.buf, job_p->io.len) :
+		      pwrite(job_p->io.fd, job_p->io.buf, job_p->io.len, (off_t)job_p->io.offset);
+		break;
+	default:
+		ret = fsync(job_p->io.fd);
+		break;
+	}
+	return ret == -1 ? -errno : (int)ret;
+}
+
+
+/* Hand an I/O job to the worker's own ring
+ *
+ * Counted in flight before the kernel sees it, so thpool_wait() never
+ * finds the job neither working nor in flight.
+ *
+ * @return 0 if submitted, -1 to run it on the worker instead
+ */
+static int thpool_io_submit(struct thread* thread_p, struct job* job_p){
+#if THPOOL_IO_URING
+	thpool_* thpool_p = thread_p->thpool_p;
+	if (thread_p->ring.fd == -1){
+		return -1;
+	}
+	atomic_fetch_add(&thpool_p->num_io_in_flight, 1);
+	if (iouring_submit(&thread_p->ring, job_p) == -1){
+		atomic_fetch_sub(&thpool_p->num_io_in_flight, 1);
+		return -1;
+	}
+	return 0;
+#else
+	(void)thread_p;
+	(void)job_p;
+	return -1;
+#endif
+}
+
+
+/* Complete I/O jobs as their CQEs arrive
+ *
+ * Every ring signals io_event_fd, so one blocking read waits for all of
+ * them.  A CQE that lands after its ring was looked at signals the fd
+ * again, so none is missed.  Rings of threads that left the pool are
+ * looked at too, their I/O may still be in flight.
+ */
+static void* thpool_io_thread(void* arg_p){
+#if THPOOL_IO_URING
+	thpool_* thpool_p = (thpool_*)arg_p;
+
+	prctl(PR_SET_NAME, "thpool-io");
+
+	while (!atomic_load(&thpool_p->io_stop) || atomic_load(&thpool_p->num_io_in_flight) > 0){
+		uint64_t count;
+		if (read(thpool_p->io_event_fd, &count, sizeof(count)) == -1 && errno != EINTR){
+			err("thpool_io_thread(): Could not read io eventfd\n");
+		}
+
+		int num_slots = atomic_load_explicit(&thpool_p->num_slots, memory_order_acquire);
+		int completed = 0;
+		int n;
+		for (n = 0; n < num_slots; n++){
+			thread* thread_p = thpool_thread(thpool_p, n);
+			job* job_p;
+			while ((job_p = iouring_pop(&thread_p->ring)) != NULL){
+#if THPOOL_METRICS
+				long long done_ns = metrics_now_ns();
+				histogram_record(&thread_p->run_time, done_ns - job_p->metrics.done_ns);
+				job_p->metrics.done_ns = done_ns;
+#endif
+				thpool_deliver(thpool_p, job_p);
+				completed++;
+			}
+		}
+
+		/* Last one out wakes thpool_wait(), as workers do */
+		if (completed && atomic_fetch_sub(&thpool_p->num_io_in_flight, completed) == completed &&
+		    atomic_load(&thpool_p->num_idle_waiters) > 0){
+			pthread_mutex_lock(&thpool_p->thcount_lock);
+			pthread_cond_broadcast(&thpool_p->threads_all_idle);
+			pthread_mutex_unlock(&thpool_p->thcount_lock);
+		}
+	}
+#else
+	(void)arg_p;
+#endif
+	return NULL;
+}
+
+
+/* Hand a finished job's result to whoever takes it: its future, its
+ * callback, or queue_out */
+static void thpool_deliver(thpool_* thpool_p, job* job_p){
+	if (atomic_load_explicit(&job_p->future, memory_order_relaxed)){
+		thpool_future_complete(thpool_p, job_p);
+	}
+	else if (job_p->done){
+		job_p->done(job_p->uuid, job_p->result, job_p->done_arg);
+		jobslab_free(&thpool_p->job_slab, job_p);
+	}
+	else{
+		thread* thread_p = thread_self;
+		if (thread_p && thread_p->thpool_p == thpool_p){
+			/* A full ring means nobody collected for a while, so the
+			 * lock is not contended.  Empty it ourselves */
+			if (resultring_push(&thread_p->results, job_p) == -1){
+				pthread_mutex_lock(&thpool_p->queue_out.rwmutex);
+				thpool_merge_results(thpool_p);
+				pthread_mutex_unlock(&thpool_p->queue_out.rwmutex);
+				resultring_push(&thread_p->results, job_p);
+			}
+
+			/* Publish, then check for a collector about to sleep on
+			 * queue_out.  It announces itself, then merges, so one of
+			 * the two sees the other */
+			atomic_thread_fence(memory_order_seq_cst);
+			if (atomic_load_explicit(&thpool_p->num_result_waiters, memory_order_relaxed)){
+				pthread_mutex_lock(&thpool_p->queue_out.rwmutex);
+				thpool_merge_results(thpool_p);
+				pthread_mutex_unlock(&thpool_p->queue_out.rwmutex);
+			}
+		}
+		else{
+			/* The io thread has no ring */
+			if (thpool_p->result_ttl_ns){
+				job_p->reap_ns = clock_now_ns() + thpool_p->result_ttl_ns;
+			}
+			jobqueue_push(&thpool_p->queue_out, job_p);
+		}
+		if (thpool_p->completion_fd != -1){
+			thpool_signal_completion(thpool_p);
+		}
+	}
+}
+
+
+/* Move the results waiting in the workers' rings over to queue_out
+ *
+ * Collectors do this before they look at queue_out, so workers never
+ * take its lock to hand in a result.  The results get their reap time
+ * here, which keeps queue_out in reap order for the reaper.
+ *
+ * Notice: Caller MUST hold the queue_out mutex
+ */
+static void thpool_merge_results(thpool_* thpool_p){
+	int num_slots = atomic_load_explicit(&thpool_p->num_slots, memory_order_acquire);
+	long long reap_ns = 0;
+	int n;
+
+	for (n = 0; n < num_slots; n++){
+		resultring* resultring_p = &thpool_thread(thpool_p, n)->results;
+		if (resultring_empty(resultring_p)){
+			continue;
+		}
+
+		job* last_p;
+		int num_jobs;
+		job* job_p = resultring_drain(resultring_p, &last_p, &num_jobs);
+		if (thpool_p->result_ttl_ns){
+			if (reap_ns == 0){
+				reap_ns = clock_now_ns() + thpool_p->result_ttl_ns;
+			}
+			job* iter_p;
+			for (iter_p = job_p; iter_p; iter_p = iter_p->prev){
+				iter_p->reap_ns = reap_ns;
+			}
+		}
+		jobqueue_link_chain(&thpool_p->queue_out, job_p, last_p, num_jobs);
+	}
+}
+
+
+/* Free results nobody collected within result_ttl_ns, and grow the pool
+ *
+ * Results get their reap time as they are merged into queue_out and all
+ * get the same time to live, so the expired ones are always at its
+ * front.  Looking every quarter TTL, and merging each time, keeps a
+ * result for at most 1.5 times the TTL.
+ *
+ * Threads the autoscaler asks for are started here too, off the path of
+ * whoever added the job, see thpool_request_grow().
+ */
+static void* thpool_reaper(void* arg_p){
+	thpool_* thpool_p = (thpool_*)arg_p;
+	long long period_ns = thpool_p->result_ttl_ns / 4;
+	if (period_ns < REAPER_MIN_PERIOD_NS){
+		period_ns = REAPER_MIN_PERIOD_NS;
+	}
+
+#if defined(__linux__)
+	prctl(PR_SET_NAME, "thpool-reaper");
+#endif
+
+	pthread_mutex_lock(&thpool_p->reaper_lock);
+	while (thpool_alive_state(thpool_p)){
+		if (!atomic_load(&thpool_p->grow_requested)){
+			if (thpool_p->result_ttl_ns){
+				struct timespec next;
+				abstime_from_now(&next, period_ns);
+				pthread_cond_timedwait(&thpool_p->reaper_wake, &thpool_p->reaper_lock, &next);
+			}
+			else{
+				pthread_cond_wait(&thpool_p->reaper_wake, &thpool_p->reaper_lock);
+			}
+		}
+		/* Let producers signal while a thread starts */
+		pthread_mutex_unlock(&thpool_p->reaper_lock);
+
+		if (atomic_exchange(&thpool_p->grow_requested, 0)){
+			thpool_autoscale(thpool_p);
+		}
+		if (thpool_p->result_ttl_ns){
+			pthread_mutex_lock(&thpool_p->queue_out.rwmutex);
+			thpool_merge_results(thpool_p);
+			pthread_mutex_unlock(&thpool_p->queue_out.rwmutex);
+
+			int num_jobs;
+			job* job_p = jobqueue_pull_expired(&thpool_p->queue_out, clock_now_ns(), &num_jobs);
+			while (job_p){
+				job* next_p = job_p->prev;
+				jobslab_free(&thpool_p->job_slab, job_p);
+				job_p = next_p;
+			}
+#if THPOOL_METRICS
+			atomic_fetch_add_explicit(&thpool_p->results_reaped, num_jobs, memory_order_relaxed);
+#endif
+		}
+		pthread_mutex_lock(&thpool_p->reaper_lock);
+	}
+	pthread_mutex_unlock(&thpool_p->reaper_lock);
+	return NULL;
+}
+
+
+/* Change the number of threads in the pool */
+int thpool_resize(thpool_* thpool_p, int num_threads){
+	if (num_threads < 0){
+		err("thpool_resize(): Number of threads can not be negative\n");
+		return -1;
+	}
+	if (thread_self && thread_self->thpool_p == thpool_p && thread_self->id >= num_threads){
+		err("thpool_resize(): A thread can not resize itself out of its pool\n");
+		return -1;
+	}
+
+	pthread_mutex_lock(&thpool_p->resize_lock);
+	if (!thpool_alive_state(thpool_p)){
+		pthread_mutex_unlock(&thpool_p->resize_lock);
+		return -1;
+	}
+
+	int ret = 0;
+	int old = atomic_load(&thpool_p->num_threads);
+	if (num_threads > old){
+		ret = thpool_grow_locked(thpool_p, num_threads);
+	}
+	else if (num_threads < old){
+		/* Route no more jobs to them, jobs they still hold get stolen */
+		atomic_store_explicit(&thpool_p->num_threads, num_threads, memory_order_release);
+		int n;
+		for (n = num_threads; n < old; n++){
+			atomic_store(&thpool_thread(thpool_p, n)->retire, 1);
+		}
+
+		/* Wake just them: their retire flag ends an idle thread's sleep,
+		 * busy ones see it after their job */
+		unsigned int bits = 0;
+		for (n = num_threads; n < old; n++){
+			bits |= 1U << (n % 32);
+		}
+		csem_kick(&thpool_p->has_jobs, bits);
+		for (n = num_threads; n < old; n++){
+			thread_wait_stopped(thpool_thread(thpool_p, n));
+		}
+	}
+	pthread_mutex_unlock(&thpool_p->resize_lock);
+	return ret;
+}
+
+
+/* Destroy the threadpool */
+/* Retrieve any desired output before calling this destroy */
+void thpool_destroy(thpool_* thpool_p){
+	/* No need to destroy if it's NULL */
+	if (thpool_p == NULL) return ;
+
+	/* End each thread 's infinite loop, and stop the autoscaler adding more */
+	pthread_mutex_lock(&thpool_p->resize_lock);
+	atomic_store_explicit(&thpool_p->threads_keepalive, 0, memory_order_release);
+	pthread_mutex_unlock(&thpool_p->resize_lock);
+
+	/* Stop the reaper first, it frees into the job slab */
+	if (thpool_p->reaper_running){
+		pthread_mutex_lock(&thpool_p->reaper_lock);
+		pthread_cond_signal(&thpool_p->reaper_wake);
+		pthread_mutex_unlock(&thpool_p->reaper_lock);
+		pthread_join(thpool_p->reaper, NULL);
+	}
+
+	/* Held threads have not taken a job yet, they just leave */
+	pthread_mutex_lock(&thpool_p->hold_lock);
+	pthread_cond_broadcast(&thpool_p->threads_resumed);
+	pthread_mutex_unlock(&thpool_p->hold_lock);
+
+	int threads_total = atomic_load(&thpool_p->num_slots);
+
+	/* One post per thread: each idle thread takes one and leaves its
+	 * loop, busy threads take theirs after finishing their job */
+	csem_post(&thpool_p->has_jobs, threads_total);
+
+	/* Wait for threads to exit.  Only threads the autoscaler retired are
+	 * detached, and those are already on their way out */
+	int n;
+	for (n=0; n < threads_total; n++){
+		thread_wait_stopped(thpool_thread(thpool_p, n));
+	}
+
+	/* The kernel still writes to jobs (and buffers) of in-flight I/O */
+	if (thpool_p->io_running){
+		uint64_t one = 1;
+		atomic_store(&thpool_p->io_stop, 1);
+		if (write(thpool_p->io_event_fd, &one, sizeof(one)) == -1){
+			err("thpool_destroy(): Could not wake io thread\n");
+		}
+		pthread_join(thpool_p->io_thread, NULL);
+	}
+
+	/* Job queue cleanup */
+	thpool_drop_queued(thpool_p);
+	jobqueue_destroy(&thpool_p->queue_out);
+	jobqueue_destroy(&thpool_p->queue_in);
+	jobqueue_destroy(&thpool_p->queue_high);
+	jobqueue_destroy(&thpool_p->queue_low);
+	if (thpool_p->ring.cells){
+		jobring_destroy(&thpool_p->ring);
+	}
+	if (thpool_p->completion_fd != -1){
+		close(thpool_p->completion_fd);
+	}
+	/* Deallocs */
+	for (n=0; n < threads_total; n++){
+		thread_destroy(thpool_thread(thpool_p, n));
+	}
+	if (thpool_p->io_event_fd != -1){
+		close(thpool_p->io_event_fd);
+	}
+	jobslab_destroy(&thpool_p->job_slab);
+	thpool_free_placement(thpool_p);
+	threadtable* table_p = atomic_load(&thpool_p->threads);
+	while (table_p){
+		threadtable* retired_p = table_p->retired;
+		free(table_p);
+		table_p = retired_p;
+	}
+	csem_destroy(&thpool_p->has_jobs);
+	pthread_mutex_destroy(&thpool_p->thcount_lock);
+	pthread_mutex_destroy(&thpool_p->resize_lock);
+	pthread_mutex_destroy(&thpool_p->hold_lock);
+	pthread_mutex_destroy(&thpool_p->reaper_lock);
+#if !defined(__linux__)
+	pthread_mutex_destroy(&thpool_p->future_lock);
+	pthread_cond_destroy(&thpool_p->future_ready);
+#endif
+	pthread_cond_destroy(&thpool_p->threads_resumed);
+	pthread_cond_destroy(&thpool_p->threads_paused);
+	pthread_cond_destroy(&thpool_p->reaper_wake);
+	pthread_cond_destroy(&thpool_p->threads_all_idle);
+	pthread_cond_destroy(&thpool_p->threads_started);
+	pthread_cond_destroy(&thpool_p->threads_stopped);
+	free(thpool_p);
+}
+
+
+/* Hand the jobs never run back to their callbacks, as cancelled
+ *
+ * Callbacks own what their job holds, parallel_for ranges among them.
+ * Other jobs are only unlinked, their memory goes with the job slab.
+ *
+ * Notice: Every thread MUST have left already
+ */
+static void thpool_drop_queued(thpool_* thpool_p){
+	jobqueue* queues[] = { &thpool_p->queue_high, &thpool_p->queue_in, &thpool_p->queue_low };
+	job* job_p;
+	int n;
+
+	for (n = 0; n < (int)(sizeof(queues) / sizeof(queues[0])); n++){
+		while ((job_p = jobqueue_pull_front(queues[n]))){
+			thpool_drop_job(job_p);
+		}
+	}
+	while (thpool_p->ring.cells && (job_p = jobring_pop(&thpool_p->ring))){
+		thpool_drop_job(job_p);
+	}
+
+	int num_slots = atomic_load_explicit(&thpool_p->num_slots, memory_order_acquire);
+	for (n = 0; n < num_slots; n++){
+		thread* thread_p = thpool_thread(thpool_p, n);
+		while ((job_p = wsdeque_pop(&thread_p->deque))){
+			thpool_drop_job(job_p);
+		}
+		while ((job_p = jobqueue_pull_front(&thread_p->inbox))){
+			thpool_drop_job(job_p);
+		}
+		while ((job_p = jobqueue_pull_front(&thread_p->keyed))){
+			thpool_drop_job(job_p);
+		}
+	}
+}
+
+
+/* Complete one job thpool_drop_queued() found */
+static void thpool_drop_job(job* job_p){
+	if (job_p->done && atomic_load_explicit(&job_p->future, memory_order_relaxed) == 0){
+		job_p->done(job_p->uuid, -ECANCELED, job_p->done_arg);
+	}
+}
+
+
+/* Pause all threads in threadpool
+ *
+ * Closes the gate, then waits for the threads already through it to
+ * start their job or find none, so no job starts after we return.
+ * Threads added later see the gate closed: thpool_grow_locked() makes
+ * new slots reachable under hold_lock.
+ */
+void thpool_pause(thpool_* thpool_p) {
+	pthread_mutex_lock(&thpool_p->hold_lock);
+	/* seq_cst: pairs with thread_enter_gate() and thread_leave_gate() */
+	atomic_store(&thpool_p->threads_on_hold, 1);
+	int num_slots = atomic_load_explicit(&thpool_p->num_slots, memory_order_acquire);
+	int n;
+	for (n = 0; n < num_slots && atomic_load(&thpool_p->threads_on_hold); n++){
+		thread* thread_p = thpool_thread(thpool_p, n);
+		while (atomic_load(&thread_p->starting) && atomic_load(&thpool_p->threads_on_hold)){
+			pthread_cond_wait(&thpool_p->threads_paused, &thpool_p->hold_lock);
+		}
+	}
+	pthread_mutex_unlock(&thpool_p->hold_lock);
+}
+
+
+/* Resume all threads in threadpool */
+void thpool_resume(thpool_* thpool_p) {
+	pthread_mutex_lock(&thpool_p->hold_lock);
+	atomic_store(&thpool_p->threads_on_hold, 0);
+	pthread_cond_broadcast(&thpool_p->threads_resumed);
+	pthread_cond_broadcast(&thpool_p->threads_paused);
+	pthread_mutex_unlock(&thpool_p->hold_lock);
+}
+
+
+int thpool_num_threads_alive(thpool_* thpool_p){
+	return atomic_load_explicit(&thpool_p->num_threads_alive, memory_order_acquire);
+}
+
+
+int thpool_num_threads_working(thpool_* thpool_p){
+	return atomic_load_explicit(&thpool_p->num_threads_working, memory_order_relaxed);
+}
+
+
+int thpool_queue_out_len(thpool_* thpool_p){
+	int len;
+	pthread_mutex_lock(&thpool_p->queue_out.rwmutex);
+	thpool_merge_results(thpool_p);
+	len = atomic_load_explicit(&thpool_p->queue_out.len, memory_order_relaxed);
+	pthread_mutex_unlock(&thpool_p->queue_out.rwmutex);
+	return len;
+}
+
+
+int thpool_alive_state(thpool_* thpool_p){
+	return atomic_load_explicit(&thpool_p->threads_keepalive, memory_order_acquire);
+}
+
+
+
+/* ============================ THREAD ============================== */
+
+
+/* Initialize a thread in the thread pool
+ *
+ * @param thread        address to the pointer of the thread to be created
+ * @param id            id to be given to the thread
+ * @return 0 on success, -1 otherwise.
+ */
+//TODO: Change thread id to set internally???
+static int thread_init (thpool_* thpool_p, struct thread** thread_p, int id){
+
+	*thread_p = (struct thread*)malloc(sizeof(struct thread));
+	if (*thread_p == NULL){
+		err("thread_init(): Could not allocate memory for thread\n");
+		return -1;
+	}
+
+	(*thread_p)->thpool_p = thpool_p;
+	(*thread_p)->id       = id;
+	(*thread_p)->steal_seed = 2654435761U * (unsigned int)(id + 1);
+	(*thread_p)->spin_ns    = thpool_p->idle_spin_ns;
+	(*thread_p)->picks      = 0;
+	(*thread_p)->cpu        = thpool_p->num_cpus ? thpool_p->cpus[id % thpool_p->num_cpus] : -1;
+	(*thread_p)->node       = (*thread_p)->cpu != -1 ? topo_cpu_node((*thread_p)->cpu) : 0;
+#if THPOOL_METRICS
+	histogram_init(&(*thread_p)->queue_wait);
+	histogram_init(&(*thread_p)->run_time);
+#endif
+
+	if (wsdeque_init(&(*thread_p)->deque) == -1){
+		err("thread_init(): Could not allocate memory for thread deque\n");
+		free(*thread_p);
+		return -1;
+	}
+	jobqueue_init(&(*thread_p)->inbox, 0);
+	jobqueue_init(&(*thread_p)->keyed, 0);
+	atomic_init(&(*thread_p)->num_keyed, 0);
+	atomic_init(&(*thread_p)->keyed_busy, 0);
+	atomic_init(&(*thread_p)->retire, 0);
+	atomic_init(&(*thread_p)->running, 0);
+	atomic_init(&(*thread_p)->starting, 0);
+	(*thread_p)->joinable = 0;
+	resultring_init(&(*thread_p)->results);
+#if THPOOL_IO_URING
+	(*thread_p)->ring.fd = -1;
+	if (thpool_p->io_depth && iouring_init(&(*thread_p)->ring, thpool_p->io_depth, thpool_p->io_event_fd) == -1){
+#if THPOOL_DEBUG
+		printf("THPOOL_DEBUG: %s: No io_uring, I/O jobs run on thread %d\n", __func__, id);
+#endif
+	}
+#endif
+
+	if (thread_start(*thread_p) == -1){
+#if THPOOL_IO_URING
+		iouring_destroy(&(*thread_p)->ring);
+#endif
+		jobqueue_destroy(&(*thread_p)->keyed);
+		jobqueue_destroy(&(*thread_p)->inbox);
+		wsdeque_destroy(&(*thread_p)->deque);
+		free(*thread_p);
+		return -1;
+	}
+#if THPOOL_DEBUG
+	printf("THPOOL_DEBUG: %s: Thread created (id:%d)\n", __func__, id);
+#endif
+	return 0;
+}
+
+
+/* Start the pthread of a thread, also of one that left the pool before
+ * @return 0 on success, -1 otherwise
+ */
+static int thread_start(struct thread* thread_p){
+	atomic_store(&thread_p->retire, 0);
+	atomic_store(&thread_p->running, 1);
+	if (pthread_create(&thread_p->pthread, NULL, (void * (*)(void *)) thread_do, thread_p) != 0){
+		err("thread_start(): Could not create thread\n");
+		atomic_store(&thread_p->running, 0);
+		return -1;
+	}
+	thread_p->joinable = 1;
+	return 0;
+}
+
+
+/* Sets the calling thread on hold until thpool_resume() or thpool_destroy() */
+static void thread_hold(thpool_* thpool_p) {
+	pthread_mutex_lock(&thpool_p->hold_lock);
+	while (atomic_load(&thpool_p->threads_on_hold) && thpool_alive_state(thpool_p)){
+		pthread_cond_wait(&thpool_p->threads_resumed, &thpool_p->hold_lock);
+	}
+	pthread_mutex_unlock(&thpool_p->hold_lock);
+}
+
+
+/* Pass the pause gate on the way to a job
+ *
+ * The thread's starting flag marks it between the gate and the start of
+ * its job, for thpool_pause() to wait on.  Only the thread writes it, so
+ * passing costs a store, a fence and one load of threads_on_hold, with
+ * no shared line written.  A paused thread holds before taking a job, so
+ * queued jobs stay where thpool_cancel() and thpool_destroy() find them.
+ *
+ * @return 0 once through, -1 if the pool is being destroyed
+ */
+static int thread_enter_gate(struct thread* thread_p){
+	thpool_* thpool_p = thread_p->thpool_p;
+	for (;;){
+		atomic_store_explicit(&thread_p->starting, 1, memory_order_relaxed);
+		/* Either thpool_pause() sees the flag or we see the gate closed */
+		atomic_thread_fence(memory_order_seq_cst);
+		if (!atomic_load_explicit(&thpool_p->threads_on_hold, memory_order_acquire)){
+			return 0;
+		}
+		thread_leave_gate(thread_p);
+		thread_hold(thpool_p);
+		if (!thpool_alive_state(thpool_p)){
+			return -1;
+		}
+	}
+}
+
+
+/* The job taken has started, or there was none */
+static void thread_leave_gate(struct thread* thread_p){
+	thpool_* thpool_p = thread_p->thpool_p;
+	/* seq_cst: a thpool_pause() that saw the flag set is woken */
+	atomic_store(&thread_p->starting, 0);
+	if (atomic_load(&thpool_p->threads_on_hold)){
+		pthread_mutex_lock(&thpool_p->hold_lock);
+		pthread_cond_broadcast(&thpool_p->threads_paused);
+		pthread_mutex_unlock(&thpool_p->hold_lock);
+	}
+}
+
+
+/* What each thread is doing
+*
+* In principle this is an endless loop. The only time this loop gets interuppted is once
+* thpool_destroy() is invoked or the program exits.
+*
+* @param  thread        thread that will run this function
+* @return nothing
+*/
+static void* thread_do(struct thread* thread_p){
+
+	/* Set thread name for profiling and debugging */
+	char thread_name[16] = {0};
+	snprintf(thread_name, 16, "thpool-%d", thread_p->id);
+//TODO: Set thread "id" here instead (using pthread_self())????  Use both??
+#if THPOOL_DEBUG
+	printf("THPOOL_DEBUG: %s: Thread started (id:%d, pthread:%u)\n",
+	       __func__, thread_p->id, (unsigned int)pthread_self());
+#endif
+
+#if defined(__linux__)
+	/* Use prctl instead to prevent using _GNU_SOURCE flag and implicit declaration */
+	prctl(PR_SET_NAME, thread_name);
+#elif defined(__APPLE__) && defined(__MACH__)
+	pthread_setname_np(thread_name);
+#else
+	err("thread_do(): pthread_setname_np is not supported on this system");
+#endif
+
+	if (thread_p->cpu != -1 && topo_pin_self(thread_p->cpu) == -1){
+		err("thread_do(): Could not pin thread to its CPU\n");
+	}
+
+	/* Assure all threads have been created before starting serving */
+	thpool_* thpool_p = thread_p->thpool_p;
+
+	/* Mark thread as alive (initialized) */
+	thread_self = thread_p;
+	pthread_mutex_lock(&thpool_p->thcount_lock);
+	atomic_fetch_add_explicit(&thpool_p->num_threads_alive, 1, memory_order_release);
+	pthread_cond_signal(&thpool_p->threads_started);
+	pthread_mutex_unlock(&thpool_p->thcount_lock);
+
+	while(thpool_alive_state(thpool_p) && !thread_leaving(thread_p)){
+
+		int woke = thread_idle_wait(thread_p);
+		if (woke == -1){
+			if (thread_retire_idle(thread_p)){
+				break;
+			}
+			continue;
+		}
+		if (thread_leaving(thread_p)){
+			break;
+		}
+
+		if (thpool_alive_state(thpool_p) && thread_enter_gate(thread_p) == 0){
+
+			/* seq_cst: thpool_wait() must not see the job gone from
+			 * num_jobs_queued before it sees this thread working */
+			atomic_fetch_add(&thpool_p->num_threads_working, 1);
+
+			/* Find a job. Each post stands for one queued job, but it may
+			 * be mid-steal by another thread, so only give up once
+			 * nothing is queued (thpool_destroy() posts without jobs) */
+			job* job_p = thread_find_job(thread_p);
+			while (job_p == NULL && atomic_load(&thpool_p->num_jobs_queued) > 0){
+				sched_yield();
+				job_p = thread_find_job(thread_p);
+			}
+
+			/* Read job from queue and execute it */
+			th_func_p func_buff;
+			void*  arg_buff;
+			int shard = job_p ? job_p->shard : -1;
+			if (job_p && shard == -1) {
+				atomic_fetch_sub(&thpool_p->num_jobs_queued, 1);
+			}
+			else if (job_p && woke == 0) {
+				/* The post taken was for some other job */
+				csem_post(&thpool_p->has_jobs, 1);
+			}
+			if (job_p) {
+
+				/* Cancelled and expired jobs complete without running */
+				int dropped = job_claim(job_p);
+				thread_leave_gate(thread_p);
+				int in_flight = 0;
+				if (dropped == 0){
+					func_buff     = job_p->function;
+					arg_buff      = job_p->arg;
+#if THPOOL_METRICS
+					long long started_ns = metrics_now_ns();
+					long long waited_ns  = started_ns - job_p->metrics.queued_ns;
+					histogram_record(&thread_p->queue_wait, waited_ns);
+					if (waited_ns > thpool_p->scale_wait_ns && thpool_p->max_threads > thpool_p->min_threads &&
+					    atomic_load(&thpool_p->num_jobs_queued) > 0){
+						thpool_request_grow(thpool_p);
+					}
+					/* Stays the start time of an I/O job handed to the ring,
+					 * which may complete as soon as it is submitted */
+					job_p->metrics.done_ns = started_ns;
+#endif
+					in_flight = func_buff == thpool_io_run && thpool_io_submit(thread_p, job_p) == 0;
+#if THPOOL_METRICS
+					if (func_buff == thpool_io_run){
+						atomic_fetch_add_explicit(in_flight ? &thpool_p->io_submitted : &thpool_p->io_inline, 1,
+						                          memory_order_relaxed);
+					}
+#endif
+					if (!in_flight){
+						job_p->result = func_buff(arg_buff);
+#if THPOOL_METRICS
+						job_p->metrics.done_ns = metrics_now_ns();
+						histogram_record(&thread_p->run_time, job_p->metrics.done_ns - started_ns);
+#endif
+					}
+				}
+				else{
+					job_p->result = dropped;
+#if THPOOL_METRICS
+					job_p->metrics.done_ns = metrics_now_ns();
+					atomic_fetch_add_explicit(&thpool_p->jobs_dropped, 1, memory_order_relaxed);
+#endif
+				}
+				if (!in_flight){
+					thpool_deliver(thpool_p, job_p);
+				}
+				if (shard != -1){
+					thread_keyed_done(thpool_p, shard);
+				}
+			}
+			else{
+				thread_leave_gate(thread_p);
+			}
+
+			/* Last one out wakes thpool_wait(), if anyone is in it */
+			if (atomic_fetch_sub(&thpool_p->num_threads_working, 1) == 1 &&
+			    atomic_load(&thpool_p->num_idle_waiters) > 0){
+				pthread_mutex_lock(&thpool_p->thcount_lock);
+				pthread_cond_broadcast(&thpool_p->threads_all_idle);
+				pthread_mutex_unlock(&thpool_p->thcount_lock);
+			}
+		}
+	}
+	thread_self = NULL;
+
+	/* Leaving a running pool: the last post taken may have been for a job,
+	 * and keyed jobs still queued here need someone to adopt them */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (thpool_alive_state(thpool_p) &&
+	    (atomic_load(&thpool_p->num_jobs_queued) > 0 || atomic_load(&thread_p->num_keyed) > 0)){
+		csem_post(&thpool_p->has_jobs, 1);
+	}
+
+	atomic_fetch_sub_explicit(&thpool_p->num_threads_alive, 1, memory_order_release);
+
+	/* Last touch: from here on the slot may be started again or freed.
+	 * Under thcount_lock, so thread_wait_stopped() does not miss it */
+	pthread_mutex_lock(&thpool_p->thcount_lock);
+	atomic_store_explicit(&thread_p->running, 0, memory_order_release);
+	pthread_cond_broadcast(&thpool_p->threads_stopped);
+	pthread_mutex_unlock(&thpool_p->thcount_lock);
+	return NULL;
+}
+
+
+/* Whether thpool_resize() asked the thread to leave, and it now will
+ *
+ * retire is 0 while in the pool, 1 once asked to leave and 2 once
+ * leaving.  Growing the pool again flips a 1 back to 0, so a thread
+ * that has not yet noticed is simply kept.
+ */
+static int thread_leaving(struct thread* thread_p){
+	int asked = 1;
+	return atomic_load_explicit(&thread_p->retire, memory_order_relaxed) == 1 &&
+	       atomic_compare_exchange_strong(&thread_p->retire, &asked, 2);
+}
+
+
+/* Wait until the pthread of a thread has returned
+ *
+ * Joinable threads are joined.  The autoscaler detaches the threads it
+ * retires, so for those wait for thread_do() to clear running.
+ */
+static void thread_wait_stopped(struct thread* thread_p){
+	thpool_* thpool_p = thread_p->thpool_p;
+	if (thread_p->joinable){
+		pthread_join(thread_p->pthread, NULL);
+		thread_p->joinable = 0;
+		return;
+	}
+	pthread_mutex_lock(&thpool_p->thcount_lock);
+	while (atomic_load_explicit(&thread_p->running, memory_order_acquire)){
+		pthread_cond_wait(&thpool_p->threads_stopped, &thpool_p->thcount_lock);
+	}
+	pthread_mutex_unlock(&thpool_p->thcount_lock);
+}
+
+
+/* Leave the pool after idling for idle_linger_ns
+ *
+ * Only the newest thread may leave, so the ones jobs are routed to stay
+ * numbered 0 to num_threads - 1 and the pool shrinks from the top, one
+ * lingering thread at a time.
+ *
+ * @return 1 if the thread left the pool, 0 otherwise
+ */
+static int thread_retire_idle(struct thread* thread_p){
+	thpool_* thpool_p = thread_p->thpool_p;
+	int retired = 0;
+
+	/* A resize in progress may be waiting on this very thread */
+	if (pthread_mutex_trylock(&thpool_p->resize_lock) != 0){
+		return 0;
+	}
+	if (atomic_load(&thpool_p->num_threads) == thread_p->id + 1 &&
+	    thread_p->id >= thpool_p->min_threads && thpool_alive_state(thpool_p)){
+		atomic_store(&thread_p->retire, 2);
+		atomic_store_explicit(&thpool_p->num_threads, thread_p->id, memory_order_release);
+		/* Nobody waits for us, so let the stack go as soon as we return */
+		pthread_detach(thread_p->pthread);
+		thread_p->joinable = 0;
+		retired = 1;
+	}
+	pthread_mutex_unlock(&thpool_p->resize_lock);
+	return retired;
+}
+
+
+/* Wait for the next post on has_jobs: busy-wait, then yield, then sleep
+ *
+ * How long a thread busy-waits follows the gaps between the jobs it has
+ * recently picked up: a job that turned up within the limit (even while
+ * sleeping) stretches the budget to twice that gap, a longer sleep halves
+ * it.  So threads stay hot under a steady stream of short jobs and stop
+ * burning CPU once the stream thins out.  Keyed jobs queued for the
+ * thread end the wait without a post, and so does thpool_resize()
+ * asking the thread to leave.
+ *
+ * @return 0 once a post was taken, 1 if keyed jobs came in or the
+ *         thread was asked to leave, -1 if idle_linger_ns passed first
+ */
+static int thread_idle_wait(struct thread* thread_p){
+	thpool_* thpool_p = thread_p->thpool_p;
+	csem* has_jobs_p  = &thpool_p->has_jobs;
+	atomic_int* keyed_p = &thread_p->num_keyed;
+
+	if (csem_trywait(has_jobs_p)){
+		return 0;
+	}
+	if (atomic_load(keyed_p)){
+		return 1;
+	}
+
+	struct timespec start, now;
+	long long waited_ns = 0;
+	int got = 0;
+	int woke = 0;
+	int n;
+	clock_gettime(THPOOL_CLOCK, &start);
+
+	/* Busy-wait */
+	for (n = 1; thread_p->spin_ns > 0; n++){
+		cpu_relax();
+		if (csem_trywait(has_jobs_p)){
+			got = 1;
+			break;
+		}
+		if (atomic_load_explicit(keyed_p, memory_order_relaxed)){
+			got  = 1;
+			woke = 1;
+			break;
+		}
+		if (n % IDLE_SPIN_CLOCK_EVERY == 0){
+			clock_gettime(THPOOL_CLOCK, &now);
+			waited_ns = (now.tv_sec - start.tv_sec) * 1000000000LL + (now.tv_nsec - start.tv_nsec);
+			if (waited_ns >= thread_p->spin_ns){
+				break;
+			}
+		}
+	}
+
+	/* Yield */
+	for (n = 0; !got && n < thpool_p->idle_yields; n++){
+		sched_yield();
+		got = csem_trywait(has_jobs_p);
+		if (!got && atomic_load_explicit(keyed_p, memory_order_relaxed)){
+			got  = 1;
+			woke = 1;
+		}
+	}
+
+	/* Sleep, for at most idle_linger_ns if the autoscaler may retire us */
+	if (!got){
+		struct timespec deadline;
+		struct timespec* deadline_p = NULL;
+		if (thread_p->id >= thpool_p->min_threads && thpool_p->max_threads > thpool_p->min_threads &&
+		    thpool_p->idle_linger_ns){
+			abstime_from_now(&deadline, thpool_p->idle_linger_ns);
+			deadline_p = &deadline;
+		}
+		woke = csem_timedwait_flag(has_jobs_p, deadline_p, keyed_p, &thread_p->retire, 1U << (thread_p->id % 32));
+		if (woke == -1){
+			return -1;
+		}
+	}
+
+	if (thpool_p->idle_spin_ns == 0){
+		return woke;
+	}
+	clock_gettime(THPOOL_CLOCK, &now);
+	waited_ns = (now.tv_sec - start.tv_sec) * 1000000000LL + (now.tv_nsec - start.tv_nsec);
+
+	long long target_ns;
+	if (waited_ns <= thpool_p->idle_spin_ns){
+		target_ns = 2 * waited_ns;
+		if (target_ns > thpool_p->idle_spin_ns){
+			target_ns = thpool_p->idle_spin_ns;
+		}
+	}
+	else {
+		target_ns = thread_p->spin_ns / 2;
+	}
+	thread_p->spin_ns = (int)((thread_p->spin_ns + target_ns) / 2);
+	return woke;
+}
+
+
+/* Take the next job for a thread to run
+ *
+ * The highest priority level with work wins.  To keep lower levels from
+ * starving under a steady stream of higher ones, every
+ * PRIO_AGING_INTERVAL-th pick of a thread starts at NORMAL and every
+ * PRIO_AGING_INTERVAL^2-th at LOW, so each level is guaranteed a share
+ * of the picks however busy the levels above it are.
+ *
+ * @return job, NULL if none could be found
+ */
+static struct job* thread_find_job(struct thread* thread_p){
+	job* job_p = NULL;
+	int start = THPOOL_PRIO_HIGH;
+	int n;
+
+	unsigned int pick = thread_p->picks + 1;
+	if (pick % (PRIO_AGING_INTERVAL * PRIO_AGING_INTERVAL) == 0){
+		start = THPOOL_PRIO_LOW;
+	}
+	else if (pick % PRIO_AGING_INTERVAL == 0){
+		start = THPOOL_PRIO_NORMAL;
+	}
+
+	for (n = 0; n < THPOOL_PRIO_LEVELS && job_p == NULL; n++){
+		job_p = thread_take_level(thread_p, (start + n) % THPOOL_PRIO_LEVELS);
+	}
+	if (job_p){
+		thread_p->picks = pick;
+	}
+	return job_p;
+}
+
+
+/* Take a job of one priority level
+ *
+ * NORMAL: own keyed queue first, then own deque (newest job, still hot
+ * in cache), then own inbox, then the bounded ring or shared queue, then
+ * other threads, and last the keyed queues threads left behind.
+ *
+ * @return job, NULL if the level has none for this thread
+ */
+static struct job* thread_take_level(struct thread* thread_p, int prio){
+	thpool_* thpool_p = thread_p->thpool_p;
+	job* job_p;
+
+	if (prio == THPOOL_PRIO_HIGH){
+		jobqueue* queue_p = &thpool_p->queue_high;
+		return atomic_load_explicit(&queue_p->len, memory_order_relaxed) ? jobqueue_pull_front(queue_p) : NULL;
+	}
+	if (prio == THPOOL_PRIO_LOW){
+		jobqueue* queue_p = &thpool_p->queue_low;
+		return atomic_load_explicit(&queue_p->len, memory_order_relaxed) ? jobqueue_pull_front(queue_p) : NULL;
+	}
+
+	job_p = thread_take_keyed(thread_p);
+	if (job_p == NULL){
+		job_p = wsdeque_pop(&thread_p->deque);
+	}
+	if (job_p == NULL && atomic_load_explicit(&thread_p->inbox.len, memory_order_relaxed)){
+		job_p = jobqueue_pull_front(&thread_p->inbox);
+	}
+	if (job_p == NULL && thpool_p->ring.cells){
+		job_p = jobring_pop(&thpool_p->ring);
+		if (job_p){
+			csem_post(&thpool_p->ring.free_slots, 1);
+		}
+	}
+	if (job_p == NULL && atomic_load_explicit(&thpool_p->queue_in.len, memory_order_relaxed)){
+		job_p = jobqueue_pull_front(&thpool_p->queue_in);
+	}
+	if (job_p == NULL){
+		job_p = thread_steal_job(thread_p);
+	}
+	if (job_p == NULL){
+		job_p = thread_adopt_keyed(thread_p);
+	}
+	return job_p;
+}
+
+
+/* Steal a job from another thread of the pool
+ *
+ * Inboxes are fed round robin, so walking backwards from the one fed
+ * last finds queued work within a few victims even in a big pool.  The
+ * starting point is jittered so concurrent thieves spread out instead of
+ * all hammering the same victim.  NUMA pools try the thief's own node
+ * before crossing over to the others.
+ *
+ * @return job, NULL if every victim came up empty
+ */
+static struct job* thread_steal_job(struct thread* thread_p){
+	thpool_* thpool_p = thread_p->thpool_p;
+	/* Threads that left the pool may still hold jobs, so try them too */
+	int num_threads = atomic_load_explicit(&thpool_p->num_slots, memory_order_acquire);
+	job* job_p = NULL;
+
+	if (num_threads < 2){
+		return NULL;
+	}
+
+	/* xorshift32 */
+	unsigned int x = thread_p->steal_seed;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	thread_p->steal_seed = x;
+
+	/* Same node first: its jobs were queued for memory close to us */
+	nodetable* nodes_p = atomic_load_explicit(&thpool_p->nodes, memory_order_acquire);
+	if (nodes_p && thread_p->node < nodes_p->num_nodes){
+		numanode* node_p = &nodes_p->nodes[thread_p->node];
+		int num_workers = numanode_workers_below(node_p, num_threads);
+		int n;
+		for (n = 0; n < num_workers && job_p == NULL; n++){
+			int id = node_p->workers[(x + n) % num_workers];
+			if (thpool_thread(thpool_p, id) != thread_p){
+				job_p = thread_steal_from(thpool_thread(thpool_p, id));
+			}
+		}
+		if (job_p){
+			return job_p;
+		}
+	}
+
+	unsigned int newest = atomic_load_explicit(&thpool_p->next_inbox, memory_order_relaxed) - 1;
+	int start = (int)((newest - x % STEAL_START_JITTER) % (unsigned int)num_threads);
+	int n;
+	for (n = 0; n < num_threads && job_p == NULL; n++){
+		thread* victim_p = thpool_thread(thpool_p, (start + num_threads - n) % num_threads);
+		if (victim_p == thread_p || (nodes_p && victim_p->node == thread_p->node)){
+			continue;
+		}
+		job_p = thread_steal_from(victim_p);
+	}
+	return job_p;
+}
+
+
+/* Take one job from a victim's deque, or failing that its inbox
+ * @return job, NULL if the victim had none
+ */
+static struct job* thread_steal_from(struct thread* victim_p){
+	job* job_p = NULL;
+	if (!wsdeque_empty(&victim_p->deque)){
+		job_p = wsdeque_steal(&victim_p->deque);
+	}
+	if (job_p == NULL && atomic_load_explicit(&victim_p->inbox.len, memory_order_relaxed)){
+		job_p = jobqueue_pull_front(&victim_p->inbox);
+	}
+	return job_p;
+}
+
+
+/* Take the next keyed job of a thread, unless one of them is running
+ * @return job, NULL if there is none or one is running
+ */
+static struct job* thread_take_keyed(struct thread* owner_p){
+	int idle = 0;
+	if (atomic_load_explicit(&owner_p->keyed.len, memory_order_relaxed) == 0 ||
+	    !atomic_compare_exchange_strong(&owner_p->keyed_busy, &idle, 1)){
+		return NULL;
+	}
+	job* job_p = jobqueue_pull_front(&owner_p->keyed);
+	if (job_p == NULL){
+		atomic_store(&owner_p->keyed_busy, 0);
+		return NULL;
+	}
+	atomic_fetch_sub(&owner_p->num_keyed, 1);
+	return job_p;
+}
+
+
+/* Take a keyed job left behind by a thread that left the pool
+ *
+ * Its shards stay with the slot until they run dry, so whoever runs them
+ * meanwhile still runs one at a time and in order.
+ *
+ * @return job, NULL if no thread left any
+ */
+static struct job* thread_adopt_keyed(struct thread* thread_p){
+	thpool_* thpool_p = thread_p->thpool_p;
+	int num_slots = atomic_load_explicit(&thpool_p->num_slots, memory_order_acquire);
+	int id;
+	for (id = atomic_load(&thpool_p->num_threads); id < num_slots; id++){
+		job* job_p = thread_take_keyed(thpool_thread(thpool_p, id));
+		if (job_p){
+			return job_p;
+		}
+	}
+	return NULL;
+}
+
+
+/* Let the next job of a shard's thread go once one of them ran */
+static void thread_keyed_done(thpool_* thpool_p, int shard){
+	atomic_ullong* shard_p = &thpool_p->key_shards[shard];
+	thread* owner_p = thpool_thread(thpool_p, (int)(atomic_load(shard_p) >> 32));
+
+	atomic_store(&owner_p->keyed_busy, 0);
+	/* pending is the low half and counts this job, so never borrows */
+	atomic_fetch_sub(shard_p, 1);
+	atomic_fetch_sub(&thpool_p->num_keyed_queued, 1);
+
+	/* Nobody sleeps on the keyed queue of a thread that left the pool,
+	 * so wake someone to adopt its next job */
+	if (owner_p->id >= atomic_load(&thpool_p->num_threads) && atomic_load(&owner_p->num_keyed) > 0){
+		csem_post(&thpool_p->has_jobs, 1);
+	}
+}
+
+
+/* Frees a thread  */
+static void thread_destroy (thread* thread_p){
+#if THPOOL_IO_URING
+	iouring_destroy(&thread_p->ring);
+#endif
+	jobqueue_destroy(&thread_p->inbox);
+	jobqueue_destroy(&thread_p->keyed);
+	wsdeque_destroy(&thread_p->deque);
+	free(thread_p);
+}
+
+
+
+
+
+/* ============================ JOB QUEUE =========================== */
+
+
+/* Mark a job queued, as one that was never queued before
+ *
+ * The bump of the generation above the state bits lets thpool_cancel()
+ * tell the job apart from earlier uses of the same memory, which it may
+ * still find in lock-free queues.  The fields must be set by now.
+ */
+static void job_arm(struct job* job_p){
+	unsigned int state = atomic_load_explicit(&job_p->state, memory_order_relaxed);
+	atomic_store_explicit(&job_p->state, ((state & ~JOB_STATE_MASK) + (1U << 2)) | JOB_QUEUED,
+	                      memory_order_release);
+}
+
+
+/* Cancel a job if it is queued with job_uuid
+ *
+ * job_p may be stale, so the state is read before the uuid and only
+ * swapped if the job was not queued again in between.  Futures and
+ * parallel_for helpers have no uuid of their own and are never
+ * cancelled, so a user's uuid 0 does not match them.
+ *
+ * @return 1 if cancelled, 0 otherwise
+ */
+static int job_cancel(struct job* job_p, int job_uuid){
+	unsigned int state = atomic_load_explicit(&job_p->state, memory_order_acquire);
+	return (state & JOB_STATE_MASK) == JOB_QUEUED && job_p->uuid == job_uuid &&
+	       !atomic_load_explicit(&job_p->future, memory_order_relaxed) && job_p->function != parfor_run &&
+	       atomic_compare_exchange_strong(&job_p->state, &state, (state & ~JOB_STATE_MASK) | JOB_CANCELLED);
+}
+
+
+/* Claim a job taken from a queue for running
+ * @return 0 if it may run, -ECANCELED if thpool_cancel() got it first,
+ *         -ETIMEDOUT if its deadline passed
+ */
+static int job_claim(struct job* job_p){
+	unsigned int state = atomic_load_explicit(&job_p->state, memory_order_relaxed);
+	if ((state & JOB_STATE_MASK) != JOB_QUEUED ||
+	    !atomic_compare_exchange_strong(&job_p->state, &state, (state & ~JOB_STATE_MASK) | JOB_RUNNING)){
+		return -ECANCELED;
+	}
+	if (job_p->deadline_ns && clock_now_ns() > job_p->deadline_ns){
+		return -ETIMEDOUT;
+	}
+	return 0;
+}
+
+
+
+/* Initialize queue
+ *
+ * @param num_buckets   initial size of the uuid index, 0 for an unindexed queue
+ * @return 0 on success, -1 otherwise.
+ */
+static int jobqueue_init(jobqueue* jobqueue_p, unsigned int num_buckets){
+
+	atomic_init(&jobqueue_p->len, 0);
+	jobqueue_p->front = NULL;
+	jobqueue_p->rear  = NULL;
+	jobqueue_p->buckets = NULL;
+	jobqueue_p->num_buckets = 0;
+	jobqueue_p->waiters = NULL;
+
+	if (num_buckets){
+		jobqueue_p->buckets = (struct job**)calloc(num_buckets, sizeof(struct job*));
+		if (jobqueue_p->buckets == NULL){
+			return -1;
+		}
+		jobqueue_p->num_buckets = num_buckets;
+	}
+
+	pthread_mutex_init(&(jobqueue_p->rwmutex), NULL);
+
+	return 0;
+}
+
+
+/* Clear the queue
+ * Notice: Jobs are only unlinked, their memory belongs to the pool's job slab
+ */
+static void jobqueue_clear(jobqueue* jobqueue_p){
+
+	while(jobqueue_length(jobqueue_p)){
+		jobqueue_pull_front(jobqueue_p);
+	}
+
+	pthread_mutex_lock(&jobqueue_p->rwmutex);
+	jobqueue_p->front = NULL;
+	jobqueue_p->rear  = NULL;
+	atomic_store_explicit(&jobqueue_p->len, 0, memory_order_relaxed);
+	pthread_mutex_unlock(&jobqueue_p->rwmutex);
+}
+
+
+/* Add (allocated) job to queue
+ */
+static void jobqueue_push(jobqueue* jobqueue_p, struct job* newjob){
+
+	pthread_mutex_lock(&jobqueue_p->rwmutex);
+	newjob->prev = NULL;
+	newjob->next = NULL;
+
+	switch(atomic_load_explicit(&jobqueue_p->len, memory_order_relaxed)){
+
+		case 0:  /* if no jobs in queue */
+			jobqueue_p->front = newjob;
+			jobqueue_p->rear  = newjob;
+			break;
+
+		default: /* if jobs in queue */
+			jobqueue_p->rear->prev = newjob;
+			newjob->next = jobqueue_p->rear;
+			jobqueue_p->rear = newjob;
+	}
+	atomic_fetch_add_explicit(&jobqueue_p->len, 1, memory_order_relaxed);
+	if (jobqueue_p->buckets){
+		jobindex_insert(jobqueue_p, newjob);
+	}
+#if THPOOL_DEBUG
+	int len = atomic_load_explicit(&jobqueue_p->len, memory_order_relaxed);
+#endif
+
+	if (jobqueue_p->waiters){
+		jobqueue_wake_waiters(jobqueue_p, newjob);
+	}
+
+	pthread_mutex_unlock(&jobqueue_p->rwmutex);
+
+#if THPOOL_DEBUG
+	/* Warn outside the lock, printf can block */
+	if (len > MAX_QUEUE_SIZE_WITHOUT_WARNING)
+		printf("%s: WARNING: queue len > %d\n",
+		       __func__, MAX_QUEUE_SIZE_WITHOUT_WARNING);
+	printf("THPOOL_DEBUG: %s: job(%p) with uuid %d added to queue(%p) (on pthread:%u)\n",
+	       __func__, newjob, newjob->uuid, jobqueue_p, (unsigned int)pthread_self());
+#endif
+}
+
+
+/* Add a chain of (allocated) jobs to queue under a single lock
+ *
+ * @param first_p       front of the chain (linked through ->prev)
+ * @param last_p        rear of the chain
+ * @param num_jobs      jobs in the chain
+ */
+static void jobqueue_push_chain(jobqueue* jobqueue_p, struct job* first_p, struct job* last_p, int num_jobs){
+
+	/* Fill in the back links before taking the lock */
+	job* job_p;
+	first_p->next = NULL;
+	for (job_p = first_p; job_p != last_p; job_p = job_p->prev){
+		job_p->prev->next = job_p;
+	}
+	last_p->prev = NULL;
+
+	pthread_mutex_lock(&jobqueue_p->rwmutex);
+	jobqueue_link_chain(jobqueue_p, first_p, last_p, num_jobs);
+	pthread_mutex_unlock(&jobqueue_p->rwmutex);
+#if THPOOL_DEBUG
+	printf("THPOOL_DEBUG: %s: %d jobs(%p..%p) added to queue(%p) (on pthread:%u)\n",
+	       __func__, num_jobs, first_p, last_p, jobqueue_p, (unsigned int)pthread_self());
+#endif
+}
+
+
+/* Add a chain of (allocated) jobs to the rear of the queue
+ * The chain must be linked both ways already, NULL at either end.
+ * Notice: Caller MUST hold the queue mutex
+ */
+static void jobqueue_link_chain(jobqueue* jobqueue_p, struct job* first_p, struct job* last_p, int num_jobs){
+
+	job* job_p;
+	job* next_p;
+
+	if (jobqueue_p->buckets){
+		/* One job at a time: a growing index rehashes the queue, which
+		 * must only hold jobs indexed already */
+		for (job_p = first_p; job_p; job_p = next_p){
+			next_p = job_p->prev;
+			job_p->prev = NULL;
+			job_p->next = NULL;
+			if (atomic_load_explicit(&jobqueue_p->len, memory_order_relaxed) == 0){
+				jobqueue_p->front = job_p;
+			}
+			else{
+				jobqueue_p->rear->prev = job_p;
+				job_p->next = jobqueue_p->rear;
+			}
+			jobqueue_p->rear = job_p;
+			atomic_fetch_add_explicit(&jobqueue_p->len, 1, memory_order_relaxed);
+			jobindex_insert(jobqueue_p, job_p);
+		}
+	}
+	else{
+		switch(atomic_load_explicit(&jobqueue_p->len, memory_order_relaxed)){
+
+			case 0:  /* if no jobs in queue */
+				jobqueue_p->front = first_p;
+				jobqueue_p->rear  = last_p;
+				break;
+
+			default: /* if jobs in queue */
+				jobqueue_p->rear->prev = first_p;
+				first_p->next = jobqueue_p->rear;
+				jobqueue_p->rear = last_p;
+		}
+		atomic_fetch_add_explicit(&jobqueue_p->len, num_jobs, memory_order_relaxed);
+	}
+
+	if (jobqueue_p->waiters){
+		for (job_p = first_p; job_p; job_p = job_p->prev){
+			jobqueue_wake_waiters(jobqueue_p, job_p);
+		}
+	}
+}
+
+
+/* Wake whoever is waiting for this very job (or for any job)
+ * Notice: Caller MUST hold the queue mutex
+ */
+static void jobqueue_wake_waiters(jobqueue* jobqueue_p, struct job* job_p){
+	jobwaiter* waiter_p;
+	for (waiter_p = jobqueue_p->waiters; waiter_p; waiter_p = waiter_p->next){
+		if (waiter_p->any || waiter_p->uuid == job_p->uuid){
+			waiter_p->ready = 1;
+			pthread_cond_signal(&waiter_p->cond);
+		}
+	}
+}
+
+
+/* Get first job from queue(removes it from queue)
+ * Notice: Caller MUST hold a mutex
+ */
+static struct job* jobqueue_pull_front(jobqueue* jobqueue_p){
+
+	pthread_mutex_lock(&jobqueue_p->rwmutex);
+	job* job_p = jobqueue_p->front;
+
+	switch(atomic_load_explicit(&jobqueue_p->len, memory_order_relaxed)){
+
+		case 0:  /* if no jobs in queue */
+			break;
+
+		case 1:  /* if one job in queue */
+			jobqueue_p->front = NULL;
+			jobqueue_p->rear  = NULL;
+			atomic_store_explicit(&jobqueue_p->len, 0, memory_order_relaxed);
+			break;
+
+		default: /* if >1 jobs in queue */
+			jobqueue_p->front = job_p->prev;
+			jobqueue_p->front->next = NULL;
+			atomic_fetch_sub_explicit(&jobqueue_p->len, 1, memory_order_relaxed);
+	}
+	if (job_p && jobqueue_p->buckets){
+		jobindex_remove(jobqueue_p, job_p);
+	}
+#if THPOOL_DEBUG
+	int len = atomic_load_explicit(&jobqueue_p->len, memory_order_relaxed);
+#endif
+
+	pthread_mutex_unlock(&jobqueue_p->rwmutex);
+
+#if THPOOL_DEBUG
+	if (len > MAX_QUEUE_SIZE_WITHOUT_WARNING)
+		printf("%s: WARNING: queue len > %d\n",
+		       __func__, MAX_QUEUE_SIZE_WITHOUT_WARNING);
+	int uuid = -1;
+	if (job_p) uuid = job_p->uuid;
+	printf("THPOOL_DEBUG: %s: job(%p) with uuid %d pulled from queue(%p) (on pthread:%u)\n",
+	       __func__, job_p, uuid, jobqueue_p, (unsigned int)pthread_self());
+#endif
+
+	return job_p;
+}
+
+
+/* Look up job uuid in the queue's index and remove it from the queue
+ *
+ * Lookup and removal are O(1) on average, so holding the queue lock here
+ * never stalls jobqueue_push() for longer than a push itself takes.
+ * When several queued jobs share a uuid the oldest one is returned.
+ *
+ * Notice: Caller MUST hold the queue mutex
+ * Notice: Queue MUST have been initialized with an index
+ */
+// returned NULL indicates NOT FOUND
+static struct job* jobqueue_unlink_by_uuid(jobqueue* jobqueue_p, int job_uuid){
+
+	/* Buckets hold newest first, so the last match is the oldest job */
+	job* curr_job_p = NULL;
+	job* iter_job_p = jobqueue_p->buckets[jobindex_hash(job_uuid, jobqueue_p->num_buckets)];
+	while (iter_job_p){
+		if (iter_job_p->uuid == job_uuid){
+			curr_job_p = iter_job_p;
+		}
+		iter_job_p = iter_job_p->hnext;
+	}
+
+	if (curr_job_p){
+		jobindex_remove(jobqueue_p, curr_job_p);
+
+		switch (atomic_load_explicit(&jobqueue_p->len, memory_order_relaxed)){
+
+			case 0:  /* if no jobs in queue */
+				break;
+
+			case 1:  /* if one job in queue */
+				jobqueue_p->front = NULL;
+				jobqueue_p->rear  = NULL;
+				atomic_store_explicit(&jobqueue_p->len, 0, memory_order_relaxed);
+				break;
+
+			default: /* if >1 jobs in queue */
+				if (!curr_job_p->next) {
+					/* Current job at queue front */
+					jobqueue_p->front = curr_job_p->prev;
+					jobqueue_p->front->next = NULL;
+				}
+				else if (!curr_job_p->prev){
+					/* Current job at queue rear */
+					jobqueue_p->rear = curr_job_p->next;
+					jobqueue_p->rear->prev = NULL;
+				}
+				else {
+					/* Current job somewhere in the middle */
+					curr_job_p->next->prev = curr_job_p->prev;
+					curr_job_p->prev->next = curr_job_p->next;
+				}
+
+				atomic_fetch_sub_explicit(&jobqueue_p->len, 1, memory_order_relaxed);
+		}
+	}
+
+	return curr_job_p;
+}
+
+
+/* Search for job uuid, waiting for it to be pushed if not there yet
+ *
+ * The caller sleeps on its own condition variable, which jobqueue_push()
+ * signals only when a job with a matching uuid arrives.  Other
+ * completions do not wake it.
+ *
+ * @param abstime       absolute THPOOL_CLOCK deadline, NULL waits forever
+ * @return the job (removed from queue), NULL if deadline passed first
+ *
+ * Notice: Queue MUST have been initialized with an index
+ */
+static struct job* jobqueue_pull_by_uuid(jobqueue* jobqueue_p, int job_uuid, const struct timespec* abstime){
+
+/*
+TODO: Do I want to implement "trylock" like I did in POC?  If so, how?
+		Pass in returned job pointer as param instead
+		Use return value for error code from trylock
+	Leave this work for AFTER it's in Propeller?
+	WILL NEED: cuz drives may "vanish" unexpectedly.
+		Don't want to endlessly wait for a drive that's no longer there.
+*/
+	jobwaiter waiter;
+	int registered = 0;
+	int timed_out  = 0;
+
+	pthread_mutex_lock(&jobqueue_p->rwmutex);
+
+	job* curr_job_p = jobqueue_unlink_by_uuid(jobqueue_p, job_uuid);
+	while (curr_job_p == NULL && !timed_out){
+		if (!registered){
+			waiter.uuid  = job_uuid;
+			waiter.any   = 0;
+			waiter.ready = 0;
+			waiter_cond_init(&waiter.cond);
+			waiter.next  = jobqueue_p->waiters;
+			jobqueue_p->waiters = &waiter;
+			registered = 1;
+		}
+
+		while (!waiter.ready && !timed_out){
+			if (abstime){
+				timed_out = (pthread_cond_timedwait(&waiter.cond, &jobqueue_p->rwmutex, abstime) == ETIMEDOUT);
+			}
+			else{
+				pthread_cond_wait(&waiter.cond, &jobqueue_p->rwmutex);
+			}
+		}
+		waiter.ready = 0;
+		curr_job_p = jobqueue_unlink_by_uuid(jobqueue_p, job_uuid);
+	}
+
+	if (registered){
+		jobwaiter** link_p = &jobqueue_p->waiters;
+		while (*link_p != &waiter){
+			link_p = &(*link_p)->next;
+		}
+		*link_p = waiter.next;
+	}
+#if THPOOL_DEBUG
+	int len = atomic_load_explicit(&jobqueue_p->len, memory_order_relaxed);
+#endif
+
+	pthread_mutex_unlock(&jobqueue_p->rwmutex);
+	if (registered){
+		pthread_cond_destroy(&waiter.cond);
+	}
+#if THPOOL_DEBUG
+	if (len > MAX_QUEUE_SIZE_WITHOUT_WARNING)
+		printf("%s: WARNING: queue len > %d\n",
+		       __func__, MAX_QUEUE_SIZE_WITHOUT_WARNING);
+	int uuid = -1;
+	if (curr_job_p) uuid = curr_job_p->uuid;
+	printf("THPOOL_DEBUG: %s: job(%p) with uuid %d pulled from queue(%p) (on pthread:%u)\n",
+	       __func__, curr_job_p, uuid, jobqueue_p, (unsigned int)pthread_self());
+#endif
+	return curr_job_p;
+}
+
+
+/* Detach up to max_jobs jobs from the front of the queue in one go
+ *
+ * Waits until at least one job is queued or the deadline passes.  The
+ * detached jobs stay chained front to rear through ->prev.
+ *
+ * @param max_jobs      most jobs to detach
+ * @param abstime       absolute THPOOL_CLOCK deadline, NULL waits forever
+ * @param num_jobs_p    number of jobs detached
+ * @return front of the detached chain, NULL if deadline passed first
+ */
+static struct job* jobqueue_pull_chain(jobqueue* jobqueue_p, int max_jobs, const struct timespec* abstime, int* num_jobs_p){
+	jobwaiter waiter;
+	int registered = 0;
+	int timed_out  = 0;
+	job* first_p = NULL;
+	int n = 0;
+
+	pthread_mutex_lock(&jobqueue_p->rwmutex);
+
+	while (atomic_load_explicit(&jobqueue_p->len, memory_order_relaxed) == 0 && !timed_out){
+		if (!registered){
+			waiter.uuid  = 0;
+			waiter.any   = 1;
+			waiter.ready = 0;
+			waiter_cond_init(&waiter.cond);
+			waiter.next  = jobqueue_p->waiters;
+			jobqueue_p->waiters = &waiter;
+			registered = 1;
+		}
+		if (abstime){
+			timed_out = (pthread_cond_timedwait(&waiter.cond, &jobqueue_p->rwmutex, abstime) == ETIMEDOUT);
+		}
+		else{
+			pthread_cond_wait(&waiter.cond, &jobqueue_p->rwmutex);
+		}
+	}
+
+	first_p = jobqueue_unlink_chain(jobqueue_p, max_jobs, &n);
+
+	if (registered){
+		jobwaiter** link_p = &jobqueue_p->waiters;
+		while (*link_p != &waiter){
+			link_p = &(*link_p)->next;
+		}
+		*link_p = waiter.next;
+	}
+
+	pthread_mutex_unlock(&jobqueue_p->rwmutex);
+	if (registered){
+		pthread_cond_destroy(&waiter.cond);
+	}
+#if THPOOL_DEBUG
+	printf("THPOOL_DEBUG: %s: %d jobs pulled from queue(%p) (on pthread:%u)\n",
+	       __func__, n, jobqueue_p, (unsigned int)pthread_self());
+#endif
+	*num_jobs_p = n;
+	return first_p;
+}
+
+
+/* Detach up to max_jobs jobs from the front of the queue, without waiting
+ *
+ * @param num_jobs_p    number of jobs detached
+ * @return front of the detached chain (through ->prev), NULL if empty
+ *
+ * Notice: Caller MUST hold the queue mutex
+ */
+static struct job* jobqueue_unlink_chain(jobqueue* jobqueue_p, int max_jobs, int* num_jobs_p){
+	job* first_p = NULL;
+	int n = 0;
+
+	if (atomic_load_explicit(&jobqueue_p->len, memory_order_relaxed)){
+		job* last_p = jobqueue_p->front;
+		first_p = last_p;
+		n = 1;
+		if (jobqueue_p->buckets){
+			jobindex_remove(jobqueue_p, last_p);
+		}
+		while (n < max_jobs && last_p->prev){
+			last_p = last_p->prev;
+			if (jobqueue_p->buckets){
+				jobindex_remove(jobqueue_p, last_p);
+			}
+			n++;
+		}
+
+		jobqueue_p->front = last_p->prev;
+		if (jobqueue_p->front){
+			jobqueue_p->front->next = NULL;
+		}
+		else{
+			jobqueue_p->rear = NULL;
+		}
+		last_p->prev = NULL;
+		atomic_fetch_sub_explicit(&jobqueue_p->len, n, memory_order_relaxed);
+	}
+
+	*num_jobs_p = n;
+	return first_p;
+}
+
+
+/* Get the queue's current length */
+static int jobqueue_length(jobqueue* jobqueue_p){
+	int len;
+	pthread_mutex_lock(&jobqueue_p->rwmutex);
+	len = atomic_load_explicit(&jobqueue_p->len, memory_order_relaxed);
+	pthread_mutex_unlock(&jobqueue_p->rwmutex);
+
+	return len;
+}
+
+
+/* Cancel the oldest job queued with job_uuid, see job_cancel()
+ * @return 1 if one was cancelled, 0 otherwise
+ */
+static int jobqueue_cancel(jobqueue* jobqueue_p, int job_uuid){
+	int cancelled = 0;
+	job* job_p;
+
+	if (atomic_load_explicit(&jobqueue_p->len, memory_order_relaxed) == 0){
+		return 0;
+	}
+	pthread_mutex_lock(&jobqueue_p->rwmutex);
+	for (job_p = jobqueue_p->front; job_p && !cancelled; job_p = job_p->prev){
+		cancelled = job_cancel(job_p, job_uuid);
+	}
+	pthread_mutex_unlock(&jobqueue_p->rwmutex);
+	return cancelled;
+}
+
+
+/* Detach the jobs whose reap_ns passed from the front of the queue
+ *
+ * Stops at the first job not expired yet, so reap_ns must grow front to
+ * rear.  The detached jobs stay chained front to rear through ->prev.
+ *
+ * @param num_jobs_p    number of jobs detached
+ * @return front of the detached chain, NULL if none expired
+ */
+static struct job* jobqueue_pull_expired(jobqueue* jobqueue_p, long long now_ns, int* num_jobs_p){
+	job* first_p = NULL;
+	job* last_p  = NULL;
+	int n = 0;
+
+	pthread_mutex_lock(&jobqueue_p->rwmutex);
+	job* job_p = jobqueue_p->front;
+	while (job_p && job_p->reap_ns <= now_ns){
+		if (jobqueue_p->buckets){
+			jobindex_remove(jobqueue_p, job_p);
+		}
+		last_p = job_p;
+		job_p  = job_p->prev;
+		n++;
+	}
+	if (n){
+		first_p = jobqueue_p->front;
+		jobqueue_p->front = job_p;
+		if (job_p){
+			job_p->next = NULL;
+		}
+		else{
+			jobqueue_p->rear = NULL;
+		}
+		last_p->prev = NULL;
+		atomic_fetch_sub_explicit(&jobqueue_p->len, n, memory_order_relaxed);
+	}
+	pthread_mutex_unlock(&jobqueue_p->rwmutex);
+
+	*num_jobs_p = n;
+	return first_p;
+}
+
+
+/* Free all queue resources back to the system */
+static void jobqueue_destroy(jobqueue* jobqueue_p){
+	jobqueue_clear(jobqueue_p);
+	pthread_mutex_destroy(&jobqueue_p->rwmutex);
+	free(jobqueue_p->buckets);
+}
+
+
+
+
+
+/* ============================ JOB INDEX =========================== */
+
+
+/* Map a job uuid to its index bucket
+ *
+ * Callers pick their own uuids, so they are often small and sequential.
+ * Mix the bits so those still spread over the whole table.
+ */
+static unsigned int jobindex_hash(int job_uuid, unsigned int num_buckets){
+	unsigned int h = (unsigned int)job_uuid;
+	h ^= h >> 16;
+	h *= 0x45d9f3bU;
+	h ^= h >> 16;
+	return h & (num_buckets - 1);
+}
+
+
+/* Add job to the front of its bucket
+ * Notice: Caller MUST hold the queue mutex
+ */
+static void jobindex_insert(jobqueue* jobqueue_p, struct job* job_p){
+	unsigned int b = jobindex_hash(job_p->uuid, jobqueue_p->num_buckets);
+	job_p->hnext = jobqueue_p->buckets[b];
+	jobqueue_p->buckets[b] = job_p;
+
+	/* Keep chains short, len already counts job_p */
+	if ((unsigned int)atomic_load_explicit(&jobqueue_p->len, memory_order_relaxed) > 2 * jobqueue_p->num_buckets){
+		jobindex_grow(jobqueue_p);
+	}
+}
+
+
+/* Unlink job from its bucket
+ * Notice: Caller MUST hold the queue mutex
+ */
+static void jobindex_remove(jobqueue* jobqueue_p, struct job* job_p){
+	job** link_p = &jobqueue_p->buckets[jobindex_hash(job_p->uuid, jobqueue_p->num_buckets)];
+	while (*link_p){
+		if (*link_p == job_p){
+			*link_p = job_p->hnext;
+			break;
+		}
+		link_p = &(*link_p)->hnext;
+	}
+	job_p->hnext = NULL;
+}
+
+
+/* Double the index size and rehash every queued job
+ *
+ * Jobs are re-inserted front (oldest) to rear (newest) so each bucket
+ * keeps its newest first ordering.  On allocation failure the old table
+ * is kept; lookups stay correct, only chains get longer.
+ *
+ * Notice: Caller MUST hold the queue mutex
+ */
+static void jobindex_grow(jobqueue* jobqueue_p){
+	unsigned int num_buckets = jobqueue_p->num_buckets * 2;
+	job** buckets = (struct job**)calloc(num_buckets, sizeof(struct job*));
+	if (buckets == NULL){
+		err("jobindex_grow(): Could not allocate memory for index\n");
+		return;
+	}
+
+	job* job_p;
+	for (job_p = jobqueue_p->front; job_p; job_p = job_p->prev){
+		unsigned int b = jobindex_hash(job_p->uuid, num_buckets);
+		job_p->hnext = buckets[b];
+		buckets[b] = job_p;
+	}
+
+	free(jobqueue_p->buckets);
+	jobqueue_p->buckets = buckets;
+	jobqueue_p->num_buckets = num_buckets;
+}
+
+
+
+
+
+/* ======================== WORK STEALING DEQUE ===================== */
+
+
+/* Initialize deque
+ *
+ * Follows "Correct and Efficient Work-Stealing for Weak Memory Models"
+ * (Le, Pop, Cohen, Zappa Nardelli, PPoPP 2013).
+ *
+ * @return 0 on success, -1 otherwise.
+ */
+static int wsdeque_init(wsdeque* wsdeque_p){
+	wsarray* array_p = (struct wsarray*)malloc(sizeof(struct wsarray) + WSDEQUE_INIT_SIZE * sizeof(job*));
+	if (array_p == NULL){
+		return -1;
+	}
+	array_p->size    = WSDEQUE_INIT_SIZE;
+	array_p->retired = NULL;
+
+	atomic_init(&wsdeque_p->top, 0);
+	atomic_init(&wsdeque_p->bottom, 0);
+	atomic_init(&wsdeque_p->array, array_p);
+	return 0;
+}
+
+
+/* Add job to the bottom of the deque
+ * Notice: Only the owning thread may call this
+ *
+ * @return 0 on success, -1 if the deque was full and could not grow
+ */
+static int wsdeque_push(wsdeque* wsdeque_p, struct job* job_p){
+	long b = atomic_load_explicit(&wsdeque_p->bottom, memory_order_relaxed);
+	long t = atomic_load_explicit(&wsdeque_p->top, memory_order_acquire);
+	wsarray* array_p = atomic_load_explicit(&wsdeque_p->array, memory_order_relaxed);
+
+	if (b - t > array_p->size - 1){
+		array_p = wsdeque_grow(wsdeque_p, array_p, b, t);
+		if (array_p == NULL){
+			return -1;
+		}
+	}
+	atomic_store_explicit(&array_p->slots[b & (array_p->size - 1)], job_p, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	atomic_store_explicit(&wsdeque_p->bottom, b + 1, memory_order_relaxed);
+	return 0;
+}
+
+
+/* Take job from the bottom of the deque (newest first)
+ * Notice: Only the owning thread may call this
+ *
+ * @return job, NULL if empty
+ */
+static struct job* wsdeque_pop(wsdeque* wsdeque_p){
+	long b = atomic_load_explicit(&wsdeque_p->bottom, memory_order_relaxed) - 1;
+	wsarray* array_p = atomic_load_explicit(&wsdeque_p->array, memory_order_relaxed);
+	atomic_store_explicit(&wsdeque_p->bottom, b, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	long t = atomic_load_explicit(&wsdeque_p->top, memory_order_relaxed);
+	job* job_p = NULL;
+
+	if (t <= b){
+		job_p = atomic_load_explicit(&array_p->slots[b & (array_p->size - 1)], memory_order_relaxed);
+		if (t == b){
+			/* Last job: race thieves for it */
+			if (!atomic_compare_exchange_strong_explicit(&wsdeque_p->top, &t, t + 1,
+			                                             memory_order_seq_cst, memory_order_relaxed)){
+				job_p = NULL;
+			}
+			atomic_store_explicit(&wsdeque_p->bottom, b + 1, memory_order_relaxed);
+		}
+	}
+	else{
+		/* Empty */
+		atomic_store_explicit(&wsdeque_p->bottom, b + 1, memory_order_relaxed);
+	}
+	return job_p;
+}
+
+
+/* Take job from the top of the deque (oldest first)
+ * Any thread may call this
+ *
+ * @return job, NULL if empty or another thread won the race
+ */
+static struct job* wsdeque_steal(wsdeque* wsdeque_p){
+	long t = atomic_load_explicit(&wsdeque_p->top, memory_order_acquire);
+	atomic_thread_fence(memory_order_seq_cst);
+	long b = atomic_load_explicit(&wsdeque_p->bottom, memory_order_acquire);
+	job* job_p = NULL;
+
+	if (t < b){
+		wsarray* array_p = atomic_load_explicit(&wsdeque_p->array, memory_order_acquire);
+		job_p = atomic_load_explicit(&array_p->slots[t & (array_p->size - 1)], memory_order_relaxed);
+		if (!atomic_compare_exchange_strong_explicit(&wsdeque_p->top, &t, t + 1,
+		                                             memory_order_seq_cst, memory_order_relaxed)){
+			job_p = NULL;
+		}
+	}
+	return job_p;
+}
+
+
+/* Cheap unfenced emptiness check
+ * Thieves use it to skip idle victims before paying for a real steal.
+ */
+static int wsdeque_empty(wsdeque* wsdeque_p){
+	return atomic_load_explicit(&wsdeque_p->bottom, memory_order_relaxed) <=
+	       atomic_load_explicit(&wsdeque_p->top, memory_order_relaxed);
+}
+
+
+/* Cancel a job queued with job_uuid, see job_cancel()
+ *
+ * Any thread may call this: the slots are only read, and arrays are
+ * never freed before the deque.
+ *
+ * @return 1 if one was cancelled, 0 otherwise
+ */
+static int wsdeque_cancel(wsdeque* wsdeque_p, int job_uuid){
+	long t = atomic_load_explicit(&wsdeque_p->top, memory_order_acquire);
+	long b = atomic_load_explicit(&wsdeque_p->bottom, memory_order_acquire);
+	wsarray* array_p = atomic_load_explicit(&wsdeque_p->array, memory_order_acquire);
+
+	if (b - t > array_p->size){
+		t = b - array_p->size;
+	}
+	for (; t < b; t++){
+		job* job_p = atomic_load_explicit(&array_p->slots[t & (array_p->size - 1)], memory_order_relaxed);
+		if (job_p && job_cancel(job_p, job_uuid)){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+/* Replace a full array with one twice its size
+ *
+ * Thieves may still be reading the old array, so it is not freed here
+ * but chained to the new one and released by wsdeque_destroy().  The
+ * arrays only ever double, so the chain costs at most as much memory
+ * again as the live array.
+ *
+ * Notice: Only the owning thread may call this
+ *
+ * @return the new array, NULL on allocation failure
+ */
+static wsarray* wsdeque_grow(wsdeque* wsdeque_p, wsarray* array_p, long bottom, long top){
+	long size = array_p->size * 2;
+	wsarray* new_array_p = (struct wsarray*)malloc(sizeof(struct wsarray) + size * sizeof(job*));
+	if (new_array_p == NULL){
+		err("wsdeque_grow(): Could not allocate memory for deque\n");
+		return NULL;
+	}
+	new_array_p->size    = size;
+	new_array_p->retired = array_p;
+
+	long i;
+	for (i = top; i < bottom; i++){
+		job* job_p = atomic_load_explicit(&array_p->slots[i & (array_p->size - 1)], memory_order_relaxed);
+		atomic_store_explicit(&new_array_p->slots[i & (size - 1)], job_p, memory_order_relaxed);
+	}
+	atomic_store_explicit(&wsdeque_p->array, new_array_p, memory_order_release);
+	return new_array_p;
+}
+
+
+/* Free all deque resources back to the system
+ * Notice: Jobs still in the deque belong to the pool's job slab
+ */
+static void wsdeque_destroy(wsdeque* wsdeque_p){
+	wsarray* array_p = atomic_load(&wsdeque_p->array);
+	while (array_p){
+		wsarray* retired_p = array_p->retired;
+		free(array_p);
+		array_p = retired_p;
+	}
+}
+
+
+
+
+
+/* ========================== BOUNDED JOB RING ====================== */
+
+
+/* Init ring with room for at least capacity jobs
+ * @return 0 on success, -1 otherwise
+ */
+static int jobring_init(jobring* jobring_p, int capacity){
+	unsigned long size = 1;
+	unsigned long n;
+
+	if (capacity <= 0 || capacity > JOBRING_MAX_CAPACITY){
+		err("jobring_init(): Queue capacity out of range\n");
+		return -1;
+	}
+	while (size < (unsigned long)capacity){
+		size <<= 1;
+	}
+
+	jobring_p->cells = (ringcell*)malloc(size * sizeof(ringcell));
+	if (jobring_p->cells == NULL){
+		return -1;
+	}
+	for (n = 0; n < size; n++){
+		atomic_init(&jobring_p->cells[n].seq, n);
+		jobring_p->cells[n].job_p = NULL;
+	}
+	jobring_p->mask = size - 1;
+	atomic_init(&jobring_p->head, 0);
+	atomic_init(&jobring_p->tail, 0);
+	csem_init(&jobring_p->free_slots, (int)size);
+	return 0;
+}
+
+
+/* Add job to the ring
+ *
+ * A cell is free for the push at position pos once its seq reads pos.
+ * The producer claims pos by moving tail past it, writes the job and
+ * then publishes it by setting seq to pos + 1.
+ *
+ * @return 0 on success, -1 if the ring is full
+ */
+static int jobring_push(jobring* jobring_p, struct job* job_p){
+	ringcell* cell_p;
+	unsigned long pos = atomic_load_explicit(&jobring_p->tail, memory_order_relaxed);
+
+	for (;;){
+		cell_p = &jobring_p->cells[pos & jobring_p->mask];
+		unsigned long seq = atomic_load_explicit(&cell_p->seq, memory_order_acquire);
+		long diff = (long)(seq - pos);
+		if (diff == 0){
+			if (atomic_compare_exchange_weak_explicit(&jobring_p->tail, &pos, pos + 1,
+			                                          memory_order_relaxed, memory_order_relaxed)){
+				break;
+			}
+		}
+		else if (diff < 0){
+			return -1;
+		}
+		else{
+			pos = atomic_load_explicit(&jobring_p->tail, memory_order_relaxed);
+		}
+	}
+
+	cell_p->job_p = job_p;
+	atomic_store_explicit(&cell_p->seq, pos + 1, memory_order_release);
+	return 0;
+}
+
+
+/* Take the oldest job from the ring
+ *
+ * Mirror of jobring_push(): the cell at pos holds a job once its seq
+ * reads pos + 1, and is handed back to producers for the next lap by
+ * setting seq to pos + size.
+ *
+ * @return job, NULL if the ring is empty
+ */
+static struct job* jobring_pop(jobring* jobring_p){
+	ringcell* cell_p;
+	unsigned long pos = atomic_load_explicit(&jobring_p->head, memory_order_relaxed);
+
+	for (;;){
+		cell_p = &jobring_p->cells[pos & jobring_p->mask];
+		unsigned long seq = atomic_load_explicit(&cell_p->seq, memory_order_acquire);
+		long diff = (long)(seq - (pos + 1));
+		if (diff == 0){
+			if (atomic_compare_exchange_weak_explicit(&jobring_p->head, &pos, pos + 1,
+			                                          memory_order_relaxed, memory_order_relaxed)){
+				break;
+			}
+		}
+		else if (diff < 0){
+			return NULL;
+		}
+		else{
+			pos = atomic_load_explicit(&jobring_p->head, memory_order_relaxed);
+		}
+	}
+
+	job* job_p = cell_p->job_p;
+	atomic_store_explicit(&cell_p->seq, pos + jobring_p->mask + 1, memory_order_release);
+	return job_p;
+}
+
+
+/* Cancel a job queued with job_uuid, see job_cancel()
+ * @return 1 if one was cancelled, 0 otherwise
+ */
+static int jobring_cancel(jobring* jobring_p, int job_uuid){
+	unsigned long pos  = atomic_load_explicit(&jobring_p->head, memory_order_acquire);
+	unsigned long tail = atomic_load_explicit(&jobring_p->tail, memory_order_acquire);
+
+	for (; (long)(tail - pos) > 0; pos++){
+		ringcell* cell_p = &jobring_p->cells[pos & jobring_p->mask];
+		if (atomic_load_explicit(&cell_p->seq, memory_order_acquire) == pos + 1 &&
+		    job_cancel(cell_p->job_p, job_uuid)){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+/* Free ring resources, jobs still in it belong to the job slab */
+static void jobring_destroy(jobring* jobring_p){
+	free(jobring_p->cells);
+	jobring_p->cells = NULL;
+	csem_destroy(&jobring_p->free_slots);
 }
 
 
 
-/* ============================ THREAD ============================== */
 
 
-/* Initialize a thread in the thread pool
+/* =========================== RESULT RING ========================== */
+
+
+/* Initialize an empty ring */
+static void resultring_init(resultring* resultring_p){
+	atomic_init(&resultring_p->head, 0);
+	atomic_init(&resultring_p->tail, 0);
+	resultring_p->head_seen = 0;
+}
+
+
+/* Add a finished job, only ever called by the owning worker
  *
- * @param thread        address to the pointer of the thread to be created
- * @param id            id to be given to the thread
+ * The worker reads head only once its own copy says the ring is full,
+ * so it stays off the collectors' cache line while there is room.
+ *
+ * @return 0 on success, -1 if the ring is full
+ */
+static int resultring_push(resultring* resultring_p, struct job* job_p){
+	unsigned int tail = atomic_load_explicit(&resultring_p->tail, memory_order_relaxed);
+	if (tail - resultring_p->head_seen == RESULT_RING_SIZE){
+		resultring_p->head_seen = atomic_load_explicit(&resultring_p->head, memory_order_acquire);
+		if (tail - resultring_p->head_seen == RESULT_RING_SIZE){
+			return -1;
+		}
+	}
+	resultring_p->slots[tail & (RESULT_RING_SIZE - 1)] = job_p;
+	atomic_store_explicit(&resultring_p->tail, tail + 1, memory_order_release);
+	return 0;
+}
+
+
+/* Check whether the ring holds any jobs, from any thread */
+static int resultring_empty(resultring* resultring_p){
+	return resultring_size(resultring_p) == 0;
+}
+
+
+/* Jobs in the ring, from any thread */
+static int resultring_size(resultring* resultring_p){
+	unsigned int head = atomic_load_explicit(&resultring_p->head, memory_order_acquire);
+	return (int)(atomic_load_explicit(&resultring_p->tail, memory_order_acquire) - head);
+}
+
+
+/* Take every job out of the ring
+ *
+ * @param last_p        rear of the chain
+ * @param num_jobs_p    jobs taken
+ * @return front of the chain, oldest first and linked both ways, or
+ *         NULL if the ring was empty
+ *
+ * Notice: Caller MUST hold the queue_out mutex, the rings' consumer lock
+ */
+static struct job* resultring_drain(resultring* resultring_p, struct job** last_p, int* num_jobs_p){
+	unsigned int head = atomic_load_explicit(&resultring_p->head, memory_order_relaxed);
+	unsigned int tail = atomic_load_explicit(&resultring_p->tail, memory_order_acquire);
+	job* first_p = NULL;
+	job* rear_p  = NULL;
+
+	*num_jobs_p = (int)(tail - head);
+	for (; head != tail; head++){
+		job* job_p = resultring_p->slots[head & (RESULT_RING_SIZE - 1)];
+		job_p->next = rear_p;
+		job_p->prev = NULL;
+		if (rear_p){
+			rear_p->prev = job_p;
+		}
+		else{
+			first_p = job_p;
+		}
+		rear_p = job_p;
+	}
+	atomic_store_explicit(&resultring_p->head, tail, memory_order_release);
+
+	*last_p = rear_p;
+	return first_p;
+}
+
+
+
+
+
+/* ============================ JOB SLAB ============================ */
+
+
+/* Registry of live slabs, so a thread cache can hand jobs back to the
+ * slab they came from without ever touching a destroyed pool */
+static pthread_mutex_t jobslab_registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static jobslab*        jobslab_registry      = NULL;
+static unsigned long   jobslab_next_id       = 1;
+
+/* Calling thread's cache of free jobs, flushed when the thread exits */
+static _Thread_local jobcache jobcache_tls;
+static pthread_key_t   jobcache_key;
+static pthread_once_t  jobcache_key_once = PTHREAD_ONCE_INIT;
+
+
+/* Initialize slab and carve its first chunk
+ *
+ * @param num_jobs      number of jobs to preallocate
  * @return 0 on success, -1 otherwise.
  */
-//TODO: Change thread id to set internally???
-static int thread_init (thpool_* thpool_p, struct thread** thread_p, int id){
+static int jobslab_init(jobslab* jobslab_p, int num_jobs){
 
-	*thread_p = (struct thread*)malloc(sizeof(struct thread));
-	if (*thread_p == NULL){
-		err("thread_init(): Could not allocate memory for thread\n");
+	if (num_jobs < 2 * JOBCACHE_BATCH)  num_jobs = 2 * JOBCACHE_BATCH;
+	if (num_jobs > JOBSLAB_MAX_CHUNK_JOBS) num_jobs = JOBSLAB_MAX_CHUNK_JOBS;
+
+	jobslab_p->free       = NULL;
+	jobslab_p->num_free   = 0;
+	jobslab_p->chunks     = NULL;
+	jobslab_p->chunk_jobs = num_jobs;
+	pthread_mutex_init(&jobslab_p->lock, NULL);
+
+	if (jobslab_grow(jobslab_p) == -1){
+		pthread_mutex_destroy(&jobslab_p->lock);
 		return -1;
 	}
 
-	(*thread_p)->thpool_p = thpool_p;
-	(*thread_p)->id       = id;
+	pthread_once(&jobcache_key_once, jobcache_key_init);
+
+	pthread_mutex_lock(&jobslab_registry_lock);
+	jobslab_p->id   = jobslab_next_id++;
+	jobslab_p->next = jobslab_registry;
+	jobslab_registry = jobslab_p;
+	pthread_mutex_unlock(&jobslab_registry_lock);
 
-	pthread_create(&(*thread_p)->pthread, NULL, (void * (*)(void *)) thread_do, (*thread_p));
-	pthread_detach((*thread_p)->pthread);
-#if THPOOL_DEBUG
-	printf("THPOOL_DEBUG: %s: Thread created (id:%d)\n", __func__, id);
-#endif
 	return 0;
 }
 
 
-/* Sets the calling thread on hold */
-static void thread_hold(int sig_id) {
-	switch(sig_id) {
-		case SIGUSR1:
-			pause();
-			break;
-		case SIGUSR2:
-			break;
-		default:
-			err("thread_hold(): Invalid sig_id");
+/* Add a chunk of jobs to the slab's free list
+ *
+ * Each new chunk is twice the size of the previous one (up to
+ * JOBSLAB_MAX_CHUNK_JOBS), so a pool that keeps growing only calls
+ * malloc a logarithmic number of times.
+ *
+ * Notice: Caller MUST hold the slab lock (or own the slab exclusively)
+ */
+static int jobslab_grow(jobslab* jobslab_p){
+	int n = jobslab_p->chunk_jobs;
+
+	jobchunk* chunk_p = (struct jobchunk*)malloc(sizeof(struct jobchunk) + n * sizeof(struct job));
+	if (chunk_p == NULL){
+		err("jobslab_grow(): Could not allocate memory for jobs\n");
+		return -1;
+	}
+	chunk_p->next = jobslab_p->chunks;
+	jobslab_p->chunks = chunk_p;
+
+	int i;
+	for (i = 0; i < n; i++){
+		chunk_p->jobs[i].prev = jobslab_p->free;
+		jobslab_p->free = &chunk_p->jobs[i];
+	}
+	jobslab_p->num_free += n;
+
+	if (jobslab_p->chunk_jobs < JOBSLAB_MAX_CHUNK_JOBS){
+		jobslab_p->chunk_jobs *= 2;
+	}
+	return 0;
+}
+
+
+/* Get a job from the slab
+ *
+ * The fast path pops the calling thread's cache and takes no lock.  An
+ * empty cache is refilled with JOBCACHE_BATCH jobs in one lock round trip.
+ *
+ * @return job on success, NULL if out of memory
+ */
+static struct job* jobslab_alloc(jobslab* jobslab_p){
+	jobcache* cache_p = jobcache_get(jobslab_p);
+
+	if (cache_p->free == NULL){
+		pthread_mutex_lock(&jobslab_p->lock);
+		if (jobslab_p->free == NULL){
+			jobslab_grow(jobslab_p);
+		}
+		while (jobslab_p->free && cache_p->num_free < JOBCACHE_BATCH){
+			job* job_p = jobslab_p->free;
+			jobslab_p->free = job_p->prev;
+			jobslab_p->num_free--;
+			job_p->prev = cache_p->free;
+			cache_p->free = job_p;
+			cache_p->num_free++;
+		}
+		pthread_mutex_unlock(&jobslab_p->lock);
+
+		if (cache_p->free == NULL){
+			return NULL;
+		}
+	}
+
+	job* job_p = cache_p->free;
+	cache_p->free = job_p->prev;
+	cache_p->num_free--;
+	return job_p;
+}
+
+
+/* Get num_jobs jobs from the slab, chained front to rear through ->prev
+ *
+ * Whatever the calling thread's cache holds is used first; the rest comes
+ * from the shared list in a single lock round trip.
+ *
+ * @return first job of the chain, NULL if out of memory
+ */
+static struct job* jobslab_alloc_batch(jobslab* jobslab_p, int num_jobs){
+	jobcache* cache_p = jobcache_get(jobslab_p);
+	job* chain_p = NULL;
+	int n = 0;
+
+	while (cache_p->free && n < num_jobs){
+		job* job_p = cache_p->free;
+		cache_p->free = job_p->prev;
+		cache_p->num_free--;
+		job_p->prev = chain_p;
+		chain_p = job_p;
+		n++;
+	}
+
+	if (n < num_jobs){
+		pthread_mutex_lock(&jobslab_p->lock);
+		while (n < num_jobs){
+			if (jobslab_p->free == NULL && jobslab_grow(jobslab_p) == -1){
+				break;
+			}
+			job* job_p = jobslab_p->free;
+			jobslab_p->free = job_p->prev;
+			jobslab_p->num_free--;
+			job_p->prev = chain_p;
+			chain_p = job_p;
+			n++;
+		}
+		pthread_mutex_unlock(&jobslab_p->lock);
+	}
+
+	if (n < num_jobs){
+		/* Out of memory: hand back the partial chain */
+		while (chain_p){
+			job* job_p = chain_p;
+			chain_p = job_p->prev;
+			jobslab_free(jobslab_p, job_p);
+		}
+	}
+	return chain_p;
+}
+
+
+/* Return a job to the slab
+ *
+ * Jobs go to the calling thread's cache.  Once the cache holds
+ * 2 * JOBCACHE_BATCH jobs, one batch is handed back to the shared list.
+ */
+static void jobslab_free(jobslab* jobslab_p, struct job* job_p){
+	jobcache* cache_p = jobcache_get(jobslab_p);
+
+	job_p->prev = cache_p->free;
+	cache_p->free = job_p;
+	cache_p->num_free++;
+
+	if (cache_p->num_free >= 2 * JOBCACHE_BATCH){
+		pthread_mutex_lock(&jobslab_p->lock);
+		while (cache_p->num_free > JOBCACHE_BATCH){
+			job_p = cache_p->free;
+			cache_p->free = job_p->prev;
+			cache_p->num_free--;
+			job_p->prev = jobslab_p->free;
+			jobslab_p->free = job_p;
+			jobslab_p->num_free++;
+		}
+		pthread_mutex_unlock(&jobslab_p->lock);
+	}
+}
+
+
+/* Free all slab memory back to the system
+ *
+ * Jobs still sitting in other threads' caches are released with their
+ * chunk; those caches are recognised as stale by their slab id.
+ */
+static void jobslab_destroy(jobslab* jobslab_p){
+
+	pthread_mutex_lock(&jobslab_registry_lock);
+	jobslab** link_p = &jobslab_registry;
+	while (*link_p){
+		if (*link_p == jobslab_p){
+			*link_p = jobslab_p->next;
 			break;
+		}
+		link_p = &(*link_p)->next;
+	}
+	pthread_mutex_unlock(&jobslab_registry_lock);
+
+	if (jobcache_tls.slab_id == jobslab_p->id){
+		jobcache_tls.slab_id  = 0;
+		jobcache_tls.free     = NULL;
+		jobcache_tls.num_free = 0;
+	}
+
+	while (jobslab_p->chunks){
+		jobchunk* chunk_p = jobslab_p->chunks;
+		jobslab_p->chunks = chunk_p->next;
+		free(chunk_p);
 	}
+	pthread_mutex_destroy(&jobslab_p->lock);
 }
 
 
-/* What each thread is doing
-*
-* In principle this is an endless loop. The only time this loop gets interuppted is once
-* thpool_destroy() is invoked or the program exits.
-*
-* @param  thread        thread that will run this function
-* @return nothing
-*/
-static void* thread_do(struct thread* thread_p){
+/* Get the calling thread's cache, bound to jobslab_p
+ *
+ * A thread caches jobs for one slab at a time.  Switching to another
+ * slab first hands the cached jobs back to their owner.
+ */
+static jobcache* jobcache_get(jobslab* jobslab_p){
+	jobcache* cache_p = &jobcache_tls;
+
+	if (cache_p->slab_id != jobslab_p->id){
+		if (cache_p->slab_id == 0){
+			/* First use on this thread: arm the exit flush */
+			pthread_setspecific(jobcache_key, cache_p);
+		}
+		jobcache_flush(cache_p);
+		cache_p->slab_id = jobslab_p->id;
+	}
+	return cache_p;
+}
+
+
+/* Hand every cached job back to the slab it came from (if still alive) */
+static void jobcache_flush(jobcache* cache_p){
+
+	if (cache_p->free){
+		pthread_mutex_lock(&jobslab_registry_lock);
+		jobslab* jobslab_p = jobslab_registry;
+		while (jobslab_p && jobslab_p->id != cache_p->slab_id){
+			jobslab_p = jobslab_p->next;
+		}
+		if (jobslab_p){
+			pthread_mutex_lock(&jobslab_p->lock);
+			while (cache_p->free){
+				job* job_p = cache_p->free;
+				cache_p->free = job_p->prev;
+				job_p->prev = jobslab_p->free;
+				jobslab_p->free = job_p;
+				jobslab_p->num_free++;
+			}
+			pthread_mutex_unlock(&jobslab_p->lock);
+		}
+		pthread_mutex_unlock(&jobslab_registry_lock);
+	}
+
+	cache_p->free     = NULL;
+	cache_p->num_free = 0;
+}
+
+
+/* Thread exit destructor for the job cache */
+static void jobcache_thread_exit(void* cache_p){
+	jobcache_flush((jobcache*)cache_p);
+}
+
+
+static void jobcache_key_init(void){
+	pthread_key_create(&jobcache_key, jobcache_thread_exit);
+}
+
+
+
+
+
+/* ============================ IO URING ============================ */
+#if THPOOL_IO_URING
+
+/* Set up a ring of entries (a power of two) that signals event_fd
+ *
+ * Without io_uring (old kernels, seccomp) this fails and the pool runs
+ * I/O jobs on its workers instead.  So does a kernel whose ring lacks an
+ * op we submit: read and write came in 5.6, after io_uring itself.
+ *
+ * @return 0 on success, -1 otherwise
+ */
+static int iouring_init(iouring* ring_p, unsigned int entries, int event_fd){
+	struct io_uring_params params;
+	void* map_p;
+
+	memset(ring_p, 0, sizeof(*ring_p));
+	memset(&params, 0, sizeof(params));
+	atomic_init(&ring_p->in_flight, 0);
+	ring_p->fd = (int)syscall(SYS_io_uring_setup, entries, &params);
+	if (ring_p->fd == -1){
+		return -1;
+	}
+	if (iouring_probe(ring_p->fd) == -1){
+		iouring_destroy(ring_p);
+		return -1;
+	}
+
+	/* Newer kernels map both rings at once */
+	ring_p->sq_map_len = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	ring_p->cq_map_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP){
+		if (ring_p->cq_map_len > ring_p->sq_map_len){
+			ring_p->sq_map_len = ring_p->cq_map_len;
+		}
+		ring_p->cq_map_len = ring_p->sq_map_len;
+	}
+	map_p = mmap(NULL, ring_p->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED, ring_p->fd, IORING_OFF_SQ_RING);
+	if (map_p == MAP_FAILED){
+		iouring_destroy(ring_p);
+		return -1;
+	}
+	ring_p->sq_map = map_p;
+	if (params.features & IORING_FEAT_SINGLE_MMAP){
+		ring_p->cq_map = ring_p->sq_map;
+	}
+	else{
+		map_p = mmap(NULL, ring_p->cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED, ring_p->fd, IORING_OFF_CQ_RING);
+		if (map_p == MAP_FAILED){
+			iouring_destroy(ring_p);
+			return -1;
+		}
+		ring_p->cq_map = map_p;
+	}
+	ring_p->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+	map_p = mmap(NULL, ring_p->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED, ring_p->fd, IORING_OFF_SQES);
+	if (map_p == MAP_FAILED){
+		iouring_destroy(ring_p);
+		return -1;
+	}
+	ring_p->sqes = (struct io_uring_sqe*)map_p;
+
+	char* sq_p = (char*)ring_p->sq_map;
+	char* cq_p = (char*)ring_p->cq_map;
+	ring_p->sq_head  = (atomic_uint*)(sq_p + params.sq_off.head);
+	ring_p->sq_tail  = (atomic_uint*)(sq_p + params.sq_off.tail);
+	ring_p->sq_mask  = *(unsigned int*)(sq_p + params.sq_off.ring_mask);
+	ring_p->sq_array = (unsigned int*)(sq_p + params.sq_off.array);
+	ring_p->cq_head  = (atomic_uint*)(cq_p + params.cq_off.head);
+	ring_p->cq_tail  = (atomic_uint*)(cq_p + params.cq_off.tail);
+	ring_p->cq_mask  = *(unsigned int*)(cq_p + params.cq_off.ring_mask);
+	ring_p->cqes     = (struct io_uring_cqe*)(cq_p + params.cq_off.cqes);
+	ring_p->entries  = params.sq_entries;
+
+	if (syscall(SYS_io_uring_register, ring_p->fd, IORING_REGISTER_EVENTFD, &event_fd, 1) == -1){
+		iouring_destroy(ring_p);
+		return -1;
+	}
+	return 0;
+}
+
+
+/* Whether the ring supports every op iouring_submit() uses
+ *
+ * Kernels before 5.6 have no IORING_REGISTER_PROBE either, so there the
+ * probe itself fails.
+ *
+ * @return 0 if supported, -1 otherwise
+ */
+static int iouring_probe(int ring_fd){
+	static const int ops[] = { IORING_OP_READ, IORING_OP_WRITE, IORING_OP_FSYNC };
+	struct io_uring_probe* probe_p = (struct io_uring_probe*)calloc(1,
+	    sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op));
+	if (probe_p == NULL){
+		return -1;
+	}
+	int ret = (int)syscall(SYS_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe_p, 256) == 0 ? 0 : -1;
+	unsigned int n;
+	for (n = 0; ret == 0 && n < sizeof(ops) / sizeof(ops[0]); n++){
+		if (ops[n] > probe_p->last_op || !(probe_p->ops[ops[n]].flags & IO_URING_OP_SUPPORTED)){
+			ret = -1;
+		}
+	}
+	free(probe_p);
+	return ret;
+}
+
+
+/* Submit an I/O job, on the ring's owning worker only
+ *
+ * No more than entries jobs are ever in flight, which keeps both the
+ * submission queue (emptied by io_uring_enter) and the completion queue
+ * (twice as big) from filling up.
+ *
+ * @return 0 on success, -1 if the ring is full or the kernel refused
+ */
+static int iouring_submit(iouring* ring_p, struct job* job_p){
+	if (atomic_load_explicit(&ring_p->in_flight, memory_order_relaxed) >= (int)ring_p->entries){
+		return -1;
+	}
+
+	unsigned int tail  = atomic_load_explicit(ring_p->sq_tail, memory_order_relaxed);
+	unsigned int index = tail & ring_p->sq_mask;
+	struct io_uring_sqe* sqe_p = &ring_p->sqes[index];
+
+	memset(sqe_p, 0, sizeof(*sqe_p));
+	sqe_p->fd        = job_p->io.fd;
+	sqe_p->user_data = (unsigned long long)(uintptr_t)job_p;
+	if (job_p->io.op == THPOOL_IO_FSYNC){
+		sqe_p->opcode = IORING_OP_FSYNC;
+	}
+	else{
+		sqe_p->opcode = job_p->io.op == THPOOL_IO_READ ? IORING_OP_READ : IORING_OP_WRITE;
+		sqe_p->addr   = (unsigned long long)(uintptr_t)job_p->io.buf;
+		sqe_p->len    = job_p->io.len;
+		sqe_p->off    = job_p->io.offset < 0 ? (unsigned long long)-1 : (unsigned long long)job_p->io.offset;
+	}
+	ring_p->sq_array[index] = index;
+
+	atomic_fetch_add_explicit(&ring_p->in_flight, 1, memory_order_release);
+	atomic_store_explicit(ring_p->sq_tail, tail + 1, memory_order_release);
+	if (syscall(SYS_io_uring_enter, ring_p->fd, 1, 0, 0, NULL, 0) != 1){
+		/* The kernel only takes entries in io_uring_enter, so it is
+		 * still ours to take back */
+		atomic_store_explicit(ring_p->sq_tail, tail, memory_order_relaxed);
+		atomic_fetch_sub_explicit(&ring_p->in_flight, 1, memory_order_relaxed);
+		return -1;
+	}
+	return 0;
+}
+
+
+/* Take the next completed job off the ring, on the io thread only
+ * @return the job, with its result set, or NULL if none completed
+ */
+static struct job* iouring_pop(iouring* ring_p){
+	if (ring_p->fd == -1){
+		return NULL;
+	}
+
+	unsigned int head = atomic_load_explicit(ring_p->cq_head, memory_order_relaxed);
+	if (head == atomic_load_explicit(ring_p->cq_tail, memory_order_acquire)){
+		return NULL;
+	}
+	struct io_uring_cqe* cqe_p = &ring_p->cqes[head & ring_p->cq_mask];
+	job* job_p = (job*)(uintptr_t)cqe_p->user_data;
+	int result = cqe_p->res;
+	atomic_store_explicit(ring_p->cq_head, head + 1, memory_order_release);
+
+	/* Pairs with the increment in iouring_submit(): the job went through
+	 * the kernel, which orders it but not in the memory model's eyes */
+	atomic_fetch_sub_explicit(&ring_p->in_flight, 1, memory_order_acq_rel);
+	job_p->result = result;
+	return job_p;
+}
+
+
+/* Tear down a ring, also one iouring_init() left half set up */
+static void iouring_destroy(iouring* ring_p){
+	if (ring_p->fd == -1){
+		return;
+	}
+	if (ring_p->sqes){
+		munmap(ring_p->sqes, ring_p->sqes_len);
+	}
+	if (ring_p->cq_map && ring_p->cq_map != ring_p->sq_map){
+		munmap(ring_p->cq_map, ring_p->cq_map_len);
+	}
+	if (ring_p->sq_map){
+		munmap(ring_p->sq_map, ring_p->sq_map_len);
+	}
+	close(ring_p->fd);
+	ring_p->fd = -1;
+}
+
+#endif
+
+
+
+/* ============================ TOPOLOGY ============================ */
+
+
+/* Read a single integer from a sysfs file
+ * @return the value, -1 if the file is missing or unreadable
+ */
+static int topo_read_int(const char* path){
+	int value = -1;
+	FILE* file_p = fopen(path, "r");
+	if (file_p){
+		if (fscanf(file_p, "%d", &value) != 1){
+			value = -1;
+		}
+		fclose(file_p);
+	}
+	return value;
+}
+
+
+/* NUMA node a CPU belongs to, 0 if the system has no NUMA information */
+static int topo_cpu_node(int cpu){
+	int node = 0;
+#if defined(__linux__)
+	char path[64];
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+	DIR* dir_p = opendir(path);
+	if (dir_p){
+		struct dirent* entry_p;
+		while ((entry_p = readdir(dir_p))){
+			if (strncmp(entry_p->d_name, "node", 4) == 0 &&
+			    entry_p->d_name[4] >= '0' && entry_p->d_name[4] <= '9'){
+				node = atoi(entry_p->d_name + 4);
+				break;
+			}
+		}
+		closedir(dir_p);
+	}
+#else
+	(void)cpu;
+#endif
+	return node;
+}
+
+
+/* List one online CPU per physical core (the first of its hyperthreads)
+ *
+ * @param cpus_p        set to a malloc'd list, caller frees
+ * @return number of CPUs in the list, -1 on error
+ */
+static int topo_physical_cores(int** cpus_p){
+	int num_conf = (int)sysconf(_SC_NPROCESSORS_CONF);
+	if (num_conf < 1){
+		num_conf = 1;
+	}
+
+	int* cpus  = (int*)malloc(num_conf * sizeof(int));
+	int* cores = (int*)malloc(num_conf * 2 * sizeof(int));
+	if (cpus == NULL || cores == NULL){
+		free(cpus);
+		free(cores);
+		return -1;
+	}
+
+	int num_cpus = 0;
+	int cpu;
+	for (cpu = 0; cpu < num_conf; cpu++){
+		char path[96];
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/online", cpu);
+		if (topo_read_int(path) == 0){
+			continue;            /* offline (cpu0 has no such file) */
+		}
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+		int package = topo_read_int(path);
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/core_id", cpu);
+		int core = topo_read_int(path);
+
+		int n;
+		for (n = 0; n < num_cpus && core != -1; n++){
+			if (cores[2*n] == package && cores[2*n + 1] == core){
+				break;
+			}
+		}
+		if (core != -1 && n < num_cpus){
+			continue;            /* hyperthread of a core already listed */
+		}
+		cores[2*num_cpus]     = package;
+		cores[2*num_cpus + 1] = core;
+		cpus[num_cpus++]      = cpu;
+	}
 
-	/* Set thread name for profiling and debugging */
-	char thread_name[16] = {0};
-	snprintf(thread_name, 16, "thpool-%d", thread_p->id);
-//TODO: Set thread "id" here instead (using pthread_self())????  Use both??
-#if THPOOL_DEBUG
-	printf("THPOOL_DEBUG: %s: Thread started (id:%d, pthread:%u)\n",
-	       __func__, thread_p->id, (unsigned int)pthread_self());
-#endif
+	free(cores);
+	*cpus_p = cpus;
+	return num_cpus;
+}
 
+
+/* Pin the calling thread to one CPU
+ * @return 0 on success, -1 otherwise
+ */
+static int topo_pin_self(int cpu){
 #if defined(__linux__)
-	/* Use prctl instead to prevent using _GNU_SOURCE flag and implicit declaration */
-	prctl(PR_SET_NAME, thread_name);
-#elif defined(__APPLE__) && defined(__MACH__)
-	pthread_setname_np(thread_name);
+	/* Raw syscall: cpu_set_t and its macros would need _GNU_SOURCE */
+	unsigned long mask[TOPO_MAX_CPUS / (8 * sizeof(unsigned long))] = {0};
+	mask[cpu / (8 * sizeof(unsigned long))] = 1UL << (cpu % (8 * sizeof(unsigned long)));
+	return syscall(SYS_sched_setaffinity, 0, sizeof(mask), mask) == 0 ? 0 : -1;
 #else
-	err("thread_do(): pthread_setname_np is not supported on this system");
+	(void)cpu;
+	return -1;
 #endif
+}
 
-	/* Assure all threads have been created before starting serving */
-	thpool_* thpool_p = thread_p->thpool_p;
 
-	/* Register signal handler */
-	struct sigaction act;
-	sigemptyset(&act.sa_mask);
-	act.sa_flags = 0;
-	act.sa_handler = thread_hold;
-	if (sigaction(SIGUSR1, &act, NULL) == -1) {
-		err("thread_do(): cannot handle SIGUSR1");
+/* NUMA node the calling thread runs on
+ *
+ * Workers of a NUMA pool are pinned, so theirs never changes.  Other
+ * threads may migrate; they re-read it every TOPO_NODE_REFRESH calls,
+ * which keeps the system call off the add_work fast path.
+ */
+static int topo_current_node(void){
+	static _Thread_local int node_cached = -1;
+	static _Thread_local unsigned int node_age = 0;
+
+	if (thread_self && thread_self->cpu != -1){
+		return thread_self->node;
 	}
-	if (sigaction(SIGUSR2, &act, NULL) == -1) {
-		err("thread_do(): cannot handle SIGUSR2");
+#if defined(__linux__)
+	if (node_cached == -1 || ++node_age % TOPO_NODE_REFRESH == 0){
+		unsigned int cpu, node;
+		node_cached = syscall(SYS_getcpu, &cpu, &node, NULL) == 0 ? (int)node : 0;
 	}
+	return node_cached;
+#else
+	(void)node_age;
+	return 0;
+#endif
+}
 
-	/* Mark thread as alive (initialized) */
-	pthread_mutex_lock(&thpool_p->thcount_lock);
-	thpool_p->num_threads_alive++;
-	pthread_mutex_unlock(&thpool_p->thcount_lock);
-
-	struct timespec ts;
-	ts.tv_sec  = 0;
-	ts.tv_nsec = 1;
 
-	while(thpool_alive_state(thpool_p)){
 
-		bsem_wait(thpool_p->queue_in.has_jobs);
 
-		if (thpool_alive_state(thpool_p)){
 
-			pthread_mutex_lock(&thpool_p->thcount_lock);
-			thpool_p->num_threads_working++;
-			pthread_mutex_unlock(&thpool_p->thcount_lock);
+/* Work out which CPUs the workers get pinned to
+ *
+ * Worker n runs on cpus[n % num_cpus]; no list leaves them unpinned.
+ * A NUMA pool needs to know where its workers are, so asking for one
+ * without any affinity pins them one per physical core.
+ *
+ * @return 0 on success, -1 otherwise
+ */
+static int thpool_init_cpus(thpool_* thpool_p, const thpool_config* config_p){
+	int affinity = config_p->affinity;
+	if (affinity == THPOOL_AFFINITY_NONE && config_p->numa_local){
+		affinity = THPOOL_AFFINITY_CORES;
+	}
 
-			/* Read job from queue and execute it */
-			th_func_p func_buff;
-			void*  arg_buff;
-			job* job_p = jobqueue_pull_front(&thpool_p->queue_in);
-			if (job_p) {
-				func_buff     = job_p->function;
-				arg_buff      = job_p->arg;
-				job_p->result = func_buff(arg_buff);
-				jobqueue_push(&thpool_p->queue_out, job_p);
+	if (affinity == THPOOL_AFFINITY_LIST){
+		if (config_p->cpus == NULL || config_p->num_cpus < 1){
+			err("thpool_init(): CPU affinity list is empty\n");
+			return -1;
+		}
+		int n;
+		for (n = 0; n < config_p->num_cpus; n++){
+			if (config_p->cpus[n] < 0 || config_p->cpus[n] >= TOPO_MAX_CPUS){
+				err("thpool_init(): CPU affinity list holds an invalid CPU\n");
+				return -1;
 			}
-
-			pthread_mutex_lock(&thpool_p->thcount_lock);
-			thpool_p->num_threads_working--;
-			if (!thpool_p->num_threads_working) {
-				pthread_cond_signal(&thpool_p->threads_all_idle);
+		}
+		thpool_p->cpus = (int*)malloc(config_p->num_cpus * sizeof(int));
+		if (thpool_p->cpus == NULL){
+			err("thpool_init(): Could not allocate memory for CPU affinity\n");
+			return -1;
+		}
+		memcpy(thpool_p->cpus, config_p->cpus, config_p->num_cpus * sizeof(int));
+		thpool_p->num_cpus = config_p->num_cpus;
+	}
+	else if (affinity == THPOOL_AFFINITY_CORES){
+		int num_cpus = topo_physical_cores(&thpool_p->cpus);
+		if (num_cpus == -1){
+			err("thpool_init(): Could not allocate memory for CPU affinity\n");
+			return -1;
+		}
+		/* Drop CPUs the affinity mask can not express */
+		int kept = 0;
+		int n;
+		for (n = 0; n < num_cpus; n++){
+			if (thpool_p->cpus[n] < TOPO_MAX_CPUS){
+				thpool_p->cpus[kept++] = thpool_p->cpus[n];
 			}
-			pthread_mutex_unlock(&thpool_p->thcount_lock);
+		}
+		thpool_p->num_cpus = kept;
+		if (kept == 0){
+			free(thpool_p->cpus);
+			thpool_p->cpus = NULL;
+		}
+	}
+	else if (affinity != THPOOL_AFFINITY_NONE){
+		err("thpool_init(): Unknown CPU affinity mode\n");
+		return -1;
+	}
+	return 0;
+}
+
+
+/* Group the workers with ids below num_threads by the NUMA node of their
+ * CPU, replacing the table built for fewer of them
+ * @return 0 on success, -1 otherwise
+ */
+static int thpool_init_nodes(thpool_* thpool_p, int num_threads){
+	if (thpool_p->num_cpus == 0){
+		return 0;            /* nowhere to pin, so no idea where workers run */
+	}
 
-			nanosleep(&ts, &ts);     /* Allow other threads CPU time */
+	/* Worker n runs on cpus[n % num_cpus] */
+	int* cpu_nodes = (int*)malloc(thpool_p->num_cpus * sizeof(int));
+	if (cpu_nodes == NULL){
+		return -1;
+	}
+	int num_nodes = 1;
+	int n;
+	for (n = 0; n < thpool_p->num_cpus; n++){
+		cpu_nodes[n] = topo_cpu_node(thpool_p->cpus[n]);
+		if (n < num_threads && cpu_nodes[n] >= num_nodes){
+			num_nodes = cpu_nodes[n] + 1;
 		}
 	}
-	pthread_mutex_lock(&thpool_p->thcount_lock);
-	thpool_p->num_threads_alive--;
-	pthread_mutex_unlock(&thpool_p->thcount_lock);
 
-	return NULL;
+	/* One block: the nodes, then the worker ids of each in turn */
+	nodetable* nodes_p = (nodetable*)calloc(1, sizeof(nodetable) + num_nodes * sizeof(numanode) + num_threads * sizeof(int));
+	if (nodes_p == NULL){
+		free(cpu_nodes);
+		return -1;
+	}
+	nodes_p->size      = num_threads;
+	nodes_p->num_nodes = num_nodes;
+	nodes_p->retired   = atomic_load(&thpool_p->nodes);
+	for (n = 0; n < num_threads; n++){
+		nodes_p->nodes[cpu_nodes[n % thpool_p->num_cpus]].num_workers++;
+	}
+	int* ids_p = (int*)&nodes_p->nodes[num_nodes];
+	int k;
+	for (k = 0; k < num_nodes; k++){
+		numanode* node_p = &nodes_p->nodes[k];
+		atomic_init(&node_p->next_inbox, 0);
+		node_p->workers     = ids_p;
+		ids_p              += node_p->num_workers;
+		node_p->num_workers = 0;
+	}
+	for (n = 0; n < num_threads; n++){
+		numanode* node_p = &nodes_p->nodes[cpu_nodes[n % thpool_p->num_cpus]];
+		node_p->workers[node_p->num_workers++] = n;
+	}
+	free(cpu_nodes);
+
+	atomic_store_explicit(&thpool_p->nodes, nodes_p, memory_order_release);
+	return 0;
 }
 
 
-/* Frees a thread  */
-static void thread_destroy (thread* thread_p){
-	free(thread_p);
+/* Free what thpool_init_cpus() and thpool_init_nodes() set up */
+static void thpool_free_placement(thpool_* thpool_p){
+	nodetable* nodes_p = atomic_load(&thpool_p->nodes);
+	while (nodes_p){
+		nodetable* retired_p = nodes_p->retired;
+		free(nodes_p);
+		nodes_p = retired_p;
+	}
+	free(thpool_p->cpus);
+	atomic_store(&thpool_p->nodes, NULL);
+	thpool_p->cpus      = NULL;
+	thpool_p->num_cpus  = 0;
 }
 
 
 
 
 
-/* ============================ JOB QUEUE =========================== */
+/* ============================ METRICS ============================= */
+#if THPOOL_METRICS
 
 
-/* Initialize queue */
-static int jobqueue_init(jobqueue* jobqueue_p){
-	int ret = -1;
+/* Timestamp for job metrics */
+static long long metrics_now_ns(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
 
-	jobqueue_p->len = 0;
-	jobqueue_p->front = NULL;
-	jobqueue_p->rear  = NULL;
 
-	jobqueue_p->has_jobs = (struct bsem*)malloc(sizeof(struct bsem));
-	if (jobqueue_p->has_jobs == NULL){
-		return ret;
+/* Init histogram to empty */
+static void histogram_init(histogram* histogram_p){
+	int n;
+	atomic_init(&histogram_p->count, 0);
+	atomic_init(&histogram_p->sum_ns, 0);
+	atomic_init(&histogram_p->max_ns, 0);
+	for (n = 0; n < HIST_BUCKETS; n++){
+		atomic_init(&histogram_p->buckets[n], 0);
 	}
+}
 
-	pthread_mutex_init(&(jobqueue_p->rwmutex), NULL);
-	ret = bsem_init(jobqueue_p->has_jobs, 0);
 
-	return ret;
+/* Bucket for a value: exact below HIST_SUB, then HIST_SUB per power of two */
+static int histogram_bucket(unsigned long long value){
+	if (value < HIST_SUB){
+		return (int)value;
+	}
+	int msb = 63 - __builtin_clzll(value);
+	if (msb >= HIST_MAX_BITS){
+		return HIST_BUCKETS - 1;
+	}
+	int shift = msb - HIST_SUB_BITS;
+	return (shift + 1) * HIST_SUB + (int)((value >> shift) - HIST_SUB);
 }
 
 
-/* Clear the queue */
-static void jobqueue_clear(jobqueue* jobqueue_p){
-
-	while(jobqueue_length(jobqueue_p)){
-		free(jobqueue_pull_front(jobqueue_p));
+/* Largest value that lands in a bucket */
+static unsigned long long histogram_bucket_top(int bucket){
+	if (bucket < HIST_SUB){
+		return (unsigned long long)bucket;
 	}
-
-	pthread_mutex_lock(&jobqueue_p->rwmutex);
-	jobqueue_p->front = NULL;
-	jobqueue_p->rear  = NULL;
-	bsem_reset(jobqueue_p->has_jobs);
-	jobqueue_p->len = 0;
-	pthread_mutex_unlock(&jobqueue_p->rwmutex);
+	int shift = bucket / HIST_SUB - 1;
+	unsigned long long low = (unsigned long long)(bucket % HIST_SUB + HIST_SUB) << shift;
+	return low + (1ULL << shift) - 1;
 }
 
 
-/* Add (allocated) job to queue
+/* Record one value
+ *
+ * Only relaxed atomic adds: each worker records into its own
+ * histograms, so these stay in its cache and never contend.
  */
-static void jobqueue_push(jobqueue* jobqueue_p, struct job* newjob){
+static void histogram_record(histogram* histogram_p, long long value_ns){
+	unsigned long long value = value_ns > 0 ? (unsigned long long)value_ns : 0;
 
-	pthread_mutex_lock(&jobqueue_p->rwmutex);
-	newjob->prev = NULL;
+	atomic_fetch_add_explicit(&histogram_p->buckets[histogram_bucket(value)], 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&histogram_p->count, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&histogram_p->sum_ns, value, memory_order_relaxed);
 
-	switch(jobqueue_p->len){
+	unsigned long long max = atomic_load_explicit(&histogram_p->max_ns, memory_order_relaxed);
+	while (value > max &&
+	       !atomic_compare_exchange_weak_explicit(&histogram_p->max_ns, &max, value,
+	                                              memory_order_relaxed, memory_order_relaxed));
+}
 
-		case 0:  /* if no jobs in queue */
-			jobqueue_p->front = newjob;
-			jobqueue_p->rear  = newjob;
-			break;
 
-		default: /* if jobs in queue */
-			jobqueue_p->rear->prev = newjob;
-			jobqueue_p->rear = newjob;
-	}
-	jobqueue_p->len++;
-	if (jobqueue_p->len > MAX_QUEUE_SIZE_WITHOUT_WARNING)
-		printf("%s: WARNING: queue len > %d\n",
-		       __func__, MAX_QUEUE_SIZE_WITHOUT_WARNING);
+/* Add a histogram's current counts to a sum */
+static void histogram_add_to(histogram* histogram_p, histsum* histsum_p){
+	int n;
+	unsigned long long max = atomic_load_explicit(&histogram_p->max_ns, memory_order_relaxed);
 
-	bsem_post(jobqueue_p->has_jobs);
-	pthread_mutex_unlock(&jobqueue_p->rwmutex);
-#if THPOOL_DEBUG
-	printf("THPOOL_DEBUG: %s: job(%p) with uuid %d added to queue(%p) (on pthread:%u)\n",
-	       __func__, newjob, newjob->uuid, jobqueue_p, (unsigned int)pthread_self());
-#endif
+	histsum_p->count  += atomic_load_explicit(&histogram_p->count, memory_order_relaxed);
+	histsum_p->sum_ns += atomic_load_explicit(&histogram_p->sum_ns, memory_order_relaxed);
+	if (max > histsum_p->max_ns){
+		histsum_p->max_ns = max;
+	}
+	for (n = 0; n < HIST_BUCKETS; n++){
+		histsum_p->buckets[n] += atomic_load_explicit(&histogram_p->buckets[n], memory_order_relaxed);
+	}
 }
 
 
-/* Get first job from queue(removes it from queue)
- * Notice: Caller MUST hold a mutex
+/* Turn a sum of histograms into count, mean, percentiles and max
+ *
+ * Counters are read while workers keep recording, so count and the
+ * buckets may be a few values apart; percentiles go by the buckets.
  */
-static struct job* jobqueue_pull_front(jobqueue* jobqueue_p){
-
-	pthread_mutex_lock(&jobqueue_p->rwmutex);
-	job* job_p = jobqueue_p->front;
-
-	switch(jobqueue_p->len){
+static void histsum_latency(histsum* histsum_p, thpool_latency* latency_p){
+	static const double quantiles[] = {0.50, 0.90, 0.99, 0.999};
+	unsigned long long* values[] = {&latency_p->p50_ns, &latency_p->p90_ns,
+	                                &latency_p->p99_ns, &latency_p->p999_ns};
+	unsigned long long total = 0;
+	unsigned long long seen  = 0;
+	int q = 0;
+	int n;
 
-		case 0:  /* if no jobs in queue */
-			break;
+	for (n = 0; n < HIST_BUCKETS; n++){
+		total += histsum_p->buckets[n];
+	}
 
-		case 1:  /* if one job in queue */
-			jobqueue_p->front = NULL;
-			jobqueue_p->rear  = NULL;
-			jobqueue_p->len = 0;
-			break;
+	latency_p->count   = histsum_p->count;
+	latency_p->mean_ns = histsum_p->count ? histsum_p->sum_ns / histsum_p->count : 0;
+	latency_p->max_ns  = histsum_p->max_ns;
+	for (q = 0; q < 4; q++){
+		*values[q] = 0;
+	}
 
-		default: /* if >1 jobs in queue */
-			jobqueue_p->front = job_p->prev;
-			jobqueue_p->len--;
-			if (jobqueue_p->len > MAX_QUEUE_SIZE_WITHOUT_WARNING)
-				printf("%s: WARNING: queue len > %d\n",
-				       __func__, MAX_QUEUE_SIZE_WITHOUT_WARNING);
-			/* more than one job in queue -> post it */
-			bsem_post(jobqueue_p->has_jobs);
+	q = 0;
+	for (n = 0; n < HIST_BUCKETS && q < 4 && total; n++){
+		seen += histsum_p->buckets[n];
+		while (q < 4 && seen >= (unsigned long long)(quantiles[q] * total + 0.5)){
+			*values[q] = histogram_bucket_top(n);
+			if (*values[q] > histsum_p->max_ns){
+				*values[q] = histsum_p->max_ns;
+			}
+			q++;
+		}
 	}
+}
 
-	pthread_mutex_unlock(&jobqueue_p->rwmutex);
-#if THPOOL_DEBUG
-	int uuid = -1;
-	if (job_p) uuid = job_p->uuid;
-	printf("THPOOL_DEBUG: %s: job(%p) with uuid %d pulled from queue(%p) (on pthread:%u)\n",
-	       __func__, job_p, uuid, jobqueue_p, (unsigned int)pthread_self());
-#endif
 
-	return job_p;
+/* Account for a result leaving queue_out */
+static void thpool_record_collected(thpool_* thpool_p, struct job* job_p, long long now_ns){
+	histogram_record(&thpool_p->queue_out_wait, now_ns - job_p->metrics.done_ns);
+	atomic_fetch_add_explicit(&thpool_p->jobs_collected, 1, memory_order_relaxed);
 }
 
 
-/* Search for job uuid
- * Notice: Caller MUST hold a mutex
- */
-// returned NULL indicates NOT FOUND
-static struct job* jobqueue_pull_by_uuid(jobqueue* jobqueue_p, int job_uuid){
-
-/*
-TODO: Do I want to implement "trylock" like I did in POC?  If so, how?
-		Pass in returned job pointer as param instead
-		Use return value for error code from trylock
-	Leave this work for AFTER it's in Propeller?
-	WILL NEED: cuz drives may "vanish" unexpectedly.
-		Don't want to endlessly wait for a drive that's no longer there.
-*/
-	pthread_mutex_lock(&jobqueue_p->rwmutex);
+#endif /* THPOOL_METRICS */
 
-	job* curr_job_p = jobqueue_p->front;  /* scan queue front to back */
-	job* last_job_p = NULL;  //Make queue a double-linked list?
 
-	while (curr_job_p){
-		if (curr_job_p->uuid == job_uuid){
-			break;
-		}
-		last_job_p = curr_job_p;
-		curr_job_p = curr_job_p->prev;
-	}
 
-	if (curr_job_p){
-		switch (jobqueue_p->len){
 
-			case 0:  /* if no jobs in queue */
-				break;
 
-			case 1:  /* if one job in queue */
-				jobqueue_p->front = NULL;
-				jobqueue_p->rear  = NULL;
-				jobqueue_p->len = 0;
-				break;
+/* ======================== SYNCHRONISATION ========================= */
 
-			default: /* if >1 jobs in queue */
-				if (!last_job_p) {
-					/* Current job at queue front */
-					jobqueue_p->front = curr_job_p->prev;
-				}
-				else if (!curr_job_p->prev){
-					/* Current job at queue rear */
-					jobqueue_p->rear = last_job_p;
-					last_job_p->prev = NULL;
-				}
-				else {
-					/* Current job somewhere in the middle */
-					last_job_p->prev = curr_job_p->prev;
-				}
 
-				jobqueue_p->len--;
-				if (jobqueue_p->len > MAX_QUEUE_SIZE_WITHOUT_WARNING)
-					printf("%s: WARNING: queue len > %d\n",
-					       __func__, MAX_QUEUE_SIZE_WITHOUT_WARNING);
-				/* more than one job in queue -> post it */
-				bsem_post(jobqueue_p->has_jobs);
-		}
+/* Init semaphore to value */
+static int csem_init(csem *csem_p, int value) {
+	if (value < 0) {
+		err("csem_init(): Semaphore can not start negative");
+		return -1;
 	}
-
-	pthread_mutex_unlock(&jobqueue_p->rwmutex);
-#if THPOOL_DEBUG
-	int uuid = -1;
-	if (curr_job_p) uuid = curr_job_p->uuid;
-	printf("THPOOL_DEBUG: %s: job(%p) with uuid %d pulled from queue(%p) (on pthread:%u)\n",
-	       __func__, curr_job_p, uuid, jobqueue_p, (unsigned int)pthread_self());
+	atomic_init(&csem_p->v, value);
+	atomic_init(&csem_p->waiters, 0);
+	atomic_init(&csem_p->seq, 0);
+#if !defined(__linux__)
+	pthread_mutex_init(&(csem_p->mutex), NULL);
+	waiter_cond_init(&(csem_p->cond));
 #endif
-	return curr_job_p;
+	return 0;
 }
 
 
-/* Get the queue's current length */
-static int jobqueue_length(jobqueue* jobqueue_p){
-	int len;
-	pthread_mutex_lock(&jobqueue_p->rwmutex);
-	len = jobqueue_p->len;
-	pthread_mutex_unlock(&jobqueue_p->rwmutex);
-
-	return len;
+/* Add n to semaphore, waking up to n sleeping threads
+ *
+ * No system call is made unless a thread is actually asleep.
+ */
+static void csem_post(csem *csem_p, int n) {
+	atomic_fetch_add(&csem_p->v, n);
+	if (atomic_load(&csem_p->waiters) == 0) {
+		return;
+	}
+#if defined(__linux__)
+	atomic_fetch_add(&csem_p->seq, 1);
+	syscall(SYS_futex, &csem_p->seq, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+#else
+	pthread_mutex_lock(&csem_p->mutex);
+	atomic_fetch_add(&csem_p->seq, 1);
+	if (n == 1) {
+		pthread_cond_signal(&csem_p->cond);
+	}
+	else {
+		pthread_cond_broadcast(&csem_p->cond);
+	}
+	pthread_mutex_unlock(&csem_p->mutex);
+#endif
 }
 
 
-/* Free all queue resources back to the system */
-static void jobqueue_destroy(jobqueue* jobqueue_p){
-	jobqueue_clear(jobqueue_p);
-	pthread_mutex_destroy(&jobqueue_p->rwmutex);
-	bsem_destroy(jobqueue_p->has_jobs);
-	free(jobqueue_p->has_jobs);
+/* Take one from semaphore if it is not 0
+ * @return 1 if taken, 0 otherwise
+ */
+static int csem_trywait(csem *csem_p) {
+	int v = atomic_load_explicit(&csem_p->v, memory_order_relaxed);
+	while (v > 0) {
+		if (atomic_compare_exchange_weak(&csem_p->v, &v, v - 1)) {
+			return 1;
+		}
+	}
+	return 0;
 }
 
 
+/* Wait on semaphore until it is not 0 or the deadline passes */
+static int csem_timedwait(csem* csem_p, const struct timespec* abstime) {
+	return csem_timedwait_flag(csem_p, abstime, NULL, NULL, CSEM_ANY);
+}
 
 
-
-/* ======================== SYNCHRONISATION ========================= */
-
-
-/* Init semaphore to 1 or 0 */
-static int bsem_init(bsem *bsem_p, int value) {
-	if (value < 0 || value > 1) {
-		err("bsem_init(): Binary semaphore can take only values 1 or 0");
-		return -1;
+/* Wait on semaphore until it is not 0, the deadline passes or a flag is set
+ *
+ * Sleepers announce themselves in waiters before re-checking v, and
+ * posters bump v before checking waiters, so a post can not slip between
+ * a sleeper's last check and its sleep.  seq changes on every post that
+ * finds sleepers, so the futex (or condvar) wait returns straight away
+ * if one raced in.  The flag works the same way with csem_kick(), which
+ * only wakes the sleepers whose bit it names.
+ *
+ * @param abstime       absolute THPOOL_CLOCK deadline, NULL waits forever
+ * @param flag_p        stop waiting once this is not 0, may be NULL
+ * @param flag2_p       the same, for a second flag
+ * @param bit           the caller's wake bit for csem_kick(), or CSEM_ANY
+ * @return 0 if one was taken, -1 if the deadline passed first, 1 if a
+ *         flag was set
+ */
+static int csem_timedwait_flag(csem* csem_p, const struct timespec* abstime, atomic_int* flag_p,
+                               atomic_int* flag2_p, unsigned int bit) {
+	int timed_out = 0;
+	while (!csem_trywait(csem_p)) {
+		if (timed_out) {
+			return -1;
+		}
+		if ((flag_p && atomic_load(flag_p)) || (flag2_p && atomic_load(flag2_p))) {
+			return 1;
+		}
+		atomic_fetch_add(&csem_p->waiters, 1);
+		unsigned int seq = atomic_load(&csem_p->seq);
+		if (atomic_load(&csem_p->v) == 0 && !(flag_p && atomic_load(flag_p)) && !(flag2_p && atomic_load(flag2_p))) {
+#if defined(__linux__)
+			/* THPOOL_CLOCK is CLOCK_MONOTONIC, what bitset waits time against */
+			if (syscall(SYS_futex, &csem_p->seq, FUTEX_WAIT_BITSET_PRIVATE, seq, abstime, NULL, bit) == -1
+			    && errno == ETIMEDOUT) {
+				timed_out = 1;
+			}
+#else
+			(void)bit;
+			pthread_mutex_lock(&csem_p->mutex);
+			while (atomic_load(&csem_p->seq) == seq && !timed_out) {
+				if (abstime) {
+					timed_out = (pthread_cond_timedwait(&csem_p->cond, &csem_p->mutex, abstime) == ETIMEDOUT);
+				}
+				else {
+					pthread_cond_wait(&csem_p->cond, &csem_p->mutex);
+				}
+			}
+			pthread_mutex_unlock(&csem_p->mutex);
+#endif
+		}
+		atomic_fetch_sub(&csem_p->waiters, 1);
 	}
-	pthread_mutex_init(&(bsem_p->mutex), NULL);
-	pthread_cond_init(&(bsem_p->cond), NULL);
-	bsem_p->v = value;
-
 	return 0;
 }
 
 
-/* Reset semaphore to 0 */
-static void bsem_reset(bsem *bsem_p) {
-	bsem_init(bsem_p, 0);
+/* Wake the sleepers waiting with bit, after setting their flag
+ *
+ * Bits may be shared, so every sleeper with the bit wakes; those whose
+ * flag is still 0 go back to sleep.
+ */
+static void csem_kick(csem* csem_p, unsigned int bit) {
+	if (atomic_load(&csem_p->waiters) == 0) {
+		return;
+	}
+#if defined(__linux__)
+	atomic_fetch_add(&csem_p->seq, 1);
+	syscall(SYS_futex, &csem_p->seq, FUTEX_WAKE_BITSET_PRIVATE, INT_MAX, NULL, NULL, bit);
+#else
+	(void)bit;
+	pthread_mutex_lock(&csem_p->mutex);
+	atomic_fetch_add(&csem_p->seq, 1);
+	pthread_cond_broadcast(&csem_p->cond);
+	pthread_mutex_unlock(&csem_p->mutex);
+#endif
 }
 
 
-/* Post to at least one thread */
-static void bsem_post(bsem *bsem_p) {
-	pthread_mutex_lock(&bsem_p->mutex);
-	bsem_p->v = 1;
-	pthread_cond_signal(&bsem_p->cond);
-	pthread_mutex_unlock(&bsem_p->mutex);
+/* Free semaphore resources */
+static void csem_destroy(csem* csem_p) {
+#if !defined(__linux__)
+	pthread_mutex_destroy(&(csem_p->mutex));
+	pthread_cond_destroy(&(csem_p->cond));
+#else
+	(void)csem_p;
+#endif
 }
 
 
-/* Post to all threads */
-static void bsem_post_all(bsem *bsem_p) {
-	pthread_mutex_lock(&bsem_p->mutex);
-	bsem_p->v = 1;
-	pthread_cond_broadcast(&bsem_p->cond);
-	pthread_mutex_unlock(&bsem_p->mutex);
+
+/* Init a condition variable that times out against THPOOL_CLOCK */
+static void waiter_cond_init(pthread_cond_t* cond_p) {
+#if defined(__APPLE__)
+	pthread_cond_init(cond_p, NULL);
+#else
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, THPOOL_CLOCK);
+	pthread_cond_init(cond_p, &attr);
+	pthread_condattr_destroy(&attr);
+#endif
 }
 
 
-/* Wait on semaphore until semaphore has value 0 */
-static void bsem_wait(bsem* bsem_p) {
-	pthread_mutex_lock(&bsem_p->mutex);
-	while (bsem_p->v != 1) {
-		pthread_cond_wait(&bsem_p->cond, &bsem_p->mutex);
-	}
-	bsem_p->v = 0;
-	pthread_mutex_unlock(&bsem_p->mutex);
+/* THPOOL_CLOCK time, in nanoseconds */
+static long long clock_now_ns(void) {
+	struct timespec ts;
+	clock_gettime(THPOOL_CLOCK, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
 }
 
 
-/* Wait on semaphore until semaphore has value 0 */
-static void bsem_destroy(bsem* bsem_p) {
-	pthread_mutex_destroy(&(bsem_p->mutex));
-	pthread_cond_destroy(&(bsem_p->cond));
+/* Absolute THPOOL_CLOCK time timeout_ns from now */
+static void abstime_from_now(struct timespec* ts_p, long long timeout_ns) {
+	clock_gettime(THPOOL_CLOCK, ts_p);
+	ts_p->tv_sec  += timeout_ns / 1000000000LL;
+	ts_p->tv_nsec += timeout_ns % 1000000000LL;
+	if (ts_p->tv_nsec >= 1000000000L){
+		ts_p->tv_sec++;
+		ts_p->tv_nsec -= 1000000000L;
+	}
 }
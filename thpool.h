@@ -15,8 +15,82 @@ extern "C" {
 
 
 typedef struct thpool_* threadpool;
+typedef struct thpool_future thpool_future;  /* see thpool_submit()  */
 
 typedef	int (*th_func_p)(void* arg);       /* function pointer          */
+typedef	void (*th_done_p)(int job_uuid, int result, void* done_arg); /* completion callback */
+typedef	void (*th_range_p)(long begin, long end, void* ctx); /* parallel_for chunk */
+
+/* Priority levels for thpool_add_work_prio() */
+enum {
+	THPOOL_PRIO_HIGH   = 0,            /* latency critical, e.g. admin */
+	THPOOL_PRIO_NORMAL = 1,            /* thpool_add_work() and friends */
+	THPOOL_PRIO_LOW    = 2,            /* bulk / background         */
+	THPOOL_PRIO_LEVELS = 3
+};
+
+/* Where workers run, for thpool_config.affinity */
+enum {
+	THPOOL_AFFINITY_NONE  = 0,         /* wherever the OS puts them */
+	THPOOL_AFFINITY_LIST  = 1,         /* worker n on cpus[n % num_cpus] */
+	THPOOL_AFFINITY_CORES = 2          /* one per physical core     */
+};
+
+/* What thpool_add_io() does */
+enum {
+	THPOOL_IO_READ  = 0,               /* pread()                   */
+	THPOOL_IO_WRITE = 1,               /* pwrite()                  */
+	THPOOL_IO_FSYNC = 2                /* fsync(), no buf or len    */
+};
+
+/* Threadpool settings, see thpool_config_init() for the defaults */
+typedef struct thpool_config {
+	int num_threads;                   /* threads in the pool       */
+	int idle_spin_ns;                  /* max busy-wait when idle   */
+	int idle_yields;                   /* yields before sleeping    */
+	int queue_capacity;                /* max queued jobs, 0 no max */
+	int completion_fd;                 /* 1 makes an eventfd, Linux */
+	int affinity;                      /* THPOOL_AFFINITY_*, Linux  */
+	const int* cpus;                   /* for THPOOL_AFFINITY_LIST  */
+	int num_cpus;
+	int numa_local;                    /* 1 keeps jobs on their node */
+	int min_threads;                   /* autoscaler floor, 0 num_threads */
+	int max_threads;                   /* autoscaler ceiling, 0 off */
+	int scale_queue_depth;             /* queued jobs per thread to grow */
+	long long scale_wait_ns;           /* queue wait to grow        */
+	long long idle_linger_ns;          /* idle time before retiring */
+	int key_rebalance_depth;           /* keyed backlog to move keys, 0 never */
+	long long result_ttl_ns;           /* free uncollected results, 0 never */
+	int io_depth;                      /* io_uring entries per worker, Linux */
+} thpool_config;
+
+/* Latency summary, in nanoseconds */
+typedef struct thpool_latency {
+	unsigned long long count;          /* jobs measured             */
+	unsigned long long mean_ns;
+	unsigned long long p50_ns;
+	unsigned long long p90_ns;
+	unsigned long long p99_ns;
+	unsigned long long p999_ns;
+	unsigned long long max_ns;
+} thpool_latency;
+
+/* Threadpool counters, see thpool_get_stats() */
+typedef struct thpool_stats {
+	unsigned long long jobs_added;     /* since thpool_init()       */
+	unsigned long long jobs_completed; /* finished running          */
+	unsigned long long jobs_dropped;   /* cancelled or expired      */
+	unsigned long long jobs_collected; /* results taken by callers  */
+	unsigned long long results_reaped; /* freed after result_ttl_ns */
+	unsigned long long io_submitted;   /* I/O jobs run by io_uring  */
+	unsigned long long io_inline;      /* I/O jobs run on a worker  */
+	int io_rings;                      /* workers with an io_uring  */
+	int jobs_queued;                   /* waiting for a worker now  */
+	int results_waiting;               /* in the output queue now   */
+	thpool_latency queue_wait;         /* added until started       */
+	thpool_latency run_time;           /* started until finished    */
+	thpool_latency result_wait;        /* finished until collected  */
+} thpool_stats;
 
 
 /**
@@ -39,6 +113,99 @@ typedef	int (*th_func_p)(void* arg);       /* function pointer          */
 threadpool thpool_init(int num_threads);
 
 
+/**
+ * @brief  Fill a config with the default settings
+ *
+ * Always start from this so fields added in later versions get sane
+ * values, then change what you need and pass it to thpool_init_ex().
+ *
+ * Idle threads busy-wait for up to idle_spin_ns before giving up the CPU
+ * idle_yields times and finally sleeping.  Each thread shortens or
+ * stretches its own busy-wait (up to idle_spin_ns) to match how far apart
+ * jobs have recently arrived.  Set idle_spin_ns to 0 to never busy-wait;
+ * on single CPU systems it is always 0.
+ *
+ * With queue_capacity > 0 (rounded up to a power of two) jobs added from
+ * outside the pool wait in a fixed size lock-free ring instead of
+ * unbounded lists, and adding to a full pool blocks or fails, see
+ * thpool_try_add_work().  Jobs added by a job (from inside the pool) are
+ * never held back.
+ *
+ * With completion_fd set, the pool keeps an fd that event loops can
+ * watch for results, see thpool_completion_fd().
+ *
+ * affinity pins each worker to one CPU, either from the cpus list or one
+ * per physical core (hyperthread siblings are skipped).  With numa_local
+ * set, jobs added from outside the pool go to a worker on the adding
+ * thread's NUMA node, and idle workers steal from their own node before
+ * the others.  numa_local without an affinity pins one worker per core.
+ *
+ * With max_threads > num_threads the pool sizes itself: it starts with
+ * num_threads and adds one thread at a time, up to max_threads, while
+ * more than scale_queue_depth jobs per thread are queued or a job waited
+ * longer than scale_wait_ns to start (the latter needs metrics).  Threads
+ * idle for idle_linger_ns leave again, newest first, down to min_threads.
+ *
+ * Keys of thpool_add_work_keyed() stick to their worker.  With
+ * key_rebalance_depth > 0 a key with nothing queued or running moves off
+ * a worker that has more keyed jobs queued than that, to one with under
+ * half as many, so a few hot keys do not pile up on one worker.
+ *
+ * With result_ttl_ns > 0 a reaper thread frees results that nobody
+ * collected within that time, so a caller that went away does not leave
+ * queue_out growing forever.
+ *
+ * With io_depth > 0 every worker gets an io_uring of that many entries
+ * (up to 4096), and I/O jobs of thpool_add_io() are handed to the
+ * kernel instead of blocking a worker, see there.
+ *
+ * @example
+ *
+ *    thpool_config config;
+ *    thpool_config_init(&config);
+ *    config.num_threads  = 4;
+ *    config.idle_spin_ns = 0;               //save CPU, accept slower wakeups
+ *    threadpool thpool = thpool_init_ex(&config);
+ *
+ * @param  config        config to fill in
+ * @return nothing
+ */
+void thpool_config_init(thpool_config* config);
+
+
+/**
+ * @brief  Initialize threadpool from a config
+ *
+ * Same as thpool_init(), with the settings in config.
+ *
+ * @param  config        settings, filled by thpool_config_init() first
+ * @return threadpool    created threadpool on success,
+ *                       NULL on error
+ */
+threadpool thpool_init_ex(const thpool_config* config);
+
+
+/**
+ * @brief  Change the number of threads in the pool
+ *
+ * New threads start taking jobs straight away.  Threads that leave finish
+ * their current job first, and this waits for that; jobs still queued on
+ * them are taken over by the others.  An autoscaling pool keeps scaling
+ * from the new size.  A job may not resize its own thread away.
+ *
+ * @example
+ *
+ *    thpool_resize(thpool, 16);             //evening rush
+ *    ..
+ *    thpool_resize(thpool, 2);
+ *
+ * @param  threadpool    the threadpool to resize
+ * @param  num_threads   number of threads to have
+ * @return 0 on success, -1 otherwise
+ */
+int thpool_resize(threadpool, int num_threads);
+
+
 /**
  * @brief Add work to the pool's input job queue
  *
@@ -48,6 +215,9 @@ threadpool thpool_init(int num_threads);
  *
  * NOTICE: You have to cast both the function and argument to not get warnings.
  *
+ * If the pool was given a queue_capacity and its queue is full, this waits
+ * until a job is taken off it.
+ *
  * @example
  *
  *    void print_num(int num){
@@ -70,16 +240,393 @@ threadpool thpool_init(int num_threads);
 int thpool_add_work(threadpool, int job_uuid, th_func_p func_p, void* arg_p);
 
 
+/**
+ * @brief Add work to the pool only if its queue has room
+ *
+ * Same as thpool_add_work(), but a pool with a queue_capacity that is
+ * already full is left alone instead of waited on, so producers can back
+ * off (drop, retry later, slow down their own source).  Pools without a
+ * queue_capacity always have room.
+ *
+ * @example
+ *
+ *    if (thpool_try_add_work(thpool, job_uuid, task, arg) == -1 && errno == EAGAIN){
+ *       //pool is saturated, try again later
+ *    }
+ *
+ * @param  threadpool    threadpool to which the work will be added
+ * @param  job_uuid      unique job identifier
+ * @param  func_p        pointer to function to add as work
+ * @param  arg_p         pointer to an argument
+ * @return 0 on success, -1 otherwise (errno EAGAIN if the queue was full).
+ */
+int thpool_try_add_work(threadpool, int job_uuid, th_func_p func_p, void* arg_p);
+
+
+/**
+ * @brief Add work to the pool, waiting a limited time for queue room
+ *
+ * Same as thpool_add_work(), but waits at most timeout_ns for a full
+ * queue (see queue_capacity) to make room.
+ *
+ * @param  threadpool    threadpool to which the work will be added
+ * @param  job_uuid      unique job identifier
+ * @param  func_p        pointer to function to add as work
+ * @param  arg_p         pointer to an argument
+ * @param  timeout_ns    nanoseconds to wait, 0 is thpool_try_add_work(),
+ *                       negative waits forever
+ * @return 0 on success, -1 otherwise (errno ETIMEDOUT if the queue stayed full).
+ */
+int thpool_add_work_timed(threadpool, int job_uuid, th_func_p func_p, void* arg_p,
+                          long long timeout_ns);
+
+
+/**
+ * @brief Add work that is dropped unless it starts in time
+ *
+ * Same as thpool_add_work(), but if no worker starts the job within
+ * deadline_ns it is not run at all: it completes with result -ETIMEDOUT,
+ * through queue_out as usual.
+ *
+ * @example
+ *
+ *    //a status poll is useless once the next one is due
+ *    thpool_add_work_deadline(thpool, job_uuid, poll_drive, drive, 100000000LL);
+ *
+ * @param  threadpool    threadpool to which the work will be added
+ * @param  job_uuid      unique job identifier
+ * @param  func_p        pointer to function to add as work
+ * @param  arg_p         pointer to an argument
+ * @param  deadline_ns   nanoseconds from now to start by, 0 or less for none
+ * @return 0 on success, -1 otherwise.
+ */
+int thpool_add_work_deadline(threadpool, int job_uuid, th_func_p func_p, void* arg_p,
+                             long long deadline_ns);
+
+
+/**
+ * @brief Cancel work that has not started yet
+ *
+ * The oldest queued job with job_uuid is not run: it completes with
+ * result -ECANCELED instead, through its callback or queue_out as usual,
+ * so whoever waits on it is not left hanging.  A job already running is
+ * not interrupted.
+ *
+ * This looks through every queue of the pool, so it is meant for rare
+ * events such as a device going away, not for every job.
+ *
+ * @example
+ *
+ *    if (thpool_cancel(thpool, job_uuid) == 0)
+ *       thpool_wait_result(thpool, job_uuid, -1, &res);   //res is -ECANCELED
+ *
+ * @param  threadpool    threadpool the job was added to
+ * @param  job_uuid      unique job identifier
+ * @return 0 if a job was cancelled, -1 if none with job_uuid was queued
+ */
+int thpool_cancel(threadpool, int job_uuid);
+
+
+/**
+ * @brief Add work whose result is handed to a callback
+ *
+ * Same as thpool_add_work(), but once the job has run the worker calls
+ * done_p(job_uuid, result, done_arg_p) instead of putting the result in
+ * the output queue.  The callback runs on the worker thread, so keep it
+ * short and make it safe to call from any thread.
+ *
+ * @example
+ *
+ *    void on_done(int job_uuid, int result, void* ctx){
+ *       ..
+ *    }
+ *    ..
+ *    thpool_add_work_cb(thpool, job_uuid, task, arg, on_done, ctx);
+ *
+ * @param  threadpool    threadpool to which the work will be added
+ * @param  job_uuid      job identifier, passed back to done_p
+ * @param  func_p        pointer to function to add as work
+ * @param  arg_p         pointer to an argument
+ * @param  done_p        called with the job's result
+ * @param  done_arg_p    passed to done_p
+ * @return 0 on success, -1 otherwise.
+ */
+int thpool_add_work_cb(threadpool, int job_uuid, th_func_p func_p, void* arg_p,
+                       th_done_p done_p, void* done_arg_p);
+
+
+/**
+ * @brief Add work at a priority level
+ *
+ * Same as thpool_add_work(), but the job is queued at the given level.
+ * Idle workers take THPOOL_PRIO_HIGH jobs before anything else, and
+ * THPOOL_PRIO_LOW jobs only when nothing else is waiting, so a health
+ * check never sits behind a backlog of bulk work.  Lower levels still
+ * age in: 1 in 16 picks of a worker starts at NORMAL and 1 in 256 at
+ * LOW, so no level starves.
+ *
+ * HIGH and LOW jobs do not count against queue_capacity and never block.
+ *
+ * @example
+ *
+ *    thpool_add_work_prio(thpool, THPOOL_PRIO_HIGH, job_uuid, health_check, NULL);
+ *
+ * @param  threadpool    threadpool to which the work will be added
+ * @param  prio          THPOOL_PRIO_HIGH, THPOOL_PRIO_NORMAL or THPOOL_PRIO_LOW
+ * @param  job_uuid      unique job identifier
+ * @param  func_p        pointer to function to add as work
+ * @param  arg_p         pointer to an argument
+ * @return 0 on success, -1 otherwise.
+ */
+int thpool_add_work_prio(threadpool, int prio, int job_uuid, th_func_p func_p, void* arg_p);
+
+
+/**
+ * @brief Add work that runs in order with the other work of its key
+ *
+ * Same as thpool_add_work(), but jobs added with the same key run one
+ * at a time, in the order they were added, and on the same worker, so
+ * they need no lock of their own for the state they share and find it
+ * warm in that worker's cache.  Keys are hashed to 256 shards, so
+ * different keys may share a worker (and its order) too.
+ *
+ * Keyed jobs bypass priorities and queue_capacity and never block.  Jobs
+ * added while the pool has no workers at all are queued like any other
+ * job, in no particular order.
+ *
+ * @example
+ *
+ *    thpool_add_work_keyed(thpool, account_id, job_uuid, apply_transfer, transfer);
+ *
+ * @param  threadpool    threadpool to which the work will be added
+ * @param  key           jobs with equal keys run in order
+ * @param  job_uuid      unique job identifier
+ * @param  func_p        pointer to function to add as work
+ * @param  arg_p         pointer to an argument
+ * @return 0 on success, -1 otherwise.
+ */
+int thpool_add_work_keyed(threadpool, int key, int job_uuid, th_func_p func_p, void* arg_p);
+
+
+/**
+ * @brief Add a burst of work to the pool's input job queue
+ *
+ * Same as calling thpool_add_work() num_jobs times, but the jobs are
+ * allocated in one step and queued as a single chain under one lock, so
+ * the cost of a burst is paid once instead of once per job.
+ *
+ * @example
+ *
+ *    int        uuids[64];
+ *    th_func_p  funcs[64];
+ *    void*      args[64];
+ *    ..
+ *    thpool_add_work_batch(thpool, 64, uuids, funcs, args);
+ *    ..
+ *
+ * @param  threadpool    threadpool to which the work will be added
+ * @param  num_jobs      number of jobs in the arrays
+ * @param  job_uuids     unique job identifier for each job
+ * @param  func_ps       function to run for each job
+ * @param  arg_ps        argument for each job, NULL passes NULL to all
+ * @return 0 on success (all jobs added), -1 otherwise (no job added).
+ */
+int thpool_add_work_batch(threadpool, int num_jobs, const int job_uuids[],
+                          const th_func_p func_ps[], void* const arg_ps[]);
+
+
+/**
+ * @brief Add work and get a handle to its result
+ *
+ * Same as thpool_add_work(), but instead of a job_uuid to look the result
+ * up by, the caller gets a future that points straight at it: waiting,
+ * polling and reading the result never search queue_out, and results of
+ * futures never land there.  Futures can not be cancelled.
+ *
+ * Every future must be given back with thpool_future_release() exactly
+ * once, before thpool_destroy().  It may be released before its job has
+ * run; the job still runs and the pool frees it afterwards.
+ *
+ * @example
+ *
+ *    thpool_future* f = thpool_submit(thpool, task, arg);
+ *    ..
+ *    int res;
+ *    thpool_future_wait(f, -1, &res);
+ *    thpool_future_release(f);
+ *
+ * @param  threadpool    threadpool to which the work will be added
+ * @param  func_p        pointer to function to add as work
+ * @param  arg_p         pointer to an argument
+ * @return the future on success, NULL otherwise
+ */
+thpool_future* thpool_submit(threadpool, th_func_p func_p, void* arg_p);
+
+
+/**
+ * @brief Add a read, write or fsync of a file descriptor
+ *
+ * Queued like thpool_add_work(); the result is the number of bytes
+ * transferred (0 for THPOOL_IO_FSYNC) or -errno, and lands in queue_out
+ * under job_uuid.
+ *
+ * In a pool made with io_depth set, the worker that takes the job only
+ * submits it to its own io_uring and goes on with other jobs; the result
+ * is posted once the kernel completes it.  A few workers then keep up to
+ * io_depth I/Os each in flight.  Without io_uring (other systems, old
+ * kernels or kernel headers, io_depth 0) or with a worker's ring full,
+ * the worker does the I/O itself, as pread(), pwrite() or fsync().
+ *
+ * buf must stay valid until the result is in.  thpool_wait() and
+ * thpool_destroy() wait for I/O in flight.
+ *
+ * @example
+ *
+ *    config.io_depth = 64;
+ *    threadpool thpool = thpool_init_ex(&config);
+ *    ..
+ *    thpool_add_io(thpool, job_uuid, THPOOL_IO_READ, fd, buf, 4096, 0);
+ *    ..
+ *    thpool_wait_result(thpool, job_uuid, -1, &res);    //bytes read
+ *
+ * @param  threadpool    threadpool to which the work will be added
+ * @param  job_uuid      unique job identifier
+ * @param  op            THPOOL_IO_READ, THPOOL_IO_WRITE or THPOOL_IO_FSYNC
+ * @param  fd            file descriptor
+ * @param  buf           data to write or room to read into
+ * @param  len           bytes, at most INT_MAX
+ * @param  offset        file offset, -1 for the current file position
+ *                       (pipes, sockets)
+ * @return 0 on success, -1 otherwise.
+ */
+int thpool_add_io(threadpool, int job_uuid, int op, int fd, void* buf, unsigned int len, long long offset);
+
+
+/**
+ * @brief Add work that starts once other work has finished
+ *
+ * Same as thpool_submit(), but the job is only queued once the jobs of
+ * all futures in deps have finished.  The worker that finishes the last
+ * of them queues it on itself, so a chain of steps costs no trip back
+ * to the caller in between.  Deps that finished already count as done,
+ * and the returned future can be a dep of later work in turn, so any
+ * graph without cycles can be built.
+ *
+ * deps are only read during the call and may be released right after
+ * it.  A dep's result is not passed on; have the job read what it needs
+ * from arg_p.
+ *
+ * @example
+ *
+ *    thpool_future* format = thpool_submit(thpool, format_drive, drive);
+ *    thpool_future* verify = thpool_submit_after(thpool, &format, 1, verify_drive, drive);
+ *    thpool_future* steps[] = { format, verify };
+ *    thpool_future* log    = thpool_submit_after(thpool, steps, 2, read_log, drive);
+ *    ..
+ *    thpool_future_wait(log, -1, &res);
+ *
+ * @param  threadpool    threadpool to which the work will be added
+ * @param  deps          futures to wait for, none of them released yet
+ * @param  num_deps      number of futures in deps, 0 is thpool_submit()
+ * @param  func_p        pointer to function to add as work
+ * @param  arg_p         pointer to an argument
+ * @return the future on success, NULL otherwise
+ */
+thpool_future* thpool_submit_after(threadpool, thpool_future* const deps[], int num_deps,
+                                   th_func_p func_p, void* arg_p);
+
+
+/**
+ * @brief Run a function over a range of indexes in parallel
+ *
+ * Splits [begin, end) into chunks of grain indexes and calls
+ * func_p(chunk_begin, chunk_end, ctx) once per chunk, on the pool's
+ * workers and on the calling thread, which works along instead of
+ * sleeping.  Returns once every chunk is done.
+ *
+ * No job is made per chunk: the range is shared by at most one helper
+ * job per worker, and each of them (and the caller) takes the next
+ * chunk off an atomic counter until none are left.  Chunks run in no
+ * particular order, so func_p must not depend on one.  It may be
+ * called from inside a job, and works on a busy or paused pool too,
+ * with the caller doing more of the chunks itself.
+ *
+ * @example
+ *
+ *    void scale(long begin, long end, void* ctx){
+ *       float* buf = ctx;
+ *       for (long i = begin; i < end; i++)
+ *          buf[i] *= 0.5f;
+ *    }
+ *    ..
+ *    thpool_parallel_for(thpool, 0, len, 4096, scale, buf);
+ *
+ * @param  threadpool    threadpool to share the work with
+ * @param  begin         first index
+ * @param  end           one past the last index
+ * @param  grain         indexes per chunk, 0 or less picks about 8
+ *                       chunks per thread
+ * @param  func_p        called once per chunk
+ * @param  ctx           passed to func_p
+ * @return 0 on success, -1 otherwise (no index was run then)
+ */
+int thpool_parallel_for(threadpool, long begin, long end, long grain, th_range_p func_p, void* ctx);
+
+
+/**
+ * @brief Wait for the result of a future
+ *
+ * The caller sleeps until the worker that runs the job wakes it, and the
+ * worker only makes that system call if someone is actually waiting.  The
+ * result may be read any number of times until the future is released.
+ *
+ * @param  future        from thpool_submit()
+ * @param  timeout_ns    max time to wait in nsec; 0 only checks once,
+ *                       negative waits forever
+ * @param  result_p      returned result from function pointer execution
+ * @return 0 on success, -1 if the job did not complete in time
+ */
+int thpool_future_wait(thpool_future* future, long long timeout_ns, int* result_p);
+
+
+/**
+ * @brief Check whether the result of a future is in
+ *
+ * A single atomic load, for callers that do other work in between.
+ *
+ * @param  future        from thpool_submit()
+ * @return 1 if the job has completed, 0 otherwise
+ */
+int thpool_future_poll(thpool_future* future);
+
+
+/**
+ * @brief Give back a future
+ *
+ * The future must not be used again afterwards.
+ *
+ * @param  future        from thpool_submit(), NULL is ignored
+ * @return nothing
+ */
+void thpool_future_release(thpool_future* future);
+
+
 /**
  * @brief Searches for completed job and, if found, retrieves it's result
  *
  * Each job has a single result
  * Each job is identified by a specific job_uuid.
  * The result is the return value from the executed job's function pointer.
+ * Completed jobs are indexed by job_uuid, so a search costs the same no
+ * matter how many results are waiting in queue_out.  If several completed
+ * jobs share a job_uuid, the oldest one is returned first.
+ *
+ * The caller blocks (without polling) for up to
+ * retry_count_max * retry_interval_ns and is woken as soon as the job
+ * completes.  See thpool_wait_result() for a plain timeout.
  *
- * NOTICE: After thpool_add_work() is called, if this function is called too
- * soon, or the rety values are too small, the desired job_uuid may not
- * be found.
+ * NOTICE: After thpool_add_work() is called, if the rety values are too
+ * small, the desired job_uuid may not be found.
  *
  * @example
  *
@@ -109,6 +656,120 @@ int thpool_add_work(threadpool, int job_uuid, th_func_p func_p, void* arg_p);
 int thpool_find_result(threadpool, int job_uuid, int retry_count_max, int retry_interval_ns, int* result_p);
 
 
+/**
+ * @brief Waits for a job to complete and retrieves it's result
+ *
+ * Blocks until the job identified by job_uuid lands in queue_out or the
+ * timeout expires.  The calling thread sleeps at zero CPU and is woken by
+ * the worker that completes that particular job; completions of other jobs
+ * do not wake it.
+ *
+ * @example
+ *
+ *    ..
+ *    thpool_add_work(thpool, job_uuid, (void*)print_num, (void*)a);
+ *    ..
+ *    int res;
+ *    if (thpool_wait_result(thpool, job_uuid, 1000000000LL, &res) == 0)
+ *       printf("job returned %d\n", res);
+ *    ..
+ *
+ * @param  threadpool    threadpool the job was added to
+ * @param  job_uuid      unique job identifier to wait for in queue_out
+ * @param  timeout_ns    max time to wait in nsec; 0 only checks once,
+ *                       negative waits forever
+ * @param  result_p      returned result from function pointer execution
+ * @return 0 on success, -1 if the job did not complete in time
+ */
+int thpool_wait_result(threadpool, int job_uuid, long long timeout_ns, int* result_p);
+
+
+/**
+ * @brief Retrieves the results of all completed jobs, up to max_results
+ *
+ * Detaches up to max_results completed jobs from queue_out in a single
+ * lock round trip and copies out their uuids and results, oldest first.
+ * If no job has completed yet, waits until one does or the timeout expires.
+ *
+ * @example
+ *
+ *    int uuids[256], results[256];
+ *    ..
+ *    int n = thpool_collect_results(thpool, 256, uuids, results, -1);
+ *    for (i = 0; i < n; i++)
+ *       printf("job %d returned %d\n", uuids[i], results[i]);
+ *    ..
+ *
+ * @param  threadpool    threadpool to collect from
+ * @param  max_results   capacity of job_uuids and results
+ * @param  job_uuids     returned uuid of each collected job
+ * @param  results       returned result of each collected job
+ * @param  timeout_ns    max time to wait for a first result in nsec;
+ *                       0 does not wait, negative waits forever
+ * @return number of results collected, 0 if none completed in time
+ */
+int thpool_collect_results(threadpool, int max_results, int job_uuids[], int results[], long long timeout_ns);
+
+
+/**
+ * @brief Get an fd that is readable while results are waiting
+ *
+ * For event loops (epoll, poll, select) that must not block in
+ * thpool_wait_result().  The pool must be made with completion_fd set in
+ * its config.  Results that land close together share one wakeup: once
+ * the fd is readable, harvest with thpool_collect_results(), which also
+ * clears it and keeps it readable while results are left.
+ *
+ * @example
+ *
+ *    config.completion_fd = 1;
+ *    threadpool thpool = thpool_init_ex(&config);
+ *    ..
+ *    ev.events  = EPOLLIN;
+ *    ev.data.fd = thpool_completion_fd(thpool);
+ *    epoll_ctl(epfd, EPOLL_CTL_ADD, ev.data.fd, &ev);
+ *    ..
+ *    //when epoll reports it readable:
+ *    n = thpool_collect_results(thpool, 64, uuids, results, 0);
+ *
+ * @param  threadpool    threadpool to watch
+ * @return the fd (owned by the pool, closed by thpool_destroy()),
+ *         -1 with errno ENOSYS if the pool has none
+ */
+int thpool_completion_fd(threadpool);
+
+
+/**
+ * @brief Get the pool's job counters and latency percentiles
+ *
+ * Each job is timestamped when added, started, finished and collected
+ * (by thpool_wait_result(), thpool_find_result() or
+ * thpool_collect_results()).  Workers record the gaps in histograms of
+ * their own that are only ever added to, so keeping metrics costs a few
+ * clock reads per job, and taking a snapshot locks nothing.  Percentiles
+ * are accurate to within 1/8 of their value.
+ *
+ * io_submitted and io_inline split thpool_add_io() jobs by who did the
+ * I/O, the kernel through a worker's io_uring or the worker itself.
+ * io_rings counts the workers whose io_uring passed its checks.
+ *
+ * Build with -DDISABLE_METRICS to take out the timestamps and histograms
+ * altogether; only jobs_queued, results_waiting and io_rings are filled
+ * in then.
+ *
+ * @example
+ *
+ *    thpool_stats stats;
+ *    thpool_get_stats(thpool, &stats);
+ *    printf("p99 wait for a worker: %lluns\n", stats.queue_wait.p99_ns);
+ *
+ * @param  threadpool    threadpool of interest
+ * @param  stats         filled in with the snapshot
+ * @return 0 on success, -1 otherwise (or if built with DISABLE_METRICS)
+ */
+int thpool_get_stats(threadpool, thpool_stats* stats);
+
+
 /**
  * @brief Wait for all queued input jobs to finish
  *
@@ -140,11 +801,13 @@ void thpool_wait(threadpool);
 
 
 /**
- * @brief Pauses all threads immediately
+ * @brief Pauses all threads
  *
- * The threads will be paused no matter if they are idle or working.
- * The threads return to their previous states once thpool_resume
- * is called.
+ * Returns once threads that were about to start a job have started
+ * it.  From then on no thread starts a job until thpool_resume is
+ * called; jobs already running finish undisturbed.  Queued jobs stay
+ * queued, where thpool_cancel can still reach them.  No signals are
+ * involved, so system calls in jobs are not interrupted.
  *
  * While the thread is being paused, new work can be added.
  *
@@ -166,6 +829,8 @@ void thpool_pause(threadpool);
 /**
  * @brief Unpauses all threads if they are paused
  *
+ * All held threads are woken at once.
+ *
  * @example
  *    ..
  *    thpool_pause(thpool);
@@ -183,7 +848,9 @@ void thpool_resume(threadpool);
  * @brief Destroy the threadpool
  *
  * This will wait for the currently active threads to finish and then 'kill'
- * the whole threadpool to free up memory.
+ * the whole threadpool to free up memory.  Jobs that have not started are
+ * not run.  Those added with a callback get it with -ECANCELED, on the
+ * calling thread, and must not use the pool from there.
  *
  * @example
  * int main() {